@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <memory>
 #include <string>
 
@@ -71,6 +72,55 @@ class ApiManager {
                                          std::string *out_buf,
                                          const Config &config) = 0;
 
+    /**
+     * Serializes a query string into its canonical form, so that equivalent
+     * query strings can share a cache entry.
+     * @param query Query string.
+     * @return The canonical query string.
+     */
+    virtual std::string canonical_query(const std::string &query) = 0;
+
+    /**
+     * Set the maximum size of the cache of rasterized masks (`&mask=`), which
+     * is shared by all requests within the process.
+     * @param max_size The maximum size, in bytes. 0 disables the cache.
+     */
+    virtual void set_mask_cache_size(size_t max_size) = 0;
+
+    /**
+     * Rasterize and cache the mask of a query ahead of time.
+     * @param query Query string, e.g. `mask=circle`.
+     * @param width Width of the images to mask.
+     * @param height Height of the images to mask.
+     * @return A Status object to represent an error or an OK state.
+     */
+    virtual utils::Status preload_mask(const std::string &query, int width,
+                                       int height) = 0;
+
+    /**
+     * Set the maximum number of multi-page TIFF images of which the page
+     * layout is cached, so that the pages of an image requested again needn't
+     * be rediscovered. Only sources with an identity are cached, see
+     * io::SourceInterface::identity. The cache is shared by all requests
+     * within the process.
+     * @param max_entries The maximum number of images. 0 disables the cache.
+     */
+    virtual void set_pyramid_cache_size(size_t max_entries) = 0;
+
+    /**
+     * Set the maximum number of downscaled copies of images that are cached,
+     * so that an attention or entropy crop (`&a=attention`, `&a=entropy`) of
+     * an image requested again, at any size, is searched on the cached copy
+     * instead of analysing the image again. Copies are downscaled to
+     * Config::smartcrop_size, or 256 pixels if that's unset. With the cache,
+     * a focal crop (`&a=focal`) without a focal point crops to the most
+     * interesting window too. Only sources with an identity are cached, see
+     * io::SourceInterface::identity. The cache is shared by all requests
+     * within the process.
+     * @param max_entries The maximum number of copies. 0 disables the cache.
+     */
+    virtual void set_saliency_cache_size(size_t max_entries) = 0;
+
  protected:
     ApiManager() = default;
 };
@@ -16,7 +16,7 @@ struct Config {
           limit_output_pixels(71000000), max_pages(256), quality(80),
           avif_quality(80), jpeg_quality(80), tiff_quality(80),
           webp_quality(80), avif_effort(4), gif_effort(7), webp_effort(4),
-          zlib_level(6), fail_on_error(0) {}
+          zlib_level(6), fail_on_error(0), trim_preview(0), smartcrop_size(0) {}
 
     /**
      * Enables or disables image savers to be used within the `&output=` query
@@ -133,6 +133,23 @@ struct Config {
      * weserv_fail_on_error off;
      */
     intptr_t fail_on_error;
+
+    /**
+     * Find the bounding box of `&trim=` on a downscaled preview, so that JPEG
+     * and WebP images can still be shrunk on load. The trim is then accurate
+     * to the scale the image is shrunk to, rather than to the pixel.
+     * Defaults to `off`.
+     * weserv_trim_preview off;
+     */
+    intptr_t trim_preview;
+
+    /**
+     * Search the window of `&a=entropy` and `&a=attention` on a downscaled
+     * copy of the image, of which the longest side is at most this size.
+     * Defaults to 0, i.e. search at full resolution.
+     * weserv_smartcrop_size 0;
+     */
+    intptr_t smartcrop_size;
 };
 
 }  // namespace weserv::api
@@ -2,6 +2,7 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <string>
 
 namespace weserv::api::io {
 
@@ -26,6 +27,15 @@ class SourceInterface {
      * @return Offset of the pointer or -1 on error.
      */
     virtual int64_t seek(int64_t offset, int whence) = 0;
+
+    /**
+     * Identify the content of the source across requests, e.g. by the URL of
+     * the origin and its validators. Must change whenever the content does.
+     * @return The identity of the source, or an empty string if unknown.
+     */
+    virtual std::string identity() const {
+        return "";
+    }
 };
 
 }  // namespace weserv::api::io
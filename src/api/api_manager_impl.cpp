@@ -4,26 +4,18 @@
 #include "exceptions/large.h"
 #include "exceptions/unreadable.h"
 #include "exceptions/unsupported.h"
+#include "io/page_index.h"
 
 #include "parsers/query.h"
 
 #include "processors/alignment.h"
-#include "processors/background.h"
-#include "processors/blur.h"
-#include "processors/brightness.h"
-#include "processors/contrast.h"
 #include "processors/crop.h"
-#include "processors/embed.h"
-#include "processors/filter.h"
-#include "processors/gamma.h"
 #include "processors/mask.h"
-#include "processors/modulate.h"
 #include "processors/orientation.h"
-#include "processors/rotation.h"
-#include "processors/sharpen.h"
+#include "processors/pipeline.h"
+#include "processors/saliency.h"
 #include "processors/stream.h"
 #include "processors/thumbnail.h"
-#include "processors/tint.h"
 #include "processors/trim.h"
 
 #include "utils/utility.h"
@@ -164,39 +156,34 @@ Status ApiManagerImpl::process(const std::string &query,
     auto trim = processors::Trim(query_holder, config);
     auto thumbnail = processors::Thumbnail(query_holder, config);
     auto orientation = processors::Orientation(query_holder, config);
-    auto alignment = processors::Alignment(query_holder, config);
+    auto alignment =
+        processors::Alignment(query_holder, config, source.identity());
     auto crop = processors::Crop(query_holder, config);
-    auto embed = processors::Embed(query_holder, config);
-    auto rotation = processors::Rotation(query_holder, config);
-    auto brightness = processors::Brightness(query_holder, config);
-    auto modulate = processors::Modulate(query_holder, config);
-    auto contrast = processors::Contrast(query_holder, config);
-    auto gamma = processors::Gamma(query_holder, config);
-    auto sharpen = processors::Sharpen(query_holder, config);
-    auto filter = processors::Filter(query_holder, config);
-    auto blur = processors::Blur(query_holder, config);
-    auto tint = processors::Tint(query_holder, config);
-    auto background = processors::Background(query_holder, config);
-    auto mask = processors::Mask(query_holder, config);
+    auto pipeline = processors::Pipeline(query_holder, config);
 
     // Create image from a source
     auto image = stream.new_from_source(source);
 
+    // Trimming can be combined with shrink-on-load, if enabled
+    auto trim_on_load = !precrop && thumbnail.can_trim_on_load();
+
     // Image processing phase 1 (make sure trimming is done first)
-    image = image | trim;
+    if (!trim_on_load) {
+        image = image | trim;
+    }
 
     // Image processing phase 2 (size, crop, etc.)
     if (precrop) {
         image = image | orientation | crop | thumbnail | alignment;
     } else {
         // The very fast shrink-on-load tricks are possible
-        image = thumbnail.shrink_on_load(image, source);
+        image = trim_on_load ? thumbnail.trim_on_load(image, source, trim)
+                             : thumbnail.shrink_on_load(image, source);
         image = image | thumbnail | orientation | alignment | crop;
     }
 
-    // Image processing phase 3 (adjustments, effects, etc.)
-    image = image | embed | rotation | brightness | modulate | contrast |
-            gamma | sharpen | filter | blur | tint | background | mask;
+    // Image processing phase 3 (embed, adjustments, effects, etc.)
+    image = image | pipeline;
 
     // Write the image to a target
     stream.write_to_target(image, target);
@@ -274,4 +261,48 @@ Status ApiManagerImpl::process_buffer(const std::string &query,
     }
 }
 
+std::string ApiManagerImpl::canonical_query(const std::string &query) {
+    return parsers::Query(query).to_string();
+}
+
+void ApiManagerImpl::set_mask_cache_size(size_t max_size) {
+    processors::Mask::set_cache_size(max_size);
+}
+
+Status ApiManagerImpl::preload_mask(const std::string &query, int width,
+                                    int height) {
+    try {
+        auto query_holder = std::make_unique<parsers::Query>(query);
+
+        // Masks are preloaded for single-page images
+        query_holder->update("n", 1);
+
+        // The processor keeps a reference to the configuration, which must
+        // outlive it
+        Config config;
+        auto mask = processors::Mask(query_holder, config);
+        if (!mask.active()) {
+            return {Status::Code::InvalidUri, "Query doesn't specify a mask",
+                    Status::ErrorCause::Application};
+        }
+
+        mask.preload(width, height);
+
+        // Clean up libvips' per-request data and threads
+        clean_up();
+
+        return Status::OK;
+    } catch (...) {
+        return exception_handler(query);
+    }
+}
+
+void ApiManagerImpl::set_pyramid_cache_size(size_t max_entries) {
+    io::PageIndex::set_cache_size(max_entries);
+}
+
+void ApiManagerImpl::set_saliency_cache_size(size_t max_entries) {
+    processors::Saliency::set_cache_size(max_entries);
+}
+
 }  // namespace weserv::api
@@ -36,6 +36,17 @@ class ApiManagerImpl : public ApiManager {
                                  std::string *out_buf,
                                  const Config &config) override;
 
+    std::string canonical_query(const std::string &query) override;
+
+    void set_mask_cache_size(size_t max_size) override;
+
+    utils::Status preload_mask(const std::string &query, int width,
+                               int height) override;
+
+    void set_pyramid_cache_size(size_t max_entries) override;
+
+    void set_saliency_cache_size(size_t max_entries) override;
+
  private:
     /**
      * Clean up libvips' per-request data and threads.
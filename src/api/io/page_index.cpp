@@ -0,0 +1,295 @@
+#include "page_index.h"
+
+#include "../utils/lru_cache.h"
+#include "../utils/utility.h"
+
+#include <cstring>
+#include <string>
+
+namespace weserv::api::io {
+
+using enums::ImageType;
+using vips::VImage;
+
+namespace {
+
+/**
+ * The key under which the index is attached to the source.
+ */
+constexpr const char *PAGE_INDEX_KEY = "weserv-page-index";
+
+/**
+ * TIFF tags of the image dimensions.
+ */
+constexpr uint16_t TIFF_TAG_IMAGE_WIDTH = 256;
+constexpr uint16_t TIFF_TAG_IMAGE_LENGTH = 257;
+
+/**
+ * TIFF field types of the image dimensions.
+ */
+constexpr uint16_t TIFF_TYPE_SHORT = 3;
+constexpr uint16_t TIFF_TYPE_LONG = 4;
+constexpr uint16_t TIFF_TYPE_LONG8 = 16;
+
+/**
+ * Bounds the size of an IFD we're willing to read, a typical IFD has less
+ * than 30 entries.
+ */
+constexpr uint64_t TIFF_MAX_ENTRIES = 4096;
+
+/**
+ * Reads exactly length bytes at the given offset.
+ */
+bool read_at(VipsSource *source, uint64_t offset, unsigned char *data,
+             size_t length) {
+    if (vips_source_seek(source, static_cast<gint64>(offset), SEEK_SET) < 0) {
+        return false;
+    }
+
+    while (length > 0) {
+        gint64 bytes_read = vips_source_read(source, data, length);
+        if (bytes_read <= 0) {
+            return false;
+        }
+
+        data += bytes_read;
+        length -= static_cast<size_t>(bytes_read);
+    }
+
+    return true;
+}
+
+/**
+ * Decodes an unsigned integer of the given number of bytes.
+ */
+uint64_t read_uint(const unsigned char *data, size_t length,
+                   bool big_endian) {
+    uint64_t value = 0;
+
+    for (size_t i = 0; i < length; ++i) {
+        size_t shift = big_endian ? length - 1 - i : i;
+        value |= static_cast<uint64_t>(data[i]) << (shift * 8);
+    }
+
+    return value;
+}
+
+/**
+ * A process-wide cache of page indexes, keyed by the identity of the source.
+ */
+utils::LruCache<std::vector<PageGeometry>> &page_index_cache() {
+    static utils::LruCache<std::vector<PageGeometry>> cache;
+    return cache;
+}
+
+}  // namespace
+
+void PageIndex::set_cache_size(size_t max_entries) {
+    page_index_cache().set_max_size(max_entries);
+}
+
+size_t PageIndex::cache_hits() {
+    return page_index_cache().hits();
+}
+
+PageIndex &PageIndex::of(const Source &source) {
+    auto *object = G_OBJECT(source.get_source());
+
+    auto *index =
+        static_cast<PageIndex *>(g_object_get_data(object, PAGE_INDEX_KEY));
+    if (index == nullptr) {
+        index = new PageIndex();
+        g_object_set_data_full(object, PAGE_INDEX_KEY, index, [](gpointer p) {
+            delete static_cast<PageIndex *>(p);
+        });
+    }
+
+    return *index;
+}
+
+void PageIndex::build(const Source &source, const VImage &image,
+                      ImageType image_type) {
+    int n_pages = image.get_typeof(VIPS_META_N_PAGES) != 0
+                      ? image.get_int(VIPS_META_N_PAGES)
+                      : 1;
+    PageGeometry first{image.width(), utils::get_page_height(image)};
+
+    if (n_pages > 1 && image_type == ImageType::Tiff) {
+        auto &cache = page_index_cache();
+        auto identity = source.identity();
+
+        if (!identity.empty() && cache.find(identity, &pages_) &&
+            agrees(pages_, n_pages, first)) {
+            return;
+        }
+
+        pages_ = read_tiff_pages(source, n_pages);
+
+        // Only trust the IFD chain if it agrees with the loader
+        if (agrees(pages_, n_pages, first)) {
+            if (!identity.empty()) {
+                cache.insert(identity, pages_);
+            }
+
+            return;
+        }
+    }
+
+    if (image_type == ImageType::Gif || image_type == ImageType::Webp) {
+        // Every frame is rendered onto the canvas
+        pages_.assign(n_pages, first);
+    } else {
+        pages_.assign(n_pages, PageGeometry{0, 0});
+        pages_[0] = first;
+    }
+}
+
+bool PageIndex::agrees(const std::vector<PageGeometry> &pages, int n_pages,
+                       const PageGeometry &first) {
+    return static_cast<int>(pages.size()) == n_pages &&
+           pages[0].width == first.width && pages[0].height == first.height;
+}
+
+PageGeometry PageIndex::page(int page, const Loader &loader) {
+    auto &geometry = pages_[page];
+
+    if (geometry.width == 0) {
+        auto image = loader(page);
+
+        geometry = {image.width(), image.height()};
+    }
+
+    return geometry;
+}
+
+std::vector<PageGeometry> PageIndex::read_tiff_pages(const Source &source,
+                                                     int n_pages) {
+    VipsSource *vips_source = source.get_source();
+
+    std::vector<PageGeometry> pages;
+
+    unsigned char header[16];
+    if (!read_at(vips_source, 0, header, 8)) {
+        vips_source_rewind(vips_source);
+        return pages;
+    }
+
+    bool big_endian;
+    if (std::memcmp(header, "II", 2) == 0) {
+        big_endian = false;
+    } else if (std::memcmp(header, "MM", 2) == 0) {
+        big_endian = true;
+    } else {
+        vips_source_rewind(vips_source);
+        return pages;
+    }
+
+    auto version = read_uint(header + 2, 2, big_endian);
+    bool big_tiff = version == 43;
+
+    uint64_t offset;
+    if (big_tiff) {
+        if (!read_at(vips_source, 8, header + 8, 8)) {
+            vips_source_rewind(vips_source);
+            return pages;
+        }
+
+        offset = read_uint(header + 8, 8, big_endian);
+    } else if (version == 42) {
+        offset = read_uint(header + 4, 4, big_endian);
+    } else {
+        vips_source_rewind(vips_source);
+        return pages;
+    }
+
+    // The sizes of the entry count, an entry and the next IFD offset
+    size_t count_size = big_tiff ? 8 : 2;
+    size_t entry_size = big_tiff ? 20 : 12;
+    size_t offset_size = big_tiff ? 8 : 4;
+
+    std::vector<unsigned char> ifd;
+
+    while (offset != 0) {
+        // More pages than the loader found, or a cycle in the chain
+        if (static_cast<int>(pages.size()) == n_pages) {
+            pages.clear();
+            break;
+        }
+
+        unsigned char count_data[8];
+        if (!read_at(vips_source, offset, count_data, count_size)) {
+            pages.clear();
+            break;
+        }
+
+        uint64_t n_entries = read_uint(count_data, count_size, big_endian);
+        if (n_entries == 0 || n_entries > TIFF_MAX_ENTRIES) {
+            pages.clear();
+            break;
+        }
+
+        ifd.resize(n_entries * entry_size + offset_size);
+        if (!read_at(vips_source, offset + count_size, ifd.data(),
+                     ifd.size())) {
+            pages.clear();
+            break;
+        }
+
+        PageGeometry geometry{0, 0};
+
+        for (uint64_t i = 0; i < n_entries; ++i) {
+            const unsigned char *entry = ifd.data() + i * entry_size;
+
+            auto tag = read_uint(entry, 2, big_endian);
+            if (tag != TIFF_TAG_IMAGE_WIDTH && tag != TIFF_TAG_IMAGE_LENGTH) {
+                continue;
+            }
+
+            // The value is stored inline, after the type and count
+            auto type = read_uint(entry + 2, 2, big_endian);
+            const unsigned char *value = entry + 4 + offset_size;
+
+            uint64_t dimension;
+            if (type == TIFF_TYPE_SHORT) {
+                dimension = read_uint(value, 2, big_endian);
+            } else if (type == TIFF_TYPE_LONG) {
+                dimension = read_uint(value, 4, big_endian);
+            } else if (type == TIFF_TYPE_LONG8 && big_tiff) {
+                dimension = read_uint(value, 8, big_endian);
+            } else {
+                continue;
+            }
+
+            if (dimension > static_cast<uint64_t>(VIPS_MAX_COORD)) {
+                continue;
+            }
+
+            if (tag == TIFF_TAG_IMAGE_WIDTH) {
+                geometry.width = static_cast<int>(dimension);
+            } else {
+                geometry.height = static_cast<int>(dimension);
+            }
+        }
+
+        if (geometry.width == 0 || geometry.height == 0) {
+            pages.clear();
+            break;
+        }
+
+        pages.push_back(geometry);
+
+        offset = read_uint(ifd.data() + n_entries * entry_size, offset_size,
+                           big_endian);
+    }
+
+    if (static_cast<int>(pages.size()) != n_pages) {
+        pages.clear();
+    }
+
+    // Leave the source as we found it for the next load
+    vips_source_rewind(vips_source);
+
+    return pages;
+}
+
+}  // namespace weserv::api::io
@@ -0,0 +1,143 @@
+#pragma once
+
+#include "../enums.h"
+#include "source.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <vips/vips8>
+
+namespace weserv::api::io {
+
+/**
+ * The dimensions of a page, zero if not yet known.
+ */
+struct PageGeometry {
+    int width;
+    int height;
+};
+
+/**
+ * The dimensions of the pages of an image, built once per source so that
+ * page selection and pyramid detection don't need to run the loader for
+ * each page.
+ */
+class PageIndex {
+ public:
+    /**
+     * Load the given page of the image, used for the pages whose dimensions
+     * can't be read from the container.
+     */
+    using Loader = std::function<vips::VImage(int page)>;
+
+    /**
+     * Get the index attached to a source, creating an empty one if needed.
+     * The index lives as long as the source.
+     * @param source The source of the image.
+     * @return The index of the source.
+     */
+    static PageIndex &of(const Source &source);
+
+    /**
+     * Set the maximum number of indexes that are kept across requests, for
+     * sources that can be identified. Only indexes read from the container
+     * are kept, i.e. those of multi-page TIFF images.
+     * @param max_entries The maximum number of indexes. 0 disables the cache.
+     */
+    static void set_cache_size(size_t max_entries);
+
+    /**
+     * @return The number of indexes taken from the cache since the process
+     *         started.
+     */
+    static size_t cache_hits();
+
+    /**
+     * Build the index from the first page of the image. The dimensions of
+     * TIFF pages are read from the IFD chain, or from the cache if the source
+     * was indexed before, and GIF and WebP frames are rendered at the size of
+     * the canvas. Any other page is loaded on demand.
+     * @param source The source of the image.
+     * @param image The first page of the image.
+     * @param image_type The type of the image.
+     */
+    void build(const Source &source, const vips::VImage &image,
+               enums::ImageType image_type);
+
+    /**
+     * Whether the index has been built.
+     */
+    bool built() const {
+        return !pages_.empty();
+    }
+
+    /**
+     * The number of pages in the image.
+     */
+    int n_pages() const {
+        return static_cast<int>(pages_.size());
+    }
+
+    /**
+     * Get the dimensions of a page.
+     * @param page The page number.
+     * @param loader Used if the dimensions of the page aren't known yet.
+     * @return The dimensions of the page.
+     */
+    PageGeometry page(int page, const Loader &loader);
+
+    /**
+     * Find the first page whose area compares best with the given
+     * comparison function, e.g. the largest page for `std::greater<>`.
+     * @tparam Comparator Comparison type.
+     * @param loader Used for the pages whose dimensions aren't known yet.
+     * @param comp Comparison function object.
+     * @return The page number.
+     */
+    template <typename Comparator>
+    int find(const Loader &loader, Comparator comp) {
+        uint64_t size = area(page(0, loader));
+
+        int target_page = 0;
+
+        for (int i = 1; i < n_pages(); ++i) {
+            uint64_t page_size = area(page(i, loader));
+
+            if (comp(page_size, size)) {
+                target_page = i;
+                size = page_size;
+            }
+        }
+
+        return target_page;
+    }
+
+ private:
+    static uint64_t area(const PageGeometry &geometry) {
+        return static_cast<uint64_t>(geometry.width) * geometry.height;
+    }
+
+    /**
+     * Whether an index agrees with the number of pages and the first page
+     * reported by the loader.
+     */
+    static bool agrees(const std::vector<PageGeometry> &pages, int n_pages,
+                       const PageGeometry &first);
+
+    /**
+     * Walk the IFD chain of a (Big)TIFF image.
+     * @param source The source of the image.
+     * @param n_pages The number of pages reported by the loader.
+     * @return The dimensions of each page, or an empty vector if the IFD
+     *         chain can't be read or disagrees with the loader.
+     */
+    static std::vector<PageGeometry> read_tiff_pages(const Source &source,
+                                                     int n_pages);
+
+    std::vector<PageGeometry> pages_;
+};
+
+}  // namespace weserv::api::io
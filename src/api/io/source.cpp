@@ -85,4 +85,15 @@ Source Source::new_from_buffer(const std::string &buffer) {
     return Source(source);
 }
 
+std::string Source::identity() const {
+    VipsSource *source = get_source();
+
+    // Only sources of the API user can be identified
+    if (!WESERV_IS_STREAM_INPUT(source)) {
+        return "";
+    }
+
+    return WESERV_SOURCE(source)->source->identity();
+}
+
 }  // namespace weserv::api::io
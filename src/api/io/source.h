@@ -64,6 +64,12 @@ class Source : public vips::VSource {
      * @return A new Source class.
      */
     static Source new_from_buffer(const std::string &buffer);
+
+    /**
+     * Identify the content of the source across requests.
+     * @return The identity of the source, or an empty string if unknown.
+     */
+    std::string identity() const;
 };
 
 }  // namespace weserv::api::io
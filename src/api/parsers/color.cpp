@@ -203,6 +203,14 @@ std::string Color::to_string() const {
     return ss.str();
 }
 
+std::string Color::to_hex() const {
+    std::ostringstream ss;
+    ss << std::hex << std::setfill('0') << std::setw(2) << alpha_
+       << std::setw(2) << red_ << std::setw(2) << green_ << std::setw(2)
+       << blue_;
+    return ss.str();
+}
+
 template <>
 Color parse(const std::string &value) {
     // Default to transparent
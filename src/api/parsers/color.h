@@ -50,6 +50,17 @@ class Color {
      */
     std::string to_string() const;
 
+    /**
+     * Color to hexadecimal string, as accepted by parse<Color>.
+     * @return The AARRGGBB color as string representation.
+     */
+    std::string to_hex() const;
+
+    bool operator==(const Color &other) const {
+        return alpha_ == other.alpha_ && red_ == other.red_ &&
+               green_ == other.green_ && blue_ == other.blue_;
+    }
+
  private:
     int alpha_{0};
     int red_{0};
@@ -16,6 +16,14 @@ int Coordinate::to_pixels(int base) const {
     return std::get<int>(value_);
 }
 
+std::string Coordinate::to_string() const {
+    if (const auto *relative_coord = std::get_if<float>(&value_)) {
+        return format_float(*relative_coord * 100.0F) + "%";
+    }
+
+    return std::to_string(std::get<int>(value_));
+}
+
 template <>
 Coordinate parse(const std::string &value) {
     if (value.empty()) {
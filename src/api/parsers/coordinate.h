@@ -2,6 +2,7 @@
 
 #include "base.h"
 
+#include <string>
 #include <variant>
 
 namespace weserv::api::parsers {
@@ -26,6 +27,16 @@ class Coordinate {
      */
     int to_pixels(int base) const;
 
+    /**
+     * Coordinate to string, as accepted by parse<Coordinate>.
+     * @return The coordinate in pixels, or as percentage.
+     */
+    std::string to_string() const;
+
+    bool operator==(const Coordinate &other) const {
+        return value_ == other.value_;
+    }
+
  private:
     std::variant<int, float> value_{-1};
 };
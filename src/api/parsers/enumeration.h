@@ -145,9 +145,10 @@ inline enums::Output parse(const std::string &value) {
     if (value == "json") {
         return enums::Output::Json;
     }
-    // if (value == "origin")
+    // if (value == "origin" || value == "auto")
 
-    // Honor the origin image format by default
+    // Honor the origin image format by default, `auto` is negotiated by the
+    // nginx module
     return enums::Output::Origin;
 }
 
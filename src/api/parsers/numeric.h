@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdio>
+#include <cstdlib>
 #include <stdexcept>
 #include <string>
 
@@ -25,4 +27,23 @@ inline float parse<float>(const std::string &value) {
     return result;
 }
 
+/**
+ * Formats a float with the fewest digits that parse back to the same value,
+ * e.g. `300` instead of `300.000000`.
+ */
+inline std::string format_float(float value) {
+    char buf[32];
+
+    for (int precision = 6; precision <= 9; ++precision) {
+        std::snprintf(buf, sizeof(buf), "%.*g", precision,
+                      static_cast<double>(value));
+
+        if (std::strtof(buf, nullptr) == value) {
+            break;
+        }
+    }
+
+    return buf;
+}
+
 }  // namespace weserv::api::parsers
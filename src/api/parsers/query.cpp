@@ -4,6 +4,11 @@
 #include "enumeration.h"
 #include "numeric.h"
 
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <map>
+
 #include <weserv/enums.h>
 
 namespace weserv::api::parsers {
@@ -102,6 +107,149 @@ const NginxKeySet &nginx_keys = {
 };
 // clang-format on
 
+namespace {
+
+using Predicate = std::function<bool(const Query::QueryVariant &)>;
+
+/**
+ * Matches the given default value.
+ */
+template <typename T>
+Predicate omit_equal(T def) {
+    return [def](const Query::QueryVariant &v) {
+        const auto *val = std::get_if<T>(&v);
+        return val != nullptr && *val == def;
+    };
+}
+
+/**
+ * Matches the given default value, or any value outside [min, max] that the
+ * processors replace by this default.
+ */
+template <typename T>
+Predicate omit_outside(T def, T min, T max = std::numeric_limits<T>::max()) {
+    return [def, min, max](const Query::QueryVariant &v) {
+        const auto *val = std::get_if<T>(&v);
+        return val != nullptr && (*val == def || *val < min || *val > max);
+    };
+}
+
+/**
+ * Matches a dimension that's clamped to zero, i.e. an automatic one.
+ */
+bool omit_dimension(const Query::QueryVariant &v) {
+    const auto *val = std::get_if<Coordinate>(&v);
+    return val != nullptr && val->to_pixels(VIPS_MAX_COORD) <= 0;
+}
+
+/**
+ * Matches the default (transparent) color.
+ */
+bool omit_color(const Query::QueryVariant &v) {
+    const auto *val = std::get_if<Color>(&v);
+    return val != nullptr && *val == Color::DEFAULT;
+}
+
+}  // namespace
+
+// Values that are equivalent to omitting the parameter, keep in sync with the
+// defaults and checks of the processors.
+// clang-format off
+const std::unordered_map<std::string, Predicate> &omit_map = {
+    {"w",       omit_dimension},
+    {"h",       omit_dimension},
+    {"dpr",     omit_outside(1.0F, 0.0F, 8.0F)},
+    {"fit",     omit_equal(static_cast<int>(Canvas::Max))},
+    {"we",      omit_equal(false)},
+    {"precrop", omit_equal(false)},
+    {"a",       omit_equal(static_cast<int>(Position::Center))},
+    {"fpx",     omit_outside(0.5F, 0.0F, 1.0F)},
+    {"fpy",     omit_outside(0.5F, 0.0F, 1.0F)},
+    {"mask",    omit_equal(static_cast<int>(MaskType::None))},
+    {"mtrim",   omit_equal(false)},
+    {"mbg",     omit_color},
+    {"ro",      omit_equal(0)},
+    {"flip",    omit_equal(false)},
+    {"flop",    omit_equal(false)},
+    {"bri",     omit_outside(0, -100, 100)},
+    {"mod",     omit_outside(1.0F, 0.0F, 10000.0F)},
+    {"sat",     omit_outside(1.0F, 0.0F, 10000.0F)},
+    {"hue",     omit_equal(0)},
+    {"con",     omit_outside(0, -100, 100)},
+    {"gam",     omit_equal(0.0F)},
+    {"sharp",   omit_equal(0.0F)},
+    {"sharpf",  omit_outside(1.0F, 0.0F, 1000000.0F)},
+    {"sharpj",  omit_outside(2.0F, 0.0F, 1000000.0F)},
+    {"trim",    omit_outside(0, 1, 254)},
+    {"blur",    omit_equal(0.0F)},
+    {"filt",    omit_equal(static_cast<int>(FilterType::None))},
+    {"bg",      omit_color},
+    {"cbg",     omit_color},
+    {"rbg",     omit_color},
+    {"tint",    omit_color},
+    {"q",       omit_outside(0, 1, 100)},
+    {"l",       omit_outside(-1, 0, 9)},
+    {"output",  omit_equal(static_cast<int>(Output::Origin))},
+    {"il",      omit_equal(false)},
+    {"ll",      omit_equal(false)},
+    {"af",      omit_equal(false)},
+    {"page",    omit_outside(0, -2)},
+    {"n",       [](const Query::QueryVariant &v) {
+                    // 0 and anything below -1 (all pages) are invalid
+                    int n = std::get<int>(v);
+                    return n == 1 || n == 0 || n < -1;
+                }},
+    {"loop",    omit_outside(-1, 0)},
+    {"delay",   [](const Query::QueryVariant &v) {
+                    const auto &delays = std::get<std::vector<int>>(v);
+                    return delays.empty() ||
+                           std::any_of(delays.begin(), delays.end(),
+                                       [](int d) { return d < 0; });
+                }},
+    {"fsol",    omit_equal(true)},  // FAST_SHRINK_ON_LOAD
+};
+// clang-format on
+
+/**
+ * Formats a parsed value, the key is written on its own if it's empty.
+ */
+struct ValueFormatter {
+    std::string operator()(bool value) const {
+        return value ? "" : "0";
+    }
+
+    std::string operator()(int value) const {
+        return std::to_string(value);
+    }
+
+    std::string operator()(float value) const {
+        return format_float(value);
+    }
+
+    std::string operator()(const Color &value) const {
+        return value.to_hex();
+    }
+
+    std::string operator()(const Coordinate &value) const {
+        return value.to_string();
+    }
+
+    template <typename T>
+    std::string operator()(const std::vector<T> &values) const {
+        std::string out;
+
+        for (const auto &value : values) {
+            if (!out.empty()) {
+                out += ',';
+            }
+
+            out += (*this)(value);
+        }
+
+        return out;
+    }
+};
+
 template <typename T>
 std::vector<T> Query::tokenize(const std::string &data,
                                const std::string &delimiters,
@@ -291,4 +439,34 @@ Query::Query(const std::string &value) {
     }
 }
 
+std::string Query::to_string() const {
+    std::map<std::string, std::string> params;
+
+    for (const auto &[key, value] : query_map_) {
+        auto omit_it = omit_map.find(key);
+        if (omit_it != omit_map.end() && omit_it->second(value)) {
+            continue;
+        }
+
+        params.emplace(key, std::visit(ValueFormatter{}, value));
+    }
+
+    std::string out;
+
+    for (const auto &[key, value] : params) {
+        if (!out.empty()) {
+            out += '&';
+        }
+
+        out += key;
+
+        if (!value.empty()) {
+            out += '=';
+            out += value;
+        }
+    }
+
+    return out;
+}
+
 }  // namespace weserv::api::parsers
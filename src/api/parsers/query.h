@@ -20,8 +20,21 @@ using NginxKeySet = std::unordered_set<std::string>;
 
 class Query {
  public:
+    using QueryVariant = std::variant<bool, int, float, Color, Coordinate,
+                                      std::vector<int>, std::vector<float>>;
+
     explicit Query(const std::string &value);
 
+    /**
+     * Serializes the query into a canonical form, suitable as cache key.
+     * Keys are sorted, synonyms are resolved, parameters that are equivalent
+     * to omitting them are dropped and values are formatted uniformly.
+     * Enumerations are written as their numeric value.
+     * @note This must be called before the query is resolved by processing.
+     * @return The canonical query string.
+     */
+    std::string to_string() const;
+
     template <typename E, typename = std::enable_if_t<std::is_enum_v<E>>>
     /**
      * This is the only function that can pass enums, the other functions do not
@@ -68,8 +81,6 @@ class Query {
     }
 
  private:
-    using QueryVariant = std::variant<bool, int, float, Color, Coordinate,
-                                      std::vector<int>, std::vector<float>>;
     std::unordered_map<std::string, QueryVariant> query_map_;
 
     template <typename T>
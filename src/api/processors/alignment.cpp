@@ -4,13 +4,143 @@
 #include "../utils/utility.h"
 
 #include <algorithm>
+#include <cmath>
+#include <string>
 #include <tuple>
+#include <unordered_set>
 
 namespace weserv::api::processors {
 
 using enums::Canvas;
 using enums::Position;
 
+namespace {
+
+/**
+ * The parameters that change the image before it's aligned, other than its
+ * size.
+ */
+const std::unordered_set<std::string> saliency_keys = {
+    "ch",   "crop", "cw",   "cx",      "cy", "flip", "flop",
+    "gam",  "n",    "page", "precrop", "ro", "trim",
+};
+
+}  // namespace
+
+Alignment::Alignment(const std::unique_ptr<parsers::Query> &query,
+                     const Config &config, const std::string &identity)
+    : ImageProcessor(query, config) {
+    if (identity.empty()) {
+        return;
+    }
+
+    key_ = identity;
+
+    // Filter the canonical form of the query
+    auto params = query_->to_string();
+
+    size_t pos = 0;
+    while (pos < params.size()) {
+        auto end = params.find('&', pos);
+        if (end == std::string::npos) {
+            end = params.size();
+        }
+
+        auto param = params.substr(pos, end - pos);
+        if (saliency_keys.count(param.substr(0, param.find('='))) != 0) {
+            key_ += '\n';
+            key_ += param;
+        }
+
+        pos = end + 1;
+    }
+}
+
+Alignment::Window Alignment::window(const VImage &image,
+                                    const VImage &preview, int width,
+                                    int height, Position position) const {
+    if (preview.width() == image.width() &&
+        preview.height() == image.height()) {
+        auto window = preview.smartcrop(
+            width, height,
+            VImage::option()->set("interesting", static_cast<int>(position)));
+
+        // The offset of the extracted window tells where it was found
+        return {-window.xoffset(), -window.yoffset()};
+    }
+
+    // The copy may be cached from an image of another size, with the same
+    // aspect ratio
+    double hscale = static_cast<double>(preview.width()) / image.width();
+    double vscale = static_cast<double>(preview.height()) / image.height();
+
+    auto preview_width = std::clamp(
+        static_cast<int>(std::rint(width * hscale)), 1, preview.width());
+    auto preview_height = std::clamp(
+        static_cast<int>(std::rint(height * vscale)), 1, preview.height());
+
+    auto window = preview.smartcrop(
+        preview_width, preview_height,
+        VImage::option()->set("interesting", static_cast<int>(position)));
+
+    // Map the window back to the full resolution image
+    auto left = static_cast<int>(std::rint(-window.xoffset() / hscale));
+    auto top = static_cast<int>(std::rint(-window.yoffset() / vscale));
+
+    left = std::clamp(left, 0, image.width() - width);
+    top = std::clamp(top, 0, image.height() - height);
+
+    return {left, top};
+}
+
+bool Alignment::cached() const {
+    return !key_.empty() && Saliency::enabled();
+}
+
+VImage Alignment::smartcrop(const VImage &image, int width, int height,
+                            Position position) const {
+    auto analysis_size = static_cast<int>(config_.smartcrop_size);
+
+    // The cached copy is always downscaled
+    bool cache = cached();
+    if (cache && analysis_size <= 0) {
+        analysis_size = Saliency::DEFAULT_SIZE;
+    }
+
+    // The copy doesn't depend on the size of the image nor on the window, so
+    // it's shared by any crop of the image
+    auto key = cache ? key_ + '\n' + std::to_string(analysis_size) : "";
+
+    VImage preview;
+    if (cache && Saliency::find(key, &preview)) {
+        auto [left, top] = window(image, preview, width, height, position);
+
+        return image.extract_area(left, top, width, height);
+    }
+
+    // The image is read twice, once to find the window and once to crop it
+    auto input = utils::stay_sequential(image, config_.process_timeout);
+
+    preview = input;
+
+    auto longest_side = std::max(input.width(), input.height());
+    if (analysis_size > 0 && longest_side > analysis_size) {
+        preview = input.resize(static_cast<double>(analysis_size) /
+                               longest_side);
+    }
+
+    if (cache) {
+        // Keep the copy apart from the pipeline of this request
+        preview = preview.copy_memory();
+
+        Saliency::insert(key, preview);
+    }
+
+    auto [left, top] = window(input, preview, width, height, position);
+
+    return input.extract_area(left, top, width, height);
+}
+
 VImage Alignment::process(const VImage &image) const {
     // Should we process the image?
     if (query_->get<Canvas>("fit", Canvas::Max) != Canvas::Crop) {
@@ -51,10 +181,14 @@ VImage Alignment::process(const VImage &image) const {
     // Skip smart crop for multi-page images
     if (n_pages == 1 && (crop_position == Position::Entropy ||
                          crop_position == Position::Attention)) {
-        return utils::stay_sequential(image, config_.process_timeout)
-            .smartcrop(crop_width, crop_height,
-                       VImage::option()->set("interesting",
-                                             static_cast<int>(crop_position)));
+        return smartcrop(image, crop_width, crop_height, crop_position);
+    }
+
+    // Without a focal point, focus on the most interesting window, as long as
+    // the copies of the image are cached
+    if (n_pages == 1 && crop_position == Position::Focal && cached() &&
+        !query_->exists("fpx") && !query_->exists("fpy")) {
+        return smartcrop(image, crop_width, crop_height, Position::Attention);
     }
 
     int left;
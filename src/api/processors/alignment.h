@@ -1,6 +1,12 @@
 #pragma once
 
+#include "../enums.h"
 #include "base.h"
+#include "saliency.h"
+
+#include <memory>
+#include <string>
+#include <utility>
 
 namespace weserv::api::processors {
 
@@ -8,7 +14,60 @@ class Alignment : ImageProcessor {
  public:
     using ImageProcessor::ImageProcessor;
 
+    /**
+     * @param query Query holder.
+     * @param config Global config.
+     * @param identity The identity of the source, under which the copy that
+     *                 smart crops are searched on is cached. See
+     *                 io::Source::identity.
+     */
+    Alignment(const std::unique_ptr<parsers::Query> &query,
+              const Config &config, const std::string &identity);
+
     VImage process(const VImage &image) const override;
+
+ private:
+    /**
+     * The (left, top) coordinates of a window.
+     */
+    using Window = std::pair<int, int>;
+
+    /**
+     * Find the most interesting window of an image through `smartcrop`,
+     * searched on a downscaled copy of it, which is mapped back to the image.
+     * @param image The source image.
+     * @param preview The copy to search on, or the image itself.
+     * @param width Width of the window.
+     * @param height Height of the window.
+     * @param position `Position::Entropy` or `Position::Attention`.
+     * @return The window.
+     */
+    Window window(const VImage &image, const VImage &preview, int width,
+                  int height, enums::Position position) const;
+
+    /**
+     * Crop the image to its most interesting window. If the source can be
+     * identified, the window is searched on the cached copy of the image.
+     * @param image The source image.
+     * @param width Width of the window.
+     * @param height Height of the window.
+     * @param position `Position::Entropy` or `Position::Attention`.
+     * @return The cropped image.
+     */
+    VImage smartcrop(const VImage &image, int width, int height,
+                     enums::Position position) const;
+
+    /**
+     * Whether the copies of the image are cached.
+     */
+    bool cached() const;
+
+    /**
+     * The key of the downscaled copy of the image within the cache, empty if
+     * the source can't be identified. This is the identity of the source,
+     * plus the parameters that change the image before it's aligned.
+     */
+    std::string key_;
 };
 
 }  // namespace weserv::api::processors
@@ -6,6 +6,10 @@ namespace weserv::api::processors {
 
 using parsers::Color;
 
+bool Background::active() const {
+    return !query_->get<Color>("bg", Color::DEFAULT).is_transparent();
+}
+
 VImage Background::process(const VImage &image) const {
     auto bg = query_->get<Color>("bg", Color::DEFAULT);
 
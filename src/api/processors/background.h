@@ -9,6 +9,8 @@ class Background : ImageProcessor {
     using ImageProcessor::ImageProcessor;
 
     VImage process(const VImage &image) const override;
+
+    bool active() const override;
 };
 
 }  // namespace weserv::api::processors
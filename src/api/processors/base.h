@@ -19,6 +19,16 @@ class ImageProcessor {
 
     virtual VImage process(const VImage &image) const = 0;
 
+    /**
+     * Whether the query asks for this processor at all. Inactive processors
+     * are left out of the pipeline.
+     * @note This may return `true` for a query that turns out to be a no-op,
+     *       but never `false` for a query that changes the image.
+     */
+    virtual bool active() const {
+        return true;
+    }
+
     template <typename Processor>
     friend VImage operator|(const VImage &image, const Processor &processor) {
         return processor.process(image);
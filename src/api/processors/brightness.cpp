@@ -2,6 +2,10 @@
 
 namespace weserv::api::processors {
 
+bool Brightness::active() const {
+    return query_->get<int>("bri", 0) != 0;
+}
+
 VImage Brightness::process(const VImage &image) const {
     auto bri = query_->get_if<int>(
         "bri",
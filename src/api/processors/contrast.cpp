@@ -70,6 +70,10 @@ VImage Contrast::sigmoid(const VImage &image, const double contrast) const {
     return image.maplut(result);
 }
 
+bool Contrast::active() const {
+    return query_->get<int>("con", 0) != 0;
+}
+
 VImage Contrast::process(const VImage &image) const {
     auto con = query_->get_if<int>(
         "con",
@@ -10,6 +10,8 @@ class Contrast : ImageProcessor {
 
     VImage process(const VImage &image) const override;
 
+    bool active() const override;
+
  private:
     /**
      * magick's sigmoidal non-linearity contrast control equivalent in libvips.
@@ -80,10 +80,18 @@ VImage Embed::embed_multi_page(const VImage &image, int left, int top,
     // LCOV_EXCL_STOP
 }
 
+bool Embed::active() const {
+    return query_->get<Canvas>("fit", Canvas::Max) == Canvas::Embed;
+}
+
 VImage Embed::process(const VImage &image) const {
+    return process(image, nullptr);
+}
+
+VImage Embed::process(const VImage &image, const PointOps &point_ops) const {
     // Should we process the image?
-    if (query_->get<Canvas>("fit", Canvas::Max) != Canvas::Embed) {
-        return image;
+    if (!active()) {
+        return point_ops ? point_ops(image) : image;
     }
 
     auto n_pages = query_->get<int>("n");
@@ -109,7 +117,7 @@ VImage Embed::process(const VImage &image) const {
 
     // Return early when required dimensions are met
     if (image_width == width && image_height == height) {
-        return image;
+        return point_ops ? point_ops(image) : image;
     }
 
     // A background color can be specified with the cbg parameter
@@ -148,13 +156,31 @@ VImage Embed::process(const VImage &image) const {
             ? image
             : image.bandjoin_const({255});  // Assumes images are always 8-bit
 
-    return n_pages > 1
-               ? embed_multi_page(output_image, left, top, width, height,
-                                  background_rgba, n_pages, image_height)
-               : output_image.embed(left, top, width, height,
-                                    VImage::option()
-                                        ->set("extend", VIPS_EXTEND_BACKGROUND)
-                                        ->set("background", background_rgba));
+    // Run the point operations before the embed, on fewer pixels, if the
+    // background can be mapped through them as well. That is, by running them
+    // on a single pixel of the background with the format and bands of the
+    // image.
+    bool map_background =
+        point_ops &&
+        background_rgba.size() == static_cast<size_t>(output_image.bands());
+    if (map_background) {
+        auto background = output_image.new_from_image(background_rgba)
+                              .extract_area(0, 0, 1, 1);
+        background_rgba = point_ops(background).getpoint(0, 0);
+
+        output_image = point_ops(output_image);
+    }
+
+    auto embedded =
+        n_pages > 1
+            ? embed_multi_page(output_image, left, top, width, height,
+                               background_rgba, n_pages, image_height)
+            : output_image.embed(left, top, width, height,
+                                 VImage::option()
+                                     ->set("extend", VIPS_EXTEND_BACKGROUND)
+                                     ->set("background", background_rgba));
+
+    return point_ops && !map_background ? point_ops(embedded) : embedded;
 }
 
 }  // namespace weserv::api::processors
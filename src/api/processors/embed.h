@@ -2,14 +2,36 @@
 
 #include "base.h"
 
+#include <functional>
+#include <vector>
+
 namespace weserv::api::processors {
 
+/**
+ * A chain of point operations, i.e. operations that map each pixel on its own.
+ */
+using PointOps = std::function<VImage(const VImage &)>;
+
 class Embed : ImageProcessor {
  public:
     using ImageProcessor::ImageProcessor;
 
     VImage process(const VImage &image) const override;
 
+    /**
+     * Embed the image after running the given point operations on it. The
+     * background is mapped through the point operations as well, so this
+     * gives the same image as running them after the embed, on fewer pixels.
+     * @param image The source image.
+     * @param point_ops Point operations, which must map each pixel regardless
+     *                  of the other pixels and of the image dimensions. May be
+     *                  empty.
+     * @return A new image.
+     */
+    VImage process(const VImage &image, const PointOps &point_ops) const;
+
+    bool active() const override;
+
  private:
     /**
      * Split into frames, embed each frame, reassemble, and update page height.
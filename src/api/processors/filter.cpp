@@ -10,6 +10,11 @@ namespace weserv::api::processors {
 using enums::FilterType;
 using parsers::Color;
 
+bool Filter::active() const {
+    return query_->get<FilterType>("filt", FilterType::None) !=
+           FilterType::None;
+}
+
 VImage Filter::process(const VImage &image) const {
     auto filter_type = query_->get<FilterType>("filt", FilterType::None);
 
@@ -9,6 +9,8 @@ class Filter : ImageProcessor {
     using ImageProcessor::ImageProcessor;
 
     VImage process(const VImage &image) const override;
+
+    bool active() const override;
 };
 
 }  // namespace weserv::api::processors
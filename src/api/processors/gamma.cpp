@@ -2,6 +2,10 @@
 
 namespace weserv::api::processors {
 
+bool Gamma::active() const {
+    return query_->get<float>("gam", 0.0F) != 0.0F;
+}
+
 VImage Gamma::process(const VImage &image) const {
     auto gamma = query_->get<float>("gam", 0.0F);
 
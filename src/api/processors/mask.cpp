@@ -1,6 +1,7 @@
 #include "mask.h"
 
 #include "../io/blob.h"
+#include "../utils/lru_cache.h"
 #include "../utils/utility.h"
 
 #include <algorithm>
@@ -18,6 +19,22 @@ using parsers::Color;
 
 using io::Blob;
 
+namespace {
+
+/**
+ * A cache of rasterized masks, keyed by their SVG, bounded by the size of
+ * their pixel data.
+ */
+utils::LruCache<VImage> &mask_cache() {
+    // Never destroyed, as libvips may be shut down by then
+    static auto *cache = new utils::LruCache<VImage>([](const VImage &image) {
+        return static_cast<size_t>(VIPS_IMAGE_SIZEOF_IMAGE(image.get_image()));
+    });
+    return *cache;
+}
+
+}  // namespace
+
 std::string Mask::svg_path_by_type(const int width, const int height,
                                    const MaskType &mask,
                                    int *out_x_min, int *out_y_min,
@@ -262,6 +279,71 @@ Mask::transformed_path_string(const std::vector<PathCoordinate> &coordinates,
     return ss.str();
 }
 
+VImage Mask::render(const std::string &svg, bool cutout) const {
+    auto &cache = mask_cache();
+    bool cacheable = cache.enabled();
+
+    // Cutouts and frames are cached separately
+    auto key = (cutout ? "c" : "f") + svg;
+
+    VImage image;
+    if (!cacheable || !cache.find(key, &image)) {
+        // We don't take a copy of the data or free it
+        auto blob = Blob(vips_blob_new(nullptr, svg.data(), svg.size()));
+        image = VImage::svgload_buffer(
+            blob.get(),
+            VImage::option()->set("access", VIPS_ACCESS_SEQUENTIAL));
+
+        if (!cacheable) {
+            return image;
+        }
+
+        auto rasterized = cutout ? image[image.bands() - 1] : image;
+
+        // Masks that wouldn't fit in the cache are streamed from svgload,
+        // rather than materialised in memory only to be discarded
+        if (!cache.fits(VIPS_IMAGE_SIZEOF_IMAGE(rasterized.get_image()))) {
+            return image;
+        }
+
+        image = rasterized.copy_memory();
+        cache.insert(key, image);
+    }
+
+    if (cutout) {
+        // The colour of a cutout doesn't matter, only its alpha channel
+        return image.new_from_image({0, 0, 0})
+            .bandjoin(image)
+            .copy(VImage::option()->set("interpretation",
+                                        VIPS_INTERPRETATION_sRGB));
+    }
+
+    return image;
+}
+
+void Mask::preload(int width, int height) const {
+    // A blank image with an alpha channel, so that the cutout is rasterized
+    // regardless of the mask background
+    auto blank =
+        VImage::black(width, height, VImage::option()->set("bands", 4))
+            .copy(VImage::option()->set("interpretation",
+                                        VIPS_INTERPRETATION_sRGB));
+
+    (void)process(blank);
+}
+
+void Mask::set_cache_size(size_t max_size) {
+    mask_cache().set_max_size(max_size);
+}
+
+size_t Mask::cache_hits() {
+    return mask_cache().hits();
+}
+
+bool Mask::active() const {
+    return query_->get<MaskType>("mask", MaskType::None) != MaskType::None;
+}
+
 VImage Mask::process(const VImage &image) const {
     auto mask_type = query_->get<MaskType>("mask", MaskType::None);
 
@@ -306,14 +388,7 @@ VImage Mask::process(const VImage &image) const {
         }
         svg << "</svg>";
 
-        auto svg_mask = svg.str();
-
-        // We don't take a copy of the data or free it
-        auto blob =
-            Blob(vips_blob_new(nullptr, svg_mask.data(), svg_mask.size()));
-        auto mask = VImage::svgload_buffer(
-            blob.get(),
-            VImage::option()->set("access", VIPS_ACCESS_SEQUENTIAL));
+        auto mask = render(svg.str(), true);
 
         // Cutout via dest-in
         output_image = output_image.composite2(mask, VIPS_BLEND_MODE_DEST_IN);
@@ -337,14 +412,7 @@ VImage Mask::process(const VImage &image) const {
         }
         svg << "</svg>";
 
-        auto svg_frame = svg.str();
-
-        // We don't take a copy of the data or free it
-        auto blob =
-            Blob(vips_blob_new(nullptr, svg_frame.data(), svg_frame.size()));
-        auto frame = VImage::svgload_buffer(
-            blob.get(),
-            VImage::option()->set("access", VIPS_ACCESS_SEQUENTIAL));
+        auto frame = render(svg.str(), false);
 
         // Ensure image to composite is premultiplied sRGB
         frame = frame.premultiply();
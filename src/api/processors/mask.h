@@ -3,6 +3,7 @@
 #include "../enums.h"
 #include "base.h"
 
+#include <cstddef>
 #include <string>
 #include <vector>
 
@@ -18,6 +19,28 @@ class Mask : ImageProcessor {
 
     VImage process(const VImage &image) const override;
 
+    bool active() const override;
+
+    /**
+     * Rasterize the mask for an image of the given dimensions ahead of time,
+     * so that it's taken from the cache of rasterized masks later on.
+     * @param width Image width.
+     * @param height Image height.
+     */
+    void preload(int width, int height) const;
+
+    /**
+     * Set the maximum size of the cache of rasterized masks, which is shared
+     * by all requests within the process.
+     * @param max_size The maximum size, in bytes. 0 disables the cache.
+     */
+    static void set_cache_size(size_t max_size);
+
+    /**
+     * @return The number of masks taken from the cache of rasterized masks.
+     */
+    static size_t cache_hits();
+
  private:
     /**
      * Get the SVG mask path by type.
@@ -90,6 +113,15 @@ class Mask : ImageProcessor {
      * @return The ellipse represented as SVG path.
      */
     std::string svg_ellipse_path(float cx, float cy, float rx, float ry) const;
+
+    /**
+     * Rasterize an SVG, or take it from the cache of rasterized masks.
+     * @param svg The SVG.
+     * @param cutout Only the alpha channel of the SVG is used, i.e. it's a
+     *               cutout. Only the alpha channel is cached then.
+     * @return The rasterized SVG.
+     */
+    VImage render(const std::string &svg, bool cutout) const;
 };
 
 }  // namespace weserv::api::processors
@@ -2,6 +2,12 @@
 
 namespace weserv::api::processors {
 
+bool Modulate::active() const {
+    return query_->get<float>("mod", 1.0F) != 1.0F ||
+           query_->get<float>("sat", 1.0F) != 1.0F ||
+           query_->get<int>("hue", 0) % 360 != 0;
+}
+
 VImage Modulate::process(const VImage &image) const {
     auto brightness = query_->get_if<float>(
         /*"bri"*/"mod",
@@ -17,12 +23,7 @@ VImage Modulate::process(const VImage &image) const {
             return s >= 0 && s <= 10000;
         },
         1.0F);
-    auto hue = query_->get<int>("hue", 0);  // Normalized to [0, 360] below
-
-    // Should we process the image?
-    if (brightness == 1.0 && saturation == 1.0 && hue == 0) {
-        return image;
-    }
+    auto hue = query_->get<int>("hue", 0);
 
     // Normalize hue rotation to [0, 360]
     hue %= 360;
@@ -30,6 +31,11 @@ VImage Modulate::process(const VImage &image) const {
         hue = 360 + hue;
     }
 
+    // Should we process the image? A full hue rotation is a no-op
+    if (brightness == 1.0 && saturation == 1.0 && hue == 0) {
+        return image;
+    }
+
     // Get original colorspace
     VipsInterpretation type_before_modulate = image.interpretation();
 
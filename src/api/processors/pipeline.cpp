@@ -0,0 +1,199 @@
+#include "pipeline.h"
+
+#include "background.h"
+#include "blur.h"
+#include "brightness.h"
+#include "contrast.h"
+#include "embed.h"
+#include "filter.h"
+#include "gamma.h"
+#include "mask.h"
+#include "modulate.h"
+#include "rotation.h"
+#include "sharpen.h"
+#include "tint.h"
+
+#include "../enums.h"
+
+#include <vector>
+
+namespace weserv::api::processors {
+
+using enums::FilterType;
+
+namespace {
+
+/**
+ * How a step maps the pixels of an image.
+ */
+enum class Kind {
+    /**
+     * Depends on the neighbouring pixels or on the image dimensions.
+     */
+    Area,
+
+    /**
+     * Maps each pixel on its own, regardless of the other pixels and of the
+     * image dimensions.
+     */
+    Point,
+
+    /**
+     * Maps each band of each pixel on its own, i.e. a point operation that
+     * can be tabulated per band.
+     */
+    Band,
+};
+
+/**
+ * A step of the planned pipeline.
+ */
+struct Step {
+    PointOps run;
+    Kind kind;
+};
+
+/**
+ * Appends a processor to the plan, unless the query doesn't ask for it.
+ */
+template <typename Processor>
+void add_step(std::vector<Step> *plan, const Processor &processor, Kind kind) {
+    if (!processor.active()) {
+        return;
+    }
+
+    plan->push_back({[&processor](const VImage &image) {
+                         return processor.process(image);
+                     },
+                     kind});
+}
+
+/**
+ * Runs the given band operations in one go. An 8-bit image is mapped through
+ * a lookup table, which is made by running the operations on an identity
+ * table with the bands and interpretation of the image. Other images are run
+ * through the operations one by one.
+ */
+VImage run_fused(const std::vector<Step> &steps, const VImage &image) {
+    if (image.format() != VIPS_FORMAT_UCHAR) {
+        auto output_image = image;
+        for (const auto &step : steps) {
+            output_image = step.run(output_image);
+        }
+        return output_image;
+    }
+
+    auto lut = VImage::identity(VImage::option()->set("bands", image.bands()))
+                   .copy(VImage::option()->set("interpretation",
+                                               image.interpretation()));
+    for (const auto &step : steps) {
+        lut = step.run(lut);
+    }
+
+    return image.maplut(lut);
+}
+
+/**
+ * Fuses the runs of consecutive band operations, such that each image pixel
+ * is visited once per run.
+ */
+std::vector<Step> fuse(const std::vector<Step> &plan) {
+    std::vector<Step> fused;
+    fused.reserve(plan.size());
+
+    for (auto step = plan.begin(); step != plan.end();) {
+        auto last = step;
+        while (last != plan.end() && last->kind == Kind::Band) {
+            ++last;
+        }
+
+        if (last - step < 2) {
+            fused.push_back(*step++);
+            continue;
+        }
+
+        std::vector<Step> steps(step, last);
+        fused.push_back({[steps](const VImage &image) {
+                             return run_fused(steps, image);
+                         },
+                         Kind::Band});
+
+        step = last;
+    }
+
+    return fused;
+}
+
+}  // namespace
+
+VImage Pipeline::process(const VImage &image) const {
+    auto embed = Embed(query_, config_);
+    auto rotation = Rotation(query_, config_);
+    auto brightness = Brightness(query_, config_);
+    auto modulate = Modulate(query_, config_);
+    auto contrast = Contrast(query_, config_);
+    auto gamma = Gamma(query_, config_);
+    auto sharpen = Sharpen(query_, config_);
+    auto filter = Filter(query_, config_);
+    auto blur = Blur(query_, config_);
+    auto tint = Tint(query_, config_);
+    auto background = Background(query_, config_);
+    auto mask = Mask(query_, config_);
+
+    // The canonical order of the processors that follow the embed
+    std::vector<Step> plan;
+    plan.reserve(11);
+    add_step(&plan, rotation, Kind::Area);
+    add_step(&plan, brightness, Kind::Band);
+    add_step(&plan, modulate, Kind::Point);
+    add_step(&plan, contrast, Kind::Band);
+    add_step(&plan, gamma, Kind::Band);
+    add_step(&plan, sharpen, Kind::Area);
+    add_step(&plan, filter,
+             query_->get<FilterType>("filt", FilterType::None) ==
+                     FilterType::Negate
+                 ? Kind::Band
+                 : Kind::Point);
+    add_step(&plan, blur, Kind::Area);
+    add_step(&plan, tint, Kind::Point);
+    add_step(&plan, background, Kind::Point);
+    add_step(&plan, mask, Kind::Area);
+
+    plan = fuse(plan);
+
+    auto step = plan.begin();
+
+    // Internal copy, we need to re-assign a few times
+    auto output_image = image;
+
+    if (embed.active()) {
+        // The point operations that directly follow the embed commute with
+        // it, so let the embed run them on the image before it's enlarged
+        auto first = step;
+        while (step != plan.end() && step->kind != Kind::Area) {
+            ++step;
+        }
+        auto last = step;
+
+        PointOps point_ops;
+        if (first != last) {
+            point_ops = [first, last](const VImage &in) {
+                auto out = in;
+                for (auto it = first; it != last; ++it) {
+                    out = it->run(out);
+                }
+                return out;
+            };
+        }
+
+        output_image = embed.process(output_image, point_ops);
+    }
+
+    for (; step != plan.end(); ++step) {
+        output_image = step->run(output_image);
+    }
+
+    return output_image;
+}
+
+}  // namespace weserv::api::processors
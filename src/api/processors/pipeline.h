@@ -0,0 +1,21 @@
+#pragma once
+
+#include "base.h"
+
+namespace weserv::api::processors {
+
+/**
+ * Plans and runs the processors that follow the sizing of the image, i.e. the
+ * embed, adjustments and effects. Processors that the query doesn't ask for
+ * are left out, point operations that directly follow the embed are run
+ * before it, on fewer pixels, and consecutive per-band adjustments of 8-bit
+ * images are fused into a single lookup table.
+ */
+class Pipeline : ImageProcessor {
+ public:
+    using ImageProcessor::ImageProcessor;
+
+    VImage process(const VImage &image) const override;
+};
+
+}  // namespace weserv::api::processors
@@ -8,6 +8,11 @@ namespace weserv::api::processors {
 
 using parsers::Color;
 
+bool Rotation::active() const {
+    // Only arbitrary angles are valid, and multi-page images are skipped
+    return query_->get<int>("ro", 0) % 90 != 0 && query_->get<int>("n") <= 1;
+}
+
 VImage Rotation::process(const VImage &image) const {
     // Only arbitrary angles are valid
     auto rotation =
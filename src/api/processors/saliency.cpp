@@ -0,0 +1,39 @@
+#include "saliency.h"
+
+#include "../utils/lru_cache.h"
+
+namespace weserv::api::processors {
+
+using vips::VImage;
+
+namespace {
+
+utils::LruCache<VImage> &saliency_cache() {
+    // Never destroyed, as libvips may be shut down by then
+    static auto *cache = new utils::LruCache<VImage>();
+    return *cache;
+}
+
+}  // namespace
+
+void Saliency::set_cache_size(size_t max_entries) {
+    saliency_cache().set_max_size(max_entries);
+}
+
+bool Saliency::enabled() {
+    return saliency_cache().enabled();
+}
+
+size_t Saliency::cache_hits() {
+    return saliency_cache().hits();
+}
+
+bool Saliency::find(const std::string &key, VImage *preview) {
+    return saliency_cache().find(key, preview);
+}
+
+void Saliency::insert(const std::string &key, const VImage &preview) {
+    saliency_cache().insert(key, preview);
+}
+
+}  // namespace weserv::api::processors
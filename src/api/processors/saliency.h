@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include <vips/vips8>
+
+namespace weserv::api::processors {
+
+/**
+ * A process-wide cache of the downscaled copies of images on which the
+ * windows of `&a=entropy` and `&a=attention` crops are searched. A copy only
+ * depends on the source, so an image that's cropped again, at any size or
+ * aspect ratio, is searched on the cached copy instead of being read twice
+ * and downscaled again.
+ */
+class Saliency {
+ public:
+    /**
+     * The longest side of the cached copies, if the configuration doesn't
+     * set a size to search the windows at.
+     */
+    static constexpr int DEFAULT_SIZE = 256;
+
+    /**
+     * Set the maximum number of copies that are cached, which is shared by
+     * all requests within the process.
+     * @param max_entries The maximum number of copies. 0 disables the cache.
+     */
+    static void set_cache_size(size_t max_entries);
+
+    /**
+     * Whether the cache is enabled.
+     */
+    static bool enabled();
+
+    /**
+     * @return The number of copies taken from the cache since the process
+     *         started.
+     */
+    static size_t cache_hits();
+
+    /**
+     * Find a copy within the cache.
+     * @param key The key of the copy.
+     * @param preview Set to the copy, if found.
+     * @return `true` if the copy was found.
+     */
+    static bool find(const std::string &key, vips::VImage *preview);
+
+    /**
+     * Insert a copy into the cache.
+     * @param key The key of the copy.
+     * @param preview The copy, which must not depend on the source.
+     */
+    static void insert(const std::string &key, const vips::VImage &preview);
+};
+
+}  // namespace weserv::api::processors
@@ -21,37 +21,10 @@ using parsers::Coordinate;
 using vips::VError;
 
 using io::Blob;
+using io::PageIndex;
 using io::Source;
 using io::Target;
 
-template <typename Comparator>
-int Stream::resolve_page(const VImage &image, int n_pages, const Source &source,
-                         const Blob &blob, const std::string &loader,
-                         Comparator comp) const {
-    uint64_t size = static_cast<uint64_t>(image.height()) * image.width();
-
-    int target_page = 0;
-
-    for (int i = 1; i < n_pages; ++i) {
-        auto image_page =
-            new_from_source(source, blob, loader,
-                            VImage::option()
-                                ->set("access", VIPS_ACCESS_SEQUENTIAL)
-                                ->set("fail", config_.fail_on_error == 1)
-                                ->set("page", i));
-
-        uint64_t page_size =
-            static_cast<uint64_t>(image_page.height()) * image_page.width();
-
-        if (comp(page_size, size)) {
-            target_page = i;
-            size = page_size;
-        }
-    }
-
-    return target_page;
-}
-
 std::pair<int, int> Stream::get_page_load_options(int n_pages) const {
     // Skip for single-page images
     if (n_pages == 1) {
@@ -240,9 +213,12 @@ VImage Stream::new_from_source(const Source &source) const {
                                      ->set("access", access_method)
                                      ->set("fail", config_.fail_on_error == 1));
 
-    auto n_pages = image.get_typeof(VIPS_META_N_PAGES) != 0
-                       ? image.get_int(VIPS_META_N_PAGES)
-                       : 1;
+    // Index the dimensions of the pages once, for the page selection below
+    // and for the pyramid detection of the thumbnail processor
+    auto &page_index = PageIndex::of(source);
+    page_index.build(source, image, image_type);
+
+    auto n_pages = page_index.n_pages();
 
     auto n = 1;
     auto page = 0;
@@ -257,12 +233,20 @@ VImage Stream::new_from_source(const Source &source) const {
                 std::to_string(config_.max_pages));
         }
 
+        // Pages that aren't indexed are loaded on demand
+        auto load_page = [&](int i) {
+            return new_from_source(source, blob, loader,
+                                   VImage::option()
+                                       ->set("access", VIPS_ACCESS_SEQUENTIAL)
+                                       ->set("fail", config_.fail_on_error == 1)
+                                       ->set("page", i));
+        };
+
+        // See: https://github.com/weserv/images/issues/170
         if (page == -1) {
-            page = resolve_page(image, n_pages, source, blob, loader,
-                                std::greater<>());
+            page = page_index.find(load_page, std::greater<>());
         } else if (page == -2) {
-            page = resolve_page(image, n_pages, source, blob, loader,
-                                std::less<>());
+            page = page_index.find(load_page, std::less<>());
         }
 
         image = new_from_source(source, blob, loader,
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "../io/blob.h"
+#include "../io/page_index.h"
 #include "../io/source.h"
 #include "../io/target.h"
 #include "base.h"
@@ -32,24 +33,6 @@ class Stream {
      */
     const Config &config_;
 
-    /**
-     * Finds the largest/smallest page in the range [0, n_pages].
-     * Pages are compared using the given comparison function.
-     * See: https://github.com/weserv/images/issues/170.
-     * @tparam Comparator Comparison type.
-     * @param image The source image.
-     * @param n_pages Number of pages in the image.
-     * @param source Source to read from.
-     * @param blob (Fallback-)blob to read from.
-     * @param loader Image loader.
-     * @param comp Comparison function object.
-     * @return The largest/smallest page in the range [0, n_pages].
-     */
-    template <typename Comparator>
-    int resolve_page(const VImage &image, int n_pages, const io::Source &source,
-                     const io::Blob &blob, const std::string &loader,
-                     Comparator comp) const;
-
     /**
      * Get the page options to pass on to the load operation.
      * @param n_pages Number of pages in the image.
@@ -2,6 +2,7 @@
 
 #include "../exceptions/large.h"
 #include "../io/blob.h"
+#include "../io/page_index.h"
 #include "../utils/utility.h"
 
 #include <algorithm>
@@ -20,6 +21,7 @@ using enums::ImageType;
 constexpr bool FAST_SHRINK_ON_LOAD = true;
 
 using io::Blob;
+using io::PageIndex;
 using io::Source;
 
 template <>
@@ -172,9 +174,12 @@ int Thumbnail::resolve_jpeg_shrink(int width, int height) const {
 int Thumbnail::resolve_tiff_pyramid(const VImage &image, const Source &source,
                                     int width, int height) const {
     // Note: This is checked against config_.max_pages in stream.cpp
-    int n_pages = image.get_typeof(VIPS_META_N_PAGES) != 0
-                      ? image.get_int(VIPS_META_N_PAGES)
-                      : 1;
+    auto &page_index = PageIndex::of(source);
+    if (!page_index.built()) {
+        page_index.build(source, image, ImageType::Tiff);
+    }
+
+    int n_pages = page_index.n_pages();
 
     // Only one page? Can't be
     if (n_pages < 2) {
@@ -184,14 +189,13 @@ int Thumbnail::resolve_tiff_pyramid(const VImage &image, const Source &source,
     int target_page = -1;
 
     for (int i = n_pages - 1; i >= 0; i--) {
-        auto page = new_from_source<ImageType::Tiff>(
-            source, VImage::option()
-                        ->set("access", VIPS_ACCESS_SEQUENTIAL)
-                        ->set("fail", config_.fail_on_error == 1)
-                        ->set("page", i));
-
-        int level_width = page.width();
-        int level_height = page.height();
+        auto [level_width, level_height] = page_index.page(i, [&](int page) {
+            return new_from_source<ImageType::Tiff>(
+                source, VImage::option()
+                            ->set("access", VIPS_ACCESS_SEQUENTIAL)
+                            ->set("fail", config_.fail_on_error == 1)
+                            ->set("page", page));
+        });
 
         // Try to sanity-check the size of the pages. Do they look
         // like a pyramid?
@@ -261,10 +265,10 @@ VImage Thumbnail::shrink_on_load(const VImage &image,
                                  const Source &source) const {
     // Try to reload input using shrink-on-load, when:
     //  - the width or height parameters are specified
-    //  - gamma correction doesn't need to be applied
     //  - trimming isn't required
+    // Gamma correction is applied after the resize, so it doesn't matter
+    // whether the image was shrunk on load
     if (query_->get<bool>("trim", false) ||
-        query_->get<float>("gam", 0.0F) != 0.0F ||
         (query_->get<int>("w") == 0 && query_->get<int>("h") == 0)) {
         return image;
     }
@@ -345,6 +349,93 @@ VImage Thumbnail::shrink_on_load(const VImage &image,
     return image;
 }
 
+bool Thumbnail::can_trim_on_load() const {
+    if (config_.trim_preview != 1) {
+        return false;
+    }
+
+    auto threshold = query_->get_if<int>(
+        "trim", [](int t) { return t >= 1 && t <= 254; }, 0);
+    auto image_type = query_->get<ImageType>("type", ImageType::Unknown);
+
+    // Only for single-page JPEG and WebP images, which can be reloaded at an
+    // arbitrary scale, and when shrink-on-load would otherwise be used
+    return threshold != 0 &&
+           (image_type == ImageType::Jpeg || image_type == ImageType::Webp) &&
+           query_->get<int>("n") == 1 &&
+           (query_->get<int>("w") != 0 || query_->get<int>("h") != 0);
+}
+
+VImage Thumbnail::trim_on_load(const VImage &image, const Source &source,
+                               const Trim &trim) const {
+    auto image_type = query_->get<ImageType>("type", ImageType::Unknown);
+
+    // Too small to preview, trim at full resolution instead
+    if (image.width() < 24 || image.height() < 24) {
+        return shrink_on_load(image | trim, source);
+    }
+
+    // The bounding box is searched twice, so random access is needed
+    auto new_from_scale = [&](int jpeg_shrink, double webp_scale) {
+        vips::VOption *load_options =
+            VImage::option()
+                ->set("access", VIPS_ACCESS_RANDOM)
+                ->set("fail", config_.fail_on_error == 1);
+
+        if (image_type == ImageType::Jpeg) {
+            return new_from_source<ImageType::Jpeg>(
+                source, load_options->set("shrink", jpeg_shrink));
+        }
+
+        append_page_options(load_options);
+
+        return new_from_source<ImageType::Webp>(
+            source, load_options->set("scale", webp_scale));
+    };
+
+    auto preview = new_from_scale(8, 1.0 / 8);
+
+    int left, top, width, height;
+    if (!trim.find_trim(preview, &left, &top, &width, &height)) {
+        // We could use shrink-on-load
+        query_->update("trim", false);
+
+        return shrink_on_load(image, source);
+    }
+
+    // Estimate the size of the trimmed image, less a preview pixel on each
+    // side, so that we never shrink more than the trimmed image allows
+    double x_ratio = static_cast<double>(image.width()) / preview.width();
+    double y_ratio = static_cast<double>(image.height()) / preview.height();
+
+    int trimmed_width = std::max(1, static_cast<int>((width - 2) * x_ratio));
+    int trimmed_height = std::max(1, static_cast<int>((height - 2) * y_ratio));
+
+    auto jpeg_shrink = 1;
+    auto webp_scale = 1.0;
+    if (image_type == ImageType::Jpeg) {
+        jpeg_shrink = resolve_jpeg_shrink(trimmed_width, trimmed_height);
+    } else {
+        // Avoid upsizing via libwebp
+        webp_scale = std::min(
+            1.0, 1.0 / resolve_common_shrink(trimmed_width, trimmed_height));
+    }
+
+    auto shrunk = new_from_scale(jpeg_shrink, webp_scale);
+
+    // And find the bounding box at the scale we'll continue with
+    if (!trim.find_trim(shrunk, &left, &top, &width, &height)) {
+        query_->update("trim", false);
+
+        return shrunk;
+    }
+
+    // Skip any further shrink-on-load
+    query_->update("trim", true);
+
+    return shrunk.extract_area(left, top, width, height);
+}
+
 // Any pre-shrinking may already have been done
 VImage Thumbnail::process(const VImage &image) const {
     auto has_icc_profile = utils::has_profile(image);
@@ -3,6 +3,7 @@
 #include "../enums.h"
 #include "../io/source.h"
 #include "base.h"
+#include "trim.h"
 
 namespace weserv::api::processors {
 
@@ -18,6 +19,27 @@ class Thumbnail : ImageProcessor {
      */
     VImage shrink_on_load(const VImage &image, const io::Source &source) const;
 
+    /**
+     * Whether trimming can be combined with shrink-on-load, see
+     * `trim_on_load`.
+     * @return `true` if `trim_on_load` should be used instead of the trim
+     *         processor and `shrink_on_load`.
+     */
+    bool can_trim_on_load() const;
+
+    /**
+     * Trim the image without giving up shrink-on-load. The bounding box is
+     * first found on a 1/8 preview, which tells how far the trimmed image can
+     * be shrunk on load. The image is then reloaded at that scale and trimmed
+     * there.
+     * @param image The source image.
+     * @param source Source to read from.
+     * @param trim The trim processor.
+     * @return An image that may have been trimmed and shrunk.
+     */
+    VImage trim_on_load(const VImage &image, const io::Source &source,
+                        const Trim &trim) const;
+
     VImage process(const VImage &image) const override;
 
  private:
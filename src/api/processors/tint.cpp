@@ -6,6 +6,10 @@ namespace weserv::api::processors {
 
 using parsers::Color;
 
+bool Tint::active() const {
+    return !query_->get<Color>("tint", Color::DEFAULT).is_transparent();
+}
+
 VImage Tint::process(const VImage &image) const {
     auto tint = query_->get<Color>("tint", Color::DEFAULT);
 
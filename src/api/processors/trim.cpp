@@ -4,7 +4,8 @@
 
 namespace weserv::api::processors {
 
-VImage Trim::process(const VImage &image) const {
+bool Trim::find_trim(const VImage &image, int *left, int *top, int *width,
+                     int *height) const {
     auto threshold = query_->get_if<int>(
         "trim",
         [](int t) {
@@ -16,10 +17,7 @@ VImage Trim::process(const VImage &image) const {
 
     // Make sure that trimming is required
     if (threshold == 0 || image.width() < 3 || image.height() < 3) {
-        // We could use shrink-on-load for the next thumbnail processor
-        query_->update("trim", false);
-
-        return image;
+        return false;
     }
 
     // Find the value of the pixel at (0, 0), `find_trim` search for all pixels
@@ -37,14 +35,18 @@ VImage Trim::process(const VImage &image) const {
         threshold = threshold * 256;
     }
 
-    int left, top, width, height;
-    left = image.find_trim(&top, &width, &height,
-                           VImage::option()
-                               ->set("threshold", threshold)
-                               ->set("background", background(0, 0)));
+    *left = image.find_trim(top, width, height,
+                            VImage::option()
+                                ->set("threshold", threshold)
+                                ->set("background", background(0, 0)));
 
     // Sanity check, this usually happens when a high tolerance is specified
-    if (width == 0 || height == 0) {
+    return *width != 0 && *height != 0;
+}
+
+VImage Trim::process(const VImage &image) const {
+    int left, top, width, height;
+    if (!find_trim(image, &left, &top, &width, &height)) {
         // We could use shrink-on-load for the next thumbnail processor
         query_->update("trim", false);
 
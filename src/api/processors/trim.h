@@ -9,6 +9,20 @@ class Trim : ImageProcessor {
     using ImageProcessor::ImageProcessor;
 
     VImage process(const VImage &image) const override;
+
+    /**
+     * Find the bounding box of the image content, i.e. of the pixels that are
+     * significantly different from the pixel at (0, 0).
+     * @param image The source image.
+     * @param left Left edge of the bounding box.
+     * @param top Top edge of the bounding box.
+     * @param width Width of the bounding box.
+     * @param height Height of the bounding box.
+     * @return `false` if trimming isn't required, or if the whole image would
+     *         be trimmed.
+     */
+    bool find_trim(const VImage &image, int *left, int *top, int *width,
+                   int *height) const;
 };
 
 }  // namespace weserv::api::processors
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace weserv::api::utils {
+
+/**
+ * A thread-safe cache keyed by string, which evicts the least recently used
+ * entries once the total cost of its entries exceeds its maximum size. Each
+ * entry costs 1 unless a cost function is given, i.e. the maximum size is a
+ * number of entries by default.
+ * @tparam Value The type of the cached values, which are copied in and out.
+ */
+template <typename Value>
+class LruCache {
+ public:
+    /**
+     * Get the cost of a value, in the unit of the maximum size.
+     */
+    using Cost = std::function<size_t(const Value &)>;
+
+    explicit LruCache(Cost cost = nullptr) : cost_(std::move(cost)) {}
+
+    LruCache(const LruCache &) = delete;
+    LruCache &operator=(const LruCache &) = delete;
+
+    /**
+     * Set the maximum size, evicting the least recently used entries that
+     * no longer fit.
+     * @param max_size The maximum size. 0 disables the cache.
+     */
+    void set_max_size(size_t max_size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        max_size_ = max_size;
+        evict();
+    }
+
+    /**
+     * Whether the cache is enabled.
+     */
+    bool enabled() {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        return max_size_ > 0;
+    }
+
+    /**
+     * Whether a value of the given cost could be cached at all.
+     */
+    bool fits(size_t cost) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        return cost <= max_size_;
+    }
+
+    /**
+     * @return The number of values that were found since the process started.
+     */
+    size_t hits() {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        return hits_;
+    }
+
+    /**
+     * Find a value and mark it as most recently used.
+     * @param key The key of the value.
+     * @param value Set to the value, if found.
+     * @return `true` if the value was found.
+     */
+    bool find(const std::string &key, Value *value) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        auto it = index_.find(key);
+        if (it == index_.end()) {
+            return false;
+        }
+
+        entries_.splice(entries_.begin(), entries_, it->second);
+        ++hits_;
+
+        *value = it->second->value;
+        return true;
+    }
+
+    /**
+     * Insert a value, unless the key is already cached or the value doesn't
+     * fit in the cache.
+     * @param key The key of the value.
+     * @param value The value.
+     */
+    void insert(const std::string &key, const Value &value) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        size_t cost = cost_ ? cost_(value) : 1;
+        if (max_size_ == 0 || cost > max_size_ ||
+            index_.find(key) != index_.end()) {
+            return;
+        }
+
+        entries_.push_front({key, value, cost});
+        index_.emplace(key, entries_.begin());
+        size_ += cost;
+
+        evict();
+    }
+
+ private:
+    struct Entry {
+        std::string key;
+        Value value;
+        size_t cost;
+    };
+
+    void evict() {
+        while (size_ > max_size_ && !entries_.empty()) {
+            const auto &entry = entries_.back();
+
+            size_ -= entry.cost;
+            index_.erase(entry.key);
+            entries_.pop_back();
+        }
+    }
+
+    Cost cost_;
+
+    std::mutex mutex_;
+
+    size_t max_size_ = 0;
+    size_t size_ = 0;
+    size_t hits_ = 0;
+
+    /**
+     * Most recently used first.
+     */
+    std::list<Entry> entries_;
+    std::unordered_map<std::string, typename std::list<Entry>::iterator>
+        index_;
+};
+
+}  // namespace weserv::api::utils
@@ -75,6 +75,8 @@ int Status::http_code() const {
         case Code::UnsupportedSaver:
         case Code::LibvipsError:
             return 400;
+        case Code::Overloaded:
+            return 503;
         case Code::Unknown:
         default:
             return 500;
@@ -0,0 +1,286 @@
+#include "admission.h"
+
+#include "util.h"
+
+#include <algorithm>
+
+using weserv::api::enums::Output;
+
+namespace weserv::nginx {
+
+namespace {
+
+/**
+ * Pixels per byte assumed for images with unknown dimensions, a typical ratio
+ * for JPEG photos.
+ */
+constexpr uint64_t NGX_WESERV_ADMISSION_PIXELS_PER_BYTE = 4;
+
+/**
+ * The relative effort of encoding a pixel in the requested output format.
+ * Formats with an effort setting are weighted by it.
+ */
+uint64_t ngx_weserv_admission_weight(ngx_http_request_t *r,
+                                     const api::Config &config) {
+    switch (get_output_arg(r)) {
+        case Output::Avif:
+            return 2 + static_cast<uint64_t>(config.avif_effort);
+        case Output::Webp:
+            return 1 + static_cast<uint64_t>(config.webp_effort) / 2;
+        case Output::Png:
+        case Output::Gif:
+            return 2;
+        case Output::Json:
+            // Only the metadata is written
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+bool ngx_weserv_admission_fits(ngx_weserv_admission_t *admission,
+                               uint64_t cost) {
+    return admission->cost == 0 ||
+           admission->cost + cost <= admission->budget;
+}
+
+/**
+ * Admits the waiting requests that fit, strictly in order. A request that
+ * doesn't fit yet holds back the ones behind it, so that an expensive request
+ * can't be starved by cheaper ones.
+ */
+void ngx_weserv_admission_wake(ngx_weserv_admission_t *admission) {
+    ngx_queue_t *q = ngx_queue_head(&admission->queue);
+
+    while (q != ngx_queue_sentinel(&admission->queue)) {
+        auto *ticket = ngx_queue_data(q, ngx_weserv_admission_ticket_t, queue);
+
+        q = ngx_queue_next(q);
+
+        if (!ngx_weserv_admission_fits(admission, ticket->cost)) {
+            break;
+        }
+
+        ngx_queue_remove(&ticket->queue);
+        admission->queued--;
+
+        ticket->waiting = 0;
+        ticket->admitted = 1;
+        admission->cost += ticket->cost;
+
+        if (ticket->event.timer_set) {
+            ngx_del_timer(&ticket->event);
+        }
+
+        ngx_post_event(&ticket->event, &ngx_posted_events);
+    }
+}
+
+void ngx_weserv_admission_event_handler(ngx_event_t *ev) {
+    auto *ticket = static_cast<ngx_weserv_admission_ticket_t *>(ev->data);
+
+    ngx_http_request_t *r = ticket->request;
+    ngx_connection_t *c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    if (ev->timedout) {
+        ev->timedout = 0;
+
+        ngx_queue_remove(&ticket->queue);
+        ticket->admission->queued--;
+        ticket->waiting = 0;
+
+        // The requests behind might fit
+        ngx_weserv_admission_wake(ticket->admission);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "weserv admission: %s, cost: %uL",
+                   ticket->admitted ? "admitted" : "timed out", ticket->cost);
+
+    r->write_event_handler(r);
+    ngx_http_run_posted_requests(c);
+}
+
+void ngx_weserv_admission_cleanup(void *data) {
+    auto *ticket = static_cast<ngx_weserv_admission_ticket_t *>(data);
+
+    if (ticket->waiting) {
+        ngx_queue_remove(&ticket->queue);
+        ticket->admission->queued--;
+        ticket->waiting = 0;
+
+        ngx_weserv_admission_wake(ticket->admission);
+    }
+
+    if (ticket->event.timer_set) {
+        ngx_del_timer(&ticket->event);
+    }
+
+    if (ticket->event.posted) {
+        ngx_delete_posted_event(&ticket->event);
+    }
+
+    ngx_weserv_admission_release(ticket);
+}
+
+}  // namespace
+
+ngx_weserv_admission_t *ngx_weserv_admission_create(ngx_conf_t *cf,
+                                                    uint64_t budget) {
+    auto *admission = static_cast<ngx_weserv_admission_t *>(
+        ngx_pcalloc(cf->pool, sizeof(ngx_weserv_admission_t)));
+    if (admission == nullptr) {
+        return nullptr;
+    }
+
+    admission->budget = budget;
+
+    ngx_queue_init(&admission->queue);
+
+    return admission;
+}
+
+uint64_t ngx_weserv_admission_cost(ngx_http_request_t *r,
+                                   const api::Config &config,
+                                   const ngx_weserv_probe_t &dimensions,
+                                   size_t size) {
+    uint64_t pixels = dimensions.width * dimensions.height;
+    if (pixels == 0) {
+        pixels = size * NGX_WESERV_ADMISSION_PIXELS_PER_BYTE;
+    }
+
+    auto input = static_cast<double>(pixels);
+    double output = ngx_weserv_output_pixels(r, config, dimensions, input);
+
+    // The number of pages isn't known up front, so assume the worst when all
+    // pages are requested
+    ngx_int_t max_pages = config.max_pages > 0 ? config.max_pages : 256;
+    ngx_int_t pages = get_int_arg(r, "n", "pages", 1);
+    if (pages == -1 || pages > max_pages) {
+        pages = max_pages;
+    } else if (pages < 1) {
+        pages = 1;
+    }
+
+    double weight = ngx_weserv_admission_weight(r, config);
+
+    return static_cast<uint64_t>(pages * (input + output * weight));
+}
+
+double ngx_weserv_output_pixels(ngx_http_request_t *r,
+                                const api::Config &config,
+                                const ngx_weserv_probe_t &dimensions,
+                                double input) {
+    // Assume the output is as large as the input, unless the target
+    // dimensions say otherwise
+    double output = input;
+
+    ngx_int_t width = get_int_arg(r, "w", "width", 0);
+    ngx_int_t height = get_int_arg(r, "h", "height", 0);
+
+    if (width > 0 && height > 0) {
+        output = static_cast<double>(width) * height;
+    } else if (width > 0 && dimensions.width > 0) {
+        double scale = static_cast<double>(width) / dimensions.width;
+        output = input * scale * scale;
+    } else if (height > 0 && dimensions.height > 0) {
+        double scale = static_cast<double>(height) / dimensions.height;
+        output = input * scale * scale;
+    }
+
+    ngx_str_t dpr;
+    if ((width > 0 || height > 0) &&
+        ngx_http_arg(r, (u_char *)"dpr", 3, &dpr) == NGX_OK) {
+        ngx_int_t ratio = ngx_atofp(dpr.data, dpr.len, 2);
+        if (ratio != NGX_ERROR && ratio <= 800) {
+            output = output * ratio * ratio / 10000;
+        }
+    }
+
+    if (config.limit_output_pixels > 0) {
+        output = std::min(output,
+                          static_cast<double>(config.limit_output_pixels));
+    }
+
+    return output;
+}
+
+ngx_int_t ngx_weserv_admission_acquire(ngx_http_request_t *r,
+                                       ngx_weserv_admission_t *admission,
+                                       uint64_t cost, bool wait,
+                                       ngx_weserv_admission_ticket_t **ticket) {
+    if (*ticket != nullptr) {
+        if ((*ticket)->admitted) {
+            return NGX_OK;
+        }
+
+        return (*ticket)->waiting ? NGX_AGAIN : NGX_DECLINED;
+    }
+
+    // Waiting requests go first
+    bool fits = ngx_queue_empty(&admission->queue) &&
+                ngx_weserv_admission_fits(admission, cost);
+
+    if (!fits && (!wait || admission->queued >= admission->max_queued)) {
+        return NGX_DECLINED;
+    }
+
+    auto *t = static_cast<ngx_weserv_admission_ticket_t *>(
+        ngx_pcalloc(r->pool, sizeof(ngx_weserv_admission_ticket_t)));
+    if (t == nullptr) {
+        return NGX_ERROR;
+    }
+
+    ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == nullptr) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_weserv_admission_cleanup;
+    cln->data = t;
+
+    t->admission = admission;
+    t->request = r;
+    t->cost = cost;
+
+    t->event.handler = ngx_weserv_admission_event_handler;
+    t->event.data = t;
+    t->event.log = r->connection->log;
+
+    *ticket = t;
+
+    if (fits) {
+        t->admitted = 1;
+        admission->cost += cost;
+
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "weserv admission: waiting, cost: %uL", cost);
+
+    t->waiting = 1;
+    ngx_queue_insert_tail(&admission->queue, &t->queue);
+    admission->queued++;
+
+    ngx_add_timer(&t->event, admission->timeout);
+
+    return NGX_AGAIN;
+}
+
+void ngx_weserv_admission_release(ngx_weserv_admission_ticket_t *ticket) {
+    if (ticket == nullptr || !ticket->admitted) {
+        return;
+    }
+
+    ngx_weserv_admission_t *admission = ticket->admission;
+
+    ticket->admitted = 0;
+    admission->cost -= ticket->cost;
+
+    ngx_weserv_admission_wake(admission);
+}
+
+}  // namespace weserv::nginx
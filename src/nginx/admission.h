@@ -0,0 +1,113 @@
+#pragma once
+
+extern "C" {
+#include <ngx_http.h>
+}
+
+#include "probe.h"
+
+#include <weserv/config.h>
+
+#include <cstdint>
+
+namespace weserv::nginx {
+
+/**
+ * A budget for the estimated cost of the images that are processed
+ * concurrently, per worker process.
+ */
+struct ngx_weserv_admission_t {
+    /**
+     * The maximum cost of the images being processed, in pixels.
+     */
+    uint64_t budget;
+
+    /**
+     * The cost of the images being processed.
+     */
+    uint64_t cost;
+
+    /**
+     * The maximum number of images waiting for the budget, and how long an
+     * image may wait.
+     */
+    ngx_uint_t max_queued;
+    ngx_msec_t timeout;
+
+    /**
+     * The images waiting for the budget, oldest first.
+     */
+    ngx_queue_t queue;
+    ngx_uint_t queued;
+};
+
+/**
+ * The claim of a request on the budget.
+ */
+struct ngx_weserv_admission_ticket_t {
+    ngx_weserv_admission_t *admission;
+    ngx_http_request_t *request;
+    uint64_t cost;
+
+    ngx_queue_t queue;
+
+    /**
+     * Wakes up the request once it's admitted or has waited too long.
+     */
+    ngx_event_t event;
+
+    unsigned waiting : 1;
+    unsigned admitted : 1;
+};
+
+/**
+ * Creates a budget of the given cost, in pixels.
+ */
+ngx_weserv_admission_t *ngx_weserv_admission_create(ngx_conf_t *cf,
+                                                    uint64_t budget);
+
+/**
+ * Estimates the cost of processing an image, in pixels. This is the number
+ * of pixels that are decoded, plus the number of pixels that are encoded
+ * weighted by the effort of the output format.
+ * @param dimensions The dimensions of the image, zero if unknown.
+ * @param size The size of the image, in bytes.
+ */
+uint64_t ngx_weserv_admission_cost(ngx_http_request_t *r,
+                                   const api::Config &config,
+                                   const ngx_weserv_probe_t &dimensions,
+                                   size_t size);
+
+/**
+ * Estimates the number of pixels of the output image from the target
+ * dimensions of the request, which is the number of input pixels if the
+ * image isn't resized.
+ * @param dimensions The dimensions of the image, zero if unknown.
+ * @param input The number of pixels of the image.
+ */
+double ngx_weserv_output_pixels(ngx_http_request_t *r,
+                                const api::Config &config,
+                                const ngx_weserv_probe_t &dimensions,
+                                double input);
+
+/**
+ * Claims the given cost from the budget. A request that doesn't fit waits
+ * until enough of the budget is released, if wait is set. Its write event
+ * handler is invoked once it's admitted or has waited too long, after which
+ * this function should be called again. An image is always admitted if no
+ * other images are being processed, regardless of its cost.
+ * @return NGX_OK if the request is admitted, NGX_AGAIN if it's waiting,
+ *         NGX_DECLINED if it's rejected or NGX_ERROR if the allocation failed.
+ */
+ngx_int_t ngx_weserv_admission_acquire(ngx_http_request_t *r,
+                                       ngx_weserv_admission_t *admission,
+                                       uint64_t cost, bool wait,
+                                       ngx_weserv_admission_ticket_t **ticket);
+
+/**
+ * Returns the claimed cost to the budget, and admits the waiting requests
+ * that fit. This is a no-op if the ticket isn't admitted.
+ */
+void ngx_weserv_admission_release(ngx_weserv_admission_ticket_t *ticket);
+
+}  // namespace weserv::nginx
@@ -0,0 +1,108 @@
+#include "buffer.h"
+
+namespace weserv::nginx {
+
+void NgxInputBuffer::init(ngx_pool_t *pool, off_t length, size_t max_size) {
+    free();
+
+    pool_ = pool;
+    length_ = length;
+
+    if (length >= 0 &&
+        (max_size == 0 || static_cast<size_t>(length) <= max_size)) {
+        // A single slab that fits the entire image
+        max_size_ = static_cast<size_t>(length);
+        slab_size_ = ngx_max(max_size_, 1);
+    } else if (max_size == 0) {
+        // No limit, so the slab table grows as needed
+        max_size_ = NGX_MAX_SIZE_T_VALUE;
+        slab_size_ = NGX_WESERV_INPUT_SLAB_SIZE;
+        reserved_ = false;
+        return;
+    } else {
+        max_size_ = max_size;
+        slab_size_ = NGX_WESERV_INPUT_SLAB_SIZE;
+    }
+
+    slabs_.reserve((max_size_ + slab_size_ - 1) / slab_size_);
+    reserved_ = true;
+}
+
+ngx_int_t NgxInputBuffer::append(const u_char *data, size_t length) {
+    if (length > max_size_ - size_) {
+        return NGX_DECLINED;
+    }
+
+    while (length > 0) {
+        size_t offset = size_ % slab_size_;
+
+        if (offset == 0 && size_ / slab_size_ == slabs_.size()) {
+            // The last slab might be smaller than the slab size
+            auto *slab = static_cast<u_char *>(
+                ngx_palloc(pool_, ngx_min(slab_size_, max_size_ - size_)));
+            if (slab == nullptr) {
+                return NGX_ERROR;
+            }
+
+            slabs_.push_back(slab);
+        }
+
+        size_t n = ngx_min(length, slab_size_ - offset);
+
+        ngx_memcpy(slabs_[size_ / slab_size_] + offset, data, n);
+
+        data += n;
+        length -= n;
+        size_ += n;
+    }
+
+    return NGX_OK;
+}
+
+void NgxInputBuffer::copy(int64_t offset, void *data, size_t length) const {
+    auto *p = static_cast<u_char *>(data);
+
+    while (length > 0) {
+        size_t slab_offset = static_cast<size_t>(offset) % slab_size_;
+        size_t n = ngx_min(length, slab_size_ - slab_offset);
+
+        p = ngx_cpymem(p, slabs_[offset / slab_size_] + slab_offset, n);
+
+        offset += n;
+        length -= n;
+    }
+}
+
+ngx_str_t NgxInputBuffer::head() const {
+    if (slabs_.empty()) {
+        return ngx_null_string;
+    }
+
+    return {ngx_min(size_, slab_size_), slabs_[0]};
+}
+
+void NgxInputBuffer::md5_update(ngx_md5_t *md5) const {
+    size_t remaining = size_;
+
+    for (u_char *slab : slabs_) {
+        if (remaining == 0) {
+            break;
+        }
+
+        size_t n = ngx_min(remaining, slab_size_);
+        ngx_md5_update(md5, slab, n);
+
+        remaining -= n;
+    }
+}
+
+void NgxInputBuffer::free() {
+    for (u_char *slab : slabs_) {
+        ngx_pfree(pool_, slab);
+    }
+
+    slabs_.clear();
+    size_ = 0;
+}
+
+}  // namespace weserv::nginx
@@ -0,0 +1,109 @@
+#pragma once
+
+extern "C" {
+#include <ngx_core.h>
+#include <ngx_md5.h>
+}
+
+#include <vector>
+
+namespace weserv::nginx {
+
+/**
+ * The size of a slab when the length of the image is unknown up front.
+ */
+constexpr size_t NGX_WESERV_INPUT_SLAB_SIZE = 64 * 1024;
+
+/**
+ * A growable buffer for the incoming image, made up of fixed-size slabs. When
+ * the length of the image is known up front, a single slab is used.
+ * Otherwise (e.g. chunked responses), slabs are allocated as data arrives, so
+ * that memory usage tracks the actual image size rather than the maximum.
+ *
+ * Data that has been appended is never moved. As long as the slab table is
+ * reserved up front, the data can be read from another thread while more data
+ * is appended, provided the size is published safely.
+ */
+class NgxInputBuffer {
+ public:
+    /**
+     * Prepares the buffer for an incoming image.
+     * @param pool The pool to allocate the slabs from.
+     * @param length The expected length of the image, or -1 if unknown.
+     * @param max_size The maximum length of the image.
+     */
+    void init(ngx_pool_t *pool, off_t length, size_t max_size);
+
+    /**
+     * Append data to the buffer.
+     * @return NGX_OK on success, NGX_DECLINED if the data doesn't fit or
+     *         NGX_ERROR if the allocation failed.
+     */
+    ngx_int_t append(const u_char *data, size_t length);
+
+    /**
+     * Copy data from the buffer. The given range must have been appended
+     * before.
+     * @param offset Offset to start copying from.
+     * @param data Output buffer.
+     * @param length Number of bytes to copy.
+     */
+    void copy(int64_t offset, void *data, size_t length) const;
+
+    /**
+     * Feed the data appended so far to the given MD5 context.
+     */
+    void md5_update(ngx_md5_t *md5) const;
+
+    /**
+     * The data at the start of the buffer that is stored contiguously, i.e.
+     * the data appended to the first slab so far.
+     */
+    ngx_str_t head() const;
+
+    /**
+     * The number of bytes appended so far.
+     */
+    size_t size() const {
+        return size_;
+    }
+
+    /**
+     * The expected length of the image, or -1 if unknown.
+     */
+    off_t length() const {
+        return length_;
+    }
+
+    /**
+     * Indicates if the slab table is reserved up front, i.e. whether it's safe
+     * to read from another thread while data is being appended. This isn't
+     * the case when the length is unknown and there's no maximum size.
+     */
+    bool reserved() const {
+        return reserved_;
+    }
+
+    /**
+     * Release the memory of all slabs.
+     */
+    void free();
+
+ private:
+    ngx_pool_t *pool_ = nullptr;
+
+    size_t slab_size_ = 0;
+    size_t max_size_ = 0;
+    size_t size_ = 0;
+    off_t length_ = -1;
+
+    bool reserved_ = false;
+
+    /**
+     * Reserved up front when possible, so that appending never reallocates
+     * the slab table.
+     */
+    std::vector<u_char *> slabs_;
+};
+
+}  // namespace weserv::nginx
@@ -0,0 +1,845 @@
+#include "cache.h"
+
+#include "header.h"
+#include "stream.h"
+#include "util.h"
+
+extern "C" {
+#include <ngx_md5.h>
+}
+
+namespace weserv::nginx {
+
+namespace {
+
+/**
+ * An entry within the shared memory zone. The data consists of the fields,
+ * followed by the body.
+ */
+struct ngx_weserv_cache_node_t {
+    ngx_rbtree_node_t node;
+    ngx_queue_t queue;
+    u_char key[NGX_WESERV_CACHE_KEY_LEN];
+    time_t expires;
+    size_t fields_len[NGX_WESERV_CACHE_FIELDS];
+    size_t length;
+    u_char data[1];
+};
+
+/**
+ * A key that is being processed, see ngx_weserv_cache_lock.
+ */
+struct ngx_weserv_cache_lock_node_t {
+    ngx_rbtree_node_t node;
+    u_char key[NGX_WESERV_CACHE_KEY_LEN];
+
+    /**
+     * The time at which the lock is considered abandoned.
+     */
+    ngx_msec_t expires;
+
+    /**
+     * Identifies the request holding the lock, so that a request whose lock
+     * was taken over doesn't release the lock of its successor.
+     */
+    ngx_uint_t owner;
+};
+
+/**
+ * The state shared between all workers.
+ */
+struct ngx_weserv_cache_sh_t {
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+
+    /**
+     * The least recently used entries are at the tail.
+     */
+    ngx_queue_t queue;
+
+    ngx_rbtree_t locks;
+    ngx_rbtree_node_t locks_sentinel;
+
+    /**
+     * The owner of the most recently acquired lock.
+     */
+    ngx_uint_t lock_owner;
+};
+
+struct ngx_weserv_cache_ctx_t {
+    ngx_weserv_cache_sh_t *sh;
+    ngx_slab_pool_t *shpool;
+};
+
+/**
+ * Inserts a node of type T, keyed by the first bytes of its key.
+ * Reference: ngx_http_file_cache_rbtree_insert_value
+ */
+template <typename T>
+void ngx_weserv_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+                                          ngx_rbtree_node_t *node,
+                                          ngx_rbtree_node_t *sentinel) {
+    ngx_rbtree_node_t **p;
+
+    for (;;) {
+        if (node->key < temp->key) {
+            p = &temp->left;
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+        } else {
+            // node->key == temp->key
+            auto *cn = reinterpret_cast<T *>(node);
+            auto *cnt = reinterpret_cast<T *>(temp);
+
+            p = ngx_memcmp(cn->key, cnt->key, NGX_WESERV_CACHE_KEY_LEN) < 0
+                    ? &temp->left
+                    : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+/**
+ * Finds a node of type T within the given tree.
+ */
+template <typename T>
+T *ngx_weserv_cache_find(ngx_rbtree_t *rbtree, const u_char *key) {
+    ngx_rbtree_key_t node_key;
+    ngx_memcpy(&node_key, key, sizeof(ngx_rbtree_key_t));
+
+    ngx_rbtree_node_t *node = rbtree->root;
+    ngx_rbtree_node_t *sentinel = rbtree->sentinel;
+
+    while (node != sentinel) {
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        // node_key == node->key
+        auto *cn = reinterpret_cast<T *>(node);
+
+        ngx_int_t rc = ngx_memcmp(key, cn->key, NGX_WESERV_CACHE_KEY_LEN);
+        if (rc == 0) {
+            return cn;
+        }
+
+        node = rc < 0 ? node->left : node->right;
+    }
+
+    return nullptr;
+}
+
+ngx_weserv_cache_node_t *ngx_weserv_cache_find(ngx_weserv_cache_ctx_t *ctx,
+                                               const u_char *key) {
+    return ngx_weserv_cache_find<ngx_weserv_cache_node_t>(&ctx->sh->rbtree,
+                                                          key);
+}
+
+void ngx_weserv_cache_delete(ngx_weserv_cache_ctx_t *ctx,
+                             ngx_weserv_cache_node_t *cn) {
+    ngx_queue_remove(&cn->queue);
+    ngx_rbtree_delete(&ctx->sh->rbtree, &cn->node);
+    ngx_slab_free_locked(ctx->shpool, cn);
+}
+
+/**
+ * Removes up to two expired entries, or the least recently used entry if
+ * forced. Must be called with the shared memory zone locked.
+ * Reference: ngx_ssl_expire_sessions
+ * @return Whether an entry was removed.
+ */
+bool ngx_weserv_cache_expire(ngx_weserv_cache_ctx_t *ctx, bool force) {
+    time_t now = ngx_time();
+    bool removed = false;
+
+    for (ngx_uint_t n = 0; n < 2; n++) {
+        if (ngx_queue_empty(&ctx->sh->queue)) {
+            break;
+        }
+
+        ngx_queue_t *q = ngx_queue_last(&ctx->sh->queue);
+        auto *cn = ngx_queue_data(q, ngx_weserv_cache_node_t, queue);
+
+        if (!force && cn->expires > now) {
+            break;
+        }
+
+        ngx_weserv_cache_delete(ctx, cn);
+        removed = true;
+
+        if (force) {
+            break;
+        }
+    }
+
+    return removed;
+}
+
+/**
+ * A resolved address, as stored in the body of an entry.
+ */
+struct ngx_weserv_cache_addr_t {
+    socklen_t socklen;
+    ngx_sockaddr_t sockaddr;
+};
+
+/**
+ * Allocates and inserts an entry, replacing any existing entry with the same
+ * key. Must be called with the shared memory zone locked.
+ * @return A pointer to the body of the entry, to be filled in by the caller,
+ *         or nullptr if the entry doesn't fit.
+ */
+u_char *ngx_weserv_cache_insert_locked(ngx_shm_zone_t *shm_zone,
+                                       const u_char *key,
+                                       const ngx_weserv_cache_entry_t &entry,
+                                       size_t length) {
+    auto *ctx = static_cast<ngx_weserv_cache_ctx_t *>(shm_zone->data);
+
+    size_t size = offsetof(ngx_weserv_cache_node_t, data) + length;
+    for (const ngx_str_t &field : entry.fields) {
+        size += field.len;
+    }
+
+    ngx_weserv_cache_node_t *cn = ngx_weserv_cache_find(ctx, key);
+    if (cn != nullptr) {
+        ngx_weserv_cache_delete(ctx, cn);
+    }
+
+    // Don't let a single entry evict a large part of the cache
+    if (size > shm_zone->shm.size / 8) {
+        return nullptr;
+    }
+
+    (void)ngx_weserv_cache_expire(ctx, false);
+
+    void *node;
+    while ((node = ngx_slab_alloc_locked(ctx->shpool, size)) == nullptr) {
+        if (!ngx_weserv_cache_expire(ctx, true)) {
+            return nullptr;
+        }
+    }
+
+    cn = static_cast<ngx_weserv_cache_node_t *>(node);
+
+    ngx_memcpy(&cn->node.key, key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(cn->key, key, NGX_WESERV_CACHE_KEY_LEN);
+    cn->expires = entry.expires;
+    cn->length = length;
+
+    u_char *p = cn->data;
+
+    for (ngx_uint_t i = 0; i < NGX_WESERV_CACHE_FIELDS; i++) {
+        cn->fields_len[i] = entry.fields[i].len;
+        p = ngx_cpymem(p, entry.fields[i].data, entry.fields[i].len);
+    }
+
+    ngx_rbtree_insert(&ctx->sh->rbtree, &cn->node);
+    ngx_queue_insert_head(&ctx->sh->queue, &cn->queue);
+
+    return p;
+}
+
+void ngx_weserv_cache_lock_cleanup(void *data) {
+    ngx_weserv_cache_unlock(static_cast<ngx_weserv_base_ctx_t *>(data));
+}
+
+ngx_int_t ngx_weserv_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+    auto *octx = static_cast<ngx_weserv_cache_ctx_t *>(data);
+    auto *ctx = static_cast<ngx_weserv_cache_ctx_t *>(shm_zone->data);
+
+    if (octx != nullptr) {
+        // Reuse the cached images after a configuration reload
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+
+        return NGX_OK;
+    }
+
+    ctx->shpool = reinterpret_cast<ngx_slab_pool_t *>(shm_zone->shm.addr);
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = static_cast<ngx_weserv_cache_sh_t *>(ctx->shpool->data);
+
+        return NGX_OK;
+    }
+
+    ctx->sh = static_cast<ngx_weserv_cache_sh_t *>(
+        ngx_slab_alloc(ctx->shpool, sizeof(ngx_weserv_cache_sh_t)));
+    if (ctx->sh == nullptr) {
+        return NGX_ERROR;
+    }
+
+    ctx->shpool->data = ctx->sh;
+
+    ngx_rbtree_init(
+        &ctx->sh->rbtree, &ctx->sh->sentinel,
+        ngx_weserv_cache_rbtree_insert_value<ngx_weserv_cache_node_t>);
+
+    ngx_queue_init(&ctx->sh->queue);
+
+    ngx_rbtree_init(
+        &ctx->sh->locks, &ctx->sh->locks_sentinel,
+        ngx_weserv_cache_rbtree_insert_value<ngx_weserv_cache_lock_node_t>);
+
+    ctx->sh->lock_owner = 0;
+
+    size_t len =
+        sizeof(" in weserv cache zone \"\"") + shm_zone->shm.name.len;
+
+    ctx->shpool->log_ctx =
+        static_cast<u_char *>(ngx_slab_alloc(ctx->shpool, len));
+    if (ctx->shpool->log_ctx == nullptr) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(ctx->shpool->log_ctx, " in weserv cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    // Running out of memory is expected, the least recently used entries are
+    // evicted in that case
+    ctx->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+/**
+ * Sets the $weserv_cache_status variable.
+ */
+void ngx_weserv_cache_set_status(ngx_http_request_t *r, ngx_str_t status) {
+    auto *mc = static_cast<ngx_weserv_main_conf_t *>(
+        ngx_http_get_module_main_conf(r, ngx_weserv_module));
+
+    ngx_http_variable_value_t *v = &r->variables[mc->cache_status_index];
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->len = status.len;
+    v->data = status.data;
+}
+
+}  // namespace
+
+ngx_shm_zone_t *ngx_weserv_cache_add_zone(ngx_conf_t *cf, ngx_str_t *name,
+                                          size_t size) {
+    ngx_shm_zone_t *shm_zone =
+        ngx_shared_memory_add(cf, name, size, &ngx_weserv_module);
+    if (shm_zone == nullptr) {
+        return nullptr;
+    }
+
+    if (shm_zone->data == nullptr) {
+        shm_zone->data = ngx_pcalloc(cf->pool, sizeof(ngx_weserv_cache_ctx_t));
+        if (shm_zone->data == nullptr) {
+            return nullptr;
+        }
+
+        shm_zone->init = ngx_weserv_cache_init_zone;
+    }
+
+    return shm_zone;
+}
+
+ngx_int_t ngx_weserv_cache_args(ngx_http_request_t *r, ngx_str_t *args) {
+    // The parameters that the API skips, in alphabetical order
+    static ngx_str_t nginx_keys[] = {
+        ngx_string("default"),       ngx_string("encoding"),
+        ngx_string("errorredirect"), ngx_string("filename"),
+        ngx_string("maxage"),        ngx_string("url"),
+    };
+    constexpr size_t n_keys = sizeof(nginx_keys) / sizeof(nginx_keys[0]);
+
+    auto *mc = static_cast<ngx_weserv_main_conf_t *>(
+        ngx_http_get_module_main_conf(r, ngx_weserv_module));
+
+    std::string canonical =
+        mc->weserv->canonical_query(ngx_str_to_std(r->args));
+
+    size_t len = canonical.size();
+    ngx_str_t values[n_keys];
+
+    ngx_str_t arg;
+
+    for (size_t i = 0; i < n_keys; i++) {
+        if (ngx_http_arg(r, nginx_keys[i].data, nginx_keys[i].len, &arg) !=
+            NGX_OK) {
+            values[i].data = nullptr;
+            continue;
+        }
+
+        // Unescape the value, so that it's escaped the same way regardless of
+        // how the client did
+        auto *value = static_cast<u_char *>(ngx_pnalloc(r->pool, arg.len));
+        if (value == nullptr) {
+            return NGX_ERROR;
+        }
+
+        u_char *src = arg.data;
+        u_char *dst = value;
+
+        ngx_unescape_uri(&dst, &src, arg.len, 0);
+
+        values[i].data = value;
+        values[i].len = dst - value;
+
+        len += sizeof("&=") - 1 + nginx_keys[i].len + values[i].len +
+               2 * ngx_escape_uri(nullptr, values[i].data, values[i].len,
+                                  NGX_ESCAPE_ARGS);
+    }
+
+    auto *p = static_cast<u_char *>(ngx_pnalloc(r->pool, len));
+    if (p == nullptr) {
+        return NGX_ERROR;
+    }
+
+    args->data = p;
+    p = ngx_cpymem(p, canonical.data(), canonical.size());
+
+    for (size_t i = 0; i < n_keys; i++) {
+        if (values[i].data == nullptr) {
+            continue;
+        }
+
+        if (p != args->data) {
+            *p++ = '&';
+        }
+
+        p = ngx_cpymem(p, nginx_keys[i].data, nginx_keys[i].len);
+        *p++ = '=';
+        p = reinterpret_cast<u_char *>(ngx_escape_uri(
+            p, values[i].data, values[i].len, NGX_ESCAPE_ARGS));
+    }
+
+    args->len = p - args->data;
+
+    return NGX_OK;
+}
+
+void ngx_weserv_cache_key(const ngx_str_t &origin, const ngx_str_t &args,
+                          const api::Config &config, u_char *key) {
+    ngx_md5_t md5;
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, origin.data, origin.len);
+    ngx_md5_update(&md5, "\n", 1);
+    ngx_md5_update(&md5, args.data, args.len);
+    ngx_md5_update(&md5, "\n", 1);
+
+    // The configuration is allocated from zeroed memory, so any padding bytes
+    // are zero as well
+    ngx_md5_update(&md5, &config, sizeof(api::Config));
+
+    ngx_md5_final(key, &md5);
+}
+
+ngx_int_t ngx_weserv_cache_etag(ngx_http_request_t *r,
+                                const api::Config &config,
+                                const NgxInputBuffer &image, ngx_str_t *etag) {
+    // Equivalent queries share the cache entry, so they share the ETag as well
+    ngx_str_t args;
+    if (ngx_weserv_cache_args(r, &args) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_md5_t md5;
+    u_char hash[16];
+
+    ngx_md5_init(&md5);
+    image.md5_update(&md5);
+    ngx_md5_update(&md5, "\n", 1);
+    ngx_md5_update(&md5, args.data, args.len);
+    ngx_md5_update(&md5, "\n", 1);
+    ngx_md5_update(&md5, &config, sizeof(api::Config));
+    ngx_md5_final(hash, &md5);
+
+    etag->len = sizeof("\"\"") - 1 + 2 * sizeof(hash);
+    etag->data = static_cast<u_char *>(ngx_pnalloc(r->pool, etag->len));
+    if (etag->data == nullptr) {
+        return NGX_ERROR;
+    }
+
+    u_char *p = etag->data;
+    *p++ = '"';
+    p = ngx_hex_dump(p, hash, sizeof(hash));
+    *p = '"';
+
+    return NGX_OK;
+}
+
+void ngx_weserv_cache_url_key(const ngx_str_t &url, u_char *key) {
+    ngx_md5_t md5;
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, url.data, url.len);
+    ngx_md5_final(key, &md5);
+}
+
+ngx_int_t ngx_weserv_cache_lookup(ngx_pool_t *pool, ngx_shm_zone_t *shm_zone,
+                                  const u_char *key, bool stale,
+                                  ngx_weserv_cache_entry_t *entry) {
+    auto *ctx = static_cast<ngx_weserv_cache_ctx_t *>(shm_zone->data);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    ngx_weserv_cache_node_t *cn = ngx_weserv_cache_find(ctx, key);
+
+    if (cn == nullptr || (!stale && cn->expires <= ngx_time())) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    // Move to the head of the queue, since it's now the most recently used
+    ngx_queue_remove(&cn->queue);
+    ngx_queue_insert_head(&ctx->sh->queue, &cn->queue);
+
+    // The entry might be evicted as soon as the lock is released, so copy
+    // everything we need
+    size_t fields_len = 0;
+    for (size_t len : cn->fields_len) {
+        fields_len += len;
+    }
+
+    auto *p = static_cast<u_char *>(ngx_pnalloc(pool, fields_len));
+    entry->body = ngx_create_temp_buf(pool, cn->length);
+
+    if (p == nullptr || entry->body == nullptr) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return NGX_ERROR;
+    }
+
+    entry->expires = cn->expires;
+
+    u_char *data = cn->data;
+
+    for (ngx_uint_t i = 0; i < NGX_WESERV_CACHE_FIELDS; i++) {
+        entry->fields[i].len = cn->fields_len[i];
+        entry->fields[i].data = p;
+
+        p = ngx_cpymem(p, data, cn->fields_len[i]);
+        data += cn->fields_len[i];
+    }
+
+    entry->body->last = ngx_cpymem(entry->body->last, data, cn->length);
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return NGX_OK;
+}
+
+ngx_int_t ngx_weserv_cache_store(ngx_shm_zone_t *shm_zone, const u_char *key,
+                                 const ngx_weserv_cache_entry_t &entry,
+                                 ngx_chain_t *in, off_t length) {
+    auto *ctx = static_cast<ngx_weserv_cache_ctx_t *>(shm_zone->data);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    u_char *p = ngx_weserv_cache_insert_locked(shm_zone, key, entry,
+                                               static_cast<size_t>(length));
+    if (p == nullptr) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    for (ngx_chain_t *cl = in; cl; cl = cl->next) {
+        p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return NGX_OK;
+}
+
+ngx_int_t ngx_weserv_cache_store(ngx_shm_zone_t *shm_zone, const u_char *key,
+                                 const ngx_weserv_cache_entry_t &entry,
+                                 const NgxInputBuffer &image) {
+    auto *ctx = static_cast<ngx_weserv_cache_ctx_t *>(shm_zone->data);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    u_char *p =
+        ngx_weserv_cache_insert_locked(shm_zone, key, entry, image.size());
+    if (p == nullptr) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    image.copy(0, p, image.size());
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return NGX_OK;
+}
+
+ngx_int_t ngx_weserv_cache_refresh(ngx_shm_zone_t *shm_zone, const u_char *key,
+                                   time_t expires) {
+    auto *ctx = static_cast<ngx_weserv_cache_ctx_t *>(shm_zone->data);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    ngx_weserv_cache_node_t *cn = ngx_weserv_cache_find(ctx, key);
+    if (cn != nullptr) {
+        cn->expires = expires;
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return cn != nullptr ? NGX_OK : NGX_DECLINED;
+}
+
+ngx_int_t ngx_weserv_cache_lookup_image(ngx_http_request_t *r,
+                                        ngx_shm_zone_t *shm_zone,
+                                        const u_char *key, ngx_chain_t **out) {
+    ngx_weserv_cache_entry_t entry;
+
+    ngx_int_t rc = ngx_weserv_cache_lookup(r->pool, shm_zone, key, false,
+                                           &entry);
+    if (rc != NGX_OK) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "weserv cache miss");
+
+        ngx_weserv_cache_set_status(r, ngx_string("MISS"));
+
+        return rc;
+    }
+
+    ngx_buf_t *b = entry.body;
+    off_t length = b->last - b->pos;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "weserv cache hit: %O", length);
+
+    ngx_weserv_cache_set_status(r, ngx_string("HIT"));
+
+    b->last_buf = 1;
+    b->last_in_chain = 1;
+
+    ngx_chain_t *cl = ngx_alloc_chain_link(r->pool);
+    if (cl == nullptr) {
+        return NGX_ERROR;
+    }
+
+    cl->buf = b;
+    cl->next = nullptr;
+
+    if (set_image_headers(r, ngx_str_to_std(entry.fields[0]), length,
+                          entry.fields[1]) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (entry.fields[2].len != 0) {
+        if (set_etag_header(r, entry.fields[2]) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (test_if_none_match(r, entry.fields[2])) {
+            set_not_modified(r);
+
+            return NGX_HTTP_NOT_MODIFIED;
+        }
+    }
+
+    *out = cl;
+
+    return NGX_OK;
+}
+
+ngx_int_t ngx_weserv_cache_store_image(ngx_shm_zone_t *shm_zone,
+                                       const u_char *key, time_t valid,
+                                       const std::string &extension,
+                                       const ngx_str_t &canonical,
+                                       const ngx_str_t &etag, ngx_chain_t *in,
+                                       off_t length) {
+    if (length == 0) {
+        return NGX_DECLINED;
+    }
+
+    ngx_weserv_cache_entry_t entry{};
+    entry.expires = ngx_time() + valid;
+    entry.fields[0].data =
+        reinterpret_cast<u_char *>(const_cast<char *>(extension.data()));
+    entry.fields[0].len = extension.size();
+    entry.fields[1] = canonical;
+    entry.fields[2] = etag;
+
+    return ngx_weserv_cache_store(shm_zone, key, entry, in, length);
+}
+
+ngx_int_t ngx_weserv_cache_lock(ngx_http_request_t *r,
+                                ngx_shm_zone_t *shm_zone,
+                                ngx_weserv_base_ctx_t *ctx, ngx_msec_t age) {
+    auto *cache = static_cast<ngx_weserv_cache_ctx_t *>(shm_zone->data);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    auto *ln = ngx_weserv_cache_find<ngx_weserv_cache_lock_node_t>(
+        &cache->sh->locks, ctx->cache_key);
+
+    if (ln != nullptr) {
+        if (static_cast<ngx_msec_int_t>(ln->expires - ngx_current_msec) > 0) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_BUSY;
+        }
+
+        // The request holding the lock is taking too long, take it over
+        ngx_rbtree_delete(&cache->sh->locks, &ln->node);
+    } else {
+        void *node;
+        while ((node = ngx_slab_alloc_locked(
+                    cache->shpool, sizeof(ngx_weserv_cache_lock_node_t))) ==
+               nullptr) {
+            if (!ngx_weserv_cache_expire(cache, true)) {
+                ngx_shmtx_unlock(&cache->shpool->mutex);
+                return NGX_DECLINED;
+            }
+        }
+
+        ln = static_cast<ngx_weserv_cache_lock_node_t *>(node);
+
+        ngx_memcpy(&ln->node.key, ctx->cache_key, sizeof(ngx_rbtree_key_t));
+        ngx_memcpy(ln->key, ctx->cache_key, NGX_WESERV_CACHE_KEY_LEN);
+    }
+
+    ln->expires = ngx_current_msec + age;
+    ln->owner = ++cache->sh->lock_owner;
+
+    ngx_rbtree_insert(&cache->sh->locks, &ln->node);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ctx->cache_lock = shm_zone;
+    ctx->cache_lock_owner = ln->owner;
+
+    // Make sure the lock is released if the request is terminated early
+    ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == nullptr) {
+        ngx_weserv_cache_unlock(ctx);
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_weserv_cache_lock_cleanup;
+    cln->data = ctx;
+
+    return NGX_OK;
+}
+
+void ngx_weserv_cache_unlock(ngx_weserv_base_ctx_t *ctx) {
+    if (ctx->cache_lock == nullptr) {
+        return;
+    }
+
+    auto *cache = static_cast<ngx_weserv_cache_ctx_t *>(ctx->cache_lock->data);
+
+    ctx->cache_lock = nullptr;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    auto *ln = ngx_weserv_cache_find<ngx_weserv_cache_lock_node_t>(
+        &cache->sh->locks, ctx->cache_key);
+
+    // The lock might have been taken over by another request
+    if (ln != nullptr && ln->owner == ctx->cache_lock_owner) {
+        ngx_rbtree_delete(&cache->sh->locks, &ln->node);
+        ngx_slab_free_locked(cache->shpool, ln);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+ngx_int_t ngx_weserv_cache_lookup_addrs(ngx_pool_t *pool,
+                                        ngx_shm_zone_t *shm_zone,
+                                        const ngx_str_t &host,
+                                        ngx_http_upstream_resolved_t *ur) {
+    u_char key[NGX_WESERV_CACHE_KEY_LEN];
+    ngx_weserv_cache_url_key(host, key);
+
+    ngx_weserv_cache_entry_t entry;
+
+    ngx_int_t rc = ngx_weserv_cache_lookup(pool, shm_zone, key, false, &entry);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    // The addresses are used in place, the body is allocated suitably
+    // aligned
+    auto *addr = reinterpret_cast<ngx_weserv_cache_addr_t *>(entry.body->pos);
+    ngx_uint_t naddrs = (entry.body->last - entry.body->pos) /
+                        sizeof(ngx_weserv_cache_addr_t);
+
+    if (naddrs == 0) {
+        return NGX_DECLINED;
+    }
+
+    ur->addrs = static_cast<ngx_resolver_addr_t *>(
+        ngx_pcalloc(pool, naddrs * sizeof(ngx_resolver_addr_t)));
+    if (ur->addrs == nullptr) {
+        return NGX_ERROR;
+    }
+
+    for (ngx_uint_t i = 0; i < naddrs; i++) {
+        ur->addrs[i].sockaddr = &addr[i].sockaddr.sockaddr;
+        ur->addrs[i].socklen = addr[i].socklen;
+    }
+
+    ur->naddrs = naddrs;
+
+    return NGX_OK;
+}
+
+ngx_int_t ngx_weserv_cache_store_addrs(ngx_shm_zone_t *shm_zone,
+                                       const ngx_str_t &host, time_t valid,
+                                       const ngx_resolver_addr_t *addrs,
+                                       ngx_uint_t naddrs) {
+    if (valid <= 0 || naddrs == 0) {
+        return NGX_DECLINED;
+    }
+
+    u_char key[NGX_WESERV_CACHE_KEY_LEN];
+    ngx_weserv_cache_url_key(host, key);
+
+    ngx_weserv_cache_entry_t entry{};
+    entry.expires = ngx_time() + valid;
+
+    auto *ctx = static_cast<ngx_weserv_cache_ctx_t *>(shm_zone->data);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    u_char *p = ngx_weserv_cache_insert_locked(
+        shm_zone, key, entry, naddrs * sizeof(ngx_weserv_cache_addr_t));
+    if (p == nullptr) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    // The body within the node isn't necessarily aligned, so copy the
+    // records as a whole
+    for (ngx_uint_t i = 0; i < naddrs; i++) {
+        ngx_weserv_cache_addr_t addr{};
+        addr.socklen = addrs[i].socklen;
+        ngx_memcpy(&addr.sockaddr, addrs[i].sockaddr, addrs[i].socklen);
+
+        p = ngx_cpymem(p, &addr, sizeof(ngx_weserv_cache_addr_t));
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return NGX_OK;
+}
+
+}  // namespace weserv::nginx
@@ -0,0 +1,180 @@
+#pragma once
+
+extern "C" {
+#include <ngx_http.h>
+}
+
+#include "buffer.h"
+#include "module.h"
+
+#include <weserv/config.h>
+
+#include <string>
+
+namespace weserv::nginx {
+
+/**
+ * The number of strings stored along with the body of a cached entry.
+ */
+constexpr ngx_uint_t NGX_WESERV_CACHE_FIELDS = 3;
+
+/**
+ * A cached entry, copied out of the shared memory zone.
+ */
+struct ngx_weserv_cache_entry_t {
+    /**
+     * The time at which the entry becomes stale.
+     */
+    time_t expires;
+
+    /**
+     * Arbitrary strings, e.g. response headers. Unused fields are empty.
+     */
+    ngx_str_t fields[NGX_WESERV_CACHE_FIELDS];
+
+    /**
+     * The cached body. Unset when storing an entry.
+     */
+    ngx_buf_t *body;
+};
+
+/**
+ * Adds (or references, if the size is 0) a shared memory zone of a cache.
+ */
+ngx_shm_zone_t *ngx_weserv_cache_add_zone(ngx_conf_t *cf, ngx_str_t *name,
+                                          size_t size);
+
+/**
+ * Serializes the query string of the request into its canonical form, so that
+ * equivalent query strings share a cache key. The parameters handled by the
+ * module itself follow the API parameters, with their values URL-encoded
+ * regardless of how the client encoded them.
+ * @return NGX_OK or NGX_ERROR if the allocation failed.
+ */
+ngx_int_t ngx_weserv_cache_args(ngx_http_request_t *r, ngx_str_t *args);
+
+/**
+ * Calculates the cache key of a transformation, from the origin of the image,
+ * the canonical query string and the API configuration.
+ * @param origin The origin of the image.
+ * @param args The canonical query string, see ngx_weserv_cache_args.
+ * @param config The API configuration.
+ * @param key Output buffer of NGX_WESERV_CACHE_KEY_LEN bytes.
+ */
+void ngx_weserv_cache_key(const ngx_str_t &origin, const ngx_str_t &args,
+                          const api::Config &config, u_char *key);
+
+/**
+ * Calculates the cache key of an image at the given URL.
+ * @param url The URL of the image.
+ * @param key Output buffer of NGX_WESERV_CACHE_KEY_LEN bytes.
+ */
+void ngx_weserv_cache_url_key(const ngx_str_t &url, u_char *key);
+
+/**
+ * Calculates the strong ETag of a transformation, from the bytes of the
+ * incoming image, the canonical query string and the API configuration.
+ * @return NGX_OK or NGX_ERROR if the allocation failed.
+ */
+ngx_int_t ngx_weserv_cache_etag(ngx_http_request_t *r,
+                                const api::Config &config,
+                                const NgxInputBuffer &image, ngx_str_t *etag);
+
+/**
+ * Looks up an entry in the cache and copies it into the given pool.
+ * @param stale Whether to return stale entries as well.
+ * @return NGX_OK on a hit, NGX_DECLINED on a miss or NGX_ERROR if the
+ *         allocation failed.
+ */
+ngx_int_t ngx_weserv_cache_lookup(ngx_pool_t *pool, ngx_shm_zone_t *shm_zone,
+                                  const u_char *key, bool stale,
+                                  ngx_weserv_cache_entry_t *entry);
+
+/**
+ * Stores an entry in the cache, evicting the least recently used entries if
+ * needed. The body is given as an output chain of the given length.
+ * @return NGX_OK if the entry is stored or NGX_DECLINED if it doesn't fit.
+ */
+ngx_int_t ngx_weserv_cache_store(ngx_shm_zone_t *shm_zone, const u_char *key,
+                                 const ngx_weserv_cache_entry_t &entry,
+                                 ngx_chain_t *in, off_t length);
+
+/**
+ * Stores an entry in the cache, with the incoming image as body.
+ */
+ngx_int_t ngx_weserv_cache_store(ngx_shm_zone_t *shm_zone, const u_char *key,
+                                 const ngx_weserv_cache_entry_t &entry,
+                                 const NgxInputBuffer &image);
+
+/**
+ * Updates the time at which an entry becomes stale, e.g. after it has been
+ * revalidated.
+ * @return NGX_OK if the entry is updated or NGX_DECLINED if it's gone.
+ */
+ngx_int_t ngx_weserv_cache_refresh(ngx_shm_zone_t *shm_zone, const u_char *key,
+                                   time_t expires);
+
+/**
+ * Locks the cache key of the request, so that concurrent requests for the
+ * same transformation wait for its outcome instead of processing the image as
+ * well. The lock is released by ngx_weserv_cache_unlock or, at the latest,
+ * when the request is freed.
+ * Reference: ngx_http_file_cache_lock
+ * @param age The time after which the lock is considered abandoned.
+ * @return NGX_OK if the lock is acquired, NGX_BUSY if another request holds
+ *         it, NGX_DECLINED if there's no memory left for the lock or
+ *         NGX_ERROR.
+ */
+ngx_int_t ngx_weserv_cache_lock(ngx_http_request_t *r,
+                                ngx_shm_zone_t *shm_zone,
+                                ngx_weserv_base_ctx_t *ctx, ngx_msec_t age);
+
+/**
+ * Releases the lock acquired by ngx_weserv_cache_lock, if any.
+ */
+void ngx_weserv_cache_unlock(ngx_weserv_base_ctx_t *ctx);
+
+/**
+ * Looks up a transformed image in the cache. On a hit, the image is copied
+ * into an output chain and the response headers are set.
+ * @return NGX_OK on a hit, NGX_HTTP_NOT_MODIFIED on a hit that matches the
+ *         If-None-Match request header (the output chain is left unset),
+ *         NGX_DECLINED on a miss or NGX_ERROR if the allocation failed.
+ */
+ngx_int_t ngx_weserv_cache_lookup_image(ngx_http_request_t *r,
+                                        ngx_shm_zone_t *shm_zone,
+                                        const u_char *key, ngx_chain_t **out);
+
+/**
+ * Stores a transformed image in the cache.
+ * @return NGX_OK if the image is stored or NGX_DECLINED if it doesn't fit.
+ */
+ngx_int_t ngx_weserv_cache_store_image(ngx_shm_zone_t *shm_zone,
+                                       const u_char *key, time_t valid,
+                                       const std::string &extension,
+                                       const ngx_str_t &canonical,
+                                       const ngx_str_t &etag, ngx_chain_t *in,
+                                       off_t length);
+
+/**
+ * Looks up the resolved addresses of a host in the cache. The addresses are
+ * copied into the given pool.
+ * @return NGX_OK on a hit, NGX_DECLINED on a miss or NGX_ERROR if the
+ *         allocation failed.
+ */
+ngx_int_t ngx_weserv_cache_lookup_addrs(ngx_pool_t *pool,
+                                        ngx_shm_zone_t *shm_zone,
+                                        const ngx_str_t &host,
+                                        ngx_http_upstream_resolved_t *ur);
+
+/**
+ * Stores the resolved addresses of a host in the cache.
+ * @return NGX_OK if the addresses are stored or NGX_DECLINED if they don't
+ *         fit.
+ */
+ngx_int_t ngx_weserv_cache_store_addrs(ngx_shm_zone_t *shm_zone,
+                                       const ngx_str_t &host, time_t valid,
+                                       const ngx_resolver_addr_t *addrs,
+                                       ngx_uint_t naddrs);
+
+}  // namespace weserv::nginx
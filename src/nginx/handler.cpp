@@ -1,7 +1,9 @@
 #include "handler.h"
 
 #include "alloc.h"
+#include "cache.h"
 #include "error.h"
+#include "header.h"
 #include "http.h"
 #include "uri_parser.h"
 #include "util.h"
@@ -14,6 +16,270 @@ using weserv::api::utils::Status;
 
 namespace weserv::nginx {
 
+namespace {
+
+/**
+ * Processes an image from the origin cache, as if it was just received from
+ * the origin.
+ */
+ngx_int_t ngx_weserv_origin_cache_send(ngx_http_request_t *r,
+                                       ngx_weserv_upstream_ctx_t *ctx,
+                                       const ngx_weserv_cache_entry_t &origin) {
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "weserv origin cache hit");
+
+    ngx_chain_t *out = ngx_alloc_chain_link(r->pool);
+    if (out == nullptr) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    origin.body->last_buf = 1;
+    origin.body->last_in_chain = 1;
+
+    out->buf = origin.body;
+    out->next = nullptr;
+
+    ctx->canonical = origin.fields[2];
+
+    // The validators identify the image, see ngx_weserv_job_identity
+    ctx->origin_etag = origin.fields[0];
+    ctx->origin_last_modified = origin.fields[1];
+
+    // Nothing to store, the image is already cached
+    ctx->origin_cacheable = 0;
+
+    // Set the request's weserv module context
+    ngx_http_set_ctx(r, ctx, ngx_weserv_module);
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = ngx_buf_size(origin.body);
+
+    // The image filter holds back the header until the image is processed,
+    // so the body is passed even for HEAD requests
+    ngx_int_t rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, out);
+}
+
+/**
+ * A request waiting for another request that processes the same image.
+ */
+struct ngx_weserv_cache_wait_t {
+    ngx_http_request_t *request;
+    ngx_weserv_upstream_ctx_t *ctx;
+
+    /**
+     * The time at which we stop waiting and process the image ourselves.
+     */
+    ngx_msec_t deadline;
+
+    ngx_event_t event;
+};
+
+/**
+ * How often a waiting request checks whether the image is cached.
+ */
+constexpr ngx_msec_t NGX_WESERV_CACHE_LOCK_WAIT = 100;
+
+/**
+ * Requests the image from the origin, unless it's in the origin cache.
+ */
+ngx_int_t ngx_weserv_proxy_fetch(ngx_http_request_t *r,
+                                 ngx_weserv_loc_conf_t *lc,
+                                 ngx_weserv_upstream_ctx_t *ctx) {
+    ngx_weserv_cache_entry_t origin{};
+
+    if (lc->origin_cache.zone != nullptr
+#if NGX_DEBUG
+        && ctx->debug == 0
+#endif
+    ) {
+        ngx_weserv_cache_url_key(ctx->request->url(), ctx->origin_key);
+        ctx->origin_cacheable = 1;
+
+        ngx_int_t rc = ngx_weserv_cache_lookup(r->pool, lc->origin_cache.zone,
+                                               ctx->origin_key, true, &origin);
+        if (rc == NGX_ERROR) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        if (rc == NGX_OK && origin.expires > ngx_time()) {
+            return ngx_weserv_origin_cache_send(r, ctx, origin);
+        }
+
+        // Stale images can only be reused after revalidating them
+        if (rc == NGX_OK &&
+            (origin.fields[0].len != 0 || origin.fields[1].len != 0)) {
+            ctx->origin_cached = origin.body;
+
+            if (origin.fields[0].len != 0) {
+                ctx->request->set_header("If-None-Match", origin.fields[0]);
+            }
+
+            if (origin.fields[1].len != 0) {
+                ctx->request->set_header("If-Modified-Since",
+                                         origin.fields[1]);
+            }
+        }
+    }
+
+    // Set the request's weserv module context
+    ngx_http_set_ctx(r, ctx, ngx_weserv_module);
+
+    ngx_int_t rc = ngx_weserv_send_http_request(r, ctx);
+
+    if (rc == NGX_ERROR) {
+        ngx_chain_t *out = ngx_weserv_error_chain(r, ctx, ctx->response_status);
+        if (out == NGX_CHAIN_ERROR) {
+            return NGX_ERROR;
+        }
+
+        // Don't forget to reset the module context set above
+        ngx_http_set_ctx(r, nullptr, ngx_weserv_module);
+
+        return ngx_http_output_filter(r, out);
+    }
+
+    return rc;
+}
+
+/**
+ * Serves the image from the cache. On a miss, the image is requested, unless
+ * another request is already processing it.
+ * @return NGX_BUSY if another request is processing the image.
+ */
+ngx_int_t ngx_weserv_cache_handler(ngx_http_request_t *r,
+                                   ngx_weserv_loc_conf_t *lc,
+                                   ngx_weserv_upstream_ctx_t *ctx) {
+    ngx_chain_t *out;
+    ngx_int_t rc = ngx_weserv_cache_lookup_image(r, lc->cache.zone,
+                                                 ctx->cache_key, &out);
+    if (rc == NGX_ERROR) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    // The client already has the cached image
+    if (rc == NGX_HTTP_NOT_MODIFIED) {
+        return ngx_http_send_header(r);
+    }
+
+    // Serve the image from the cache, without requesting it
+    if (rc == NGX_OK) {
+        if (is_base64_needed(r)) {
+            out = output_chain_to_base64(r, out);
+            if (out == NGX_CHAIN_ERROR) {
+                return NGX_ERROR;
+            }
+        }
+
+        return ngx_http_output_filter(r, out);
+    }
+
+    if (lc->cache_lock) {
+        rc = ngx_weserv_cache_lock(r, lc->cache.zone, ctx,
+                                   lc->cache_lock_timeout);
+        if (rc == NGX_ERROR) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        if (rc == NGX_BUSY) {
+            return NGX_BUSY;
+        }
+    }
+
+    return ngx_weserv_proxy_fetch(r, lc, ctx);
+}
+
+/**
+ * Checks whether the request we're waiting for has finished.
+ * Reference: ngx_http_file_cache_lock_wait_handler
+ */
+void ngx_weserv_cache_wait_handler(ngx_event_t *ev) {
+    auto *wait = static_cast<ngx_weserv_cache_wait_t *>(ev->data);
+
+    ngx_http_request_t *r = wait->request;
+    ngx_connection_t *c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "weserv cache wait: \"%V?%V\"", &r->uri, &r->args);
+
+    auto *lc = static_cast<ngx_weserv_loc_conf_t *>(
+        ngx_http_get_module_loc_conf(r, ngx_weserv_module));
+
+    ngx_int_t rc = ngx_weserv_cache_handler(r, lc, wait->ctx);
+
+    if (rc == NGX_BUSY) {
+        if (static_cast<ngx_msec_int_t>(wait->deadline - ngx_current_msec) >
+            0) {
+            ngx_add_timer(ev, NGX_WESERV_CACHE_LOCK_WAIT);
+            return;
+        }
+
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "weserv cache lock timeout, processing the image");
+
+        rc = ngx_weserv_proxy_fetch(r, lc, wait->ctx);
+    }
+
+    ngx_http_finalize_request(r, rc);
+    ngx_http_run_posted_requests(c);
+}
+
+/**
+ * Removes the wait timer when the request is freed while waiting.
+ * Reference: ngx_http_file_cache_cleanup
+ */
+void ngx_weserv_cache_wait_cleanup(void *data) {
+    auto *wait = static_cast<ngx_weserv_cache_wait_t *>(data);
+
+    if (wait->event.timer_set) {
+        ngx_del_timer(&wait->event);
+    }
+}
+
+/**
+ * Waits for the request that's processing the same image.
+ */
+ngx_int_t ngx_weserv_cache_wait(ngx_http_request_t *r,
+                                ngx_weserv_loc_conf_t *lc,
+                                ngx_weserv_upstream_ctx_t *ctx) {
+    auto *wait = static_cast<ngx_weserv_cache_wait_t *>(
+        ngx_pcalloc(r->pool, sizeof(ngx_weserv_cache_wait_t)));
+    if (wait == nullptr) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    wait->request = r;
+    wait->ctx = ctx;
+    wait->deadline = ngx_current_msec + lc->cache_lock_timeout;
+    wait->event.handler = ngx_weserv_cache_wait_handler;
+    wait->event.data = wait;
+    wait->event.log = r->connection->log;
+
+    // The request might be terminated while waiting, e.g. when the client
+    // closes the connection, make sure the timer doesn't outlive it
+    ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == nullptr) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln->handler = ngx_weserv_cache_wait_cleanup;
+    cln->data = wait;
+
+    ngx_add_timer(&wait->event, NGX_WESERV_CACHE_LOCK_WAIT);
+
+    r->main->count++;
+
+    return NGX_DONE;
+}
+
+}  // namespace
+
 ngx_int_t ngx_weserv_request_handler(ngx_http_request_t *r) {
     auto *lc = static_cast<ngx_weserv_loc_conf_t *>(
         ngx_http_get_module_loc_conf(r, ngx_weserv_module));
@@ -47,6 +313,18 @@ ngx_int_t ngx_weserv_request_handler(ngx_http_request_t *r) {
         return ngx_http_output_filter(r, out);
     }
 
+    // Negotiate the output format and apply the client hints before the cache
+    // key is calculated
+    if (negotiate_output(r, lc->api_conf.savers, lc->auto_output) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (lc->client_hints.widths != nullptr &&
+        apply_client_hints(r, *lc->client_hints.widths,
+                           lc->client_hints.save_data_quality) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
     // Allocate a weserv upstream module context
     auto *ctx = register_pool_cleanup(r->pool, new (r->pool)
                                                    ngx_weserv_upstream_ctx_t());
@@ -67,9 +345,6 @@ ngx_int_t ngx_weserv_request_handler(ngx_http_request_t *r) {
     }
 #endif
 
-    // Set the request's weserv module context
-    ngx_http_set_ctx(r, ctx, ngx_weserv_module);
-
     auto http_request = std::make_unique<HTTPRequest>();
     http_request->set_url(parsed_uri)
         .set_max_redirects(lc->max_redirects)
@@ -78,18 +353,25 @@ ngx_int_t ngx_weserv_request_handler(ngx_http_request_t *r) {
     // Store the caller's request
     ctx->request = std::move(http_request);
 
-    rc = ngx_weserv_send_http_request(r, ctx);
+    if (lc->cache.zone == nullptr
+#if NGX_DEBUG
+        || ctx->debug != 0
+#endif
+    ) {
+        return ngx_weserv_proxy_fetch(r, lc, ctx);
+    }
 
-    if (rc == NGX_ERROR) {
-        ngx_chain_t *out = ngx_weserv_error_chain(r, ctx, ctx->response_status);
-        if (out == NGX_CHAIN_ERROR) {
-            return NGX_ERROR;
-        }
+    ngx_str_t args;
+    if (ngx_weserv_cache_args(r, &args) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-        // Don't forget to reset the module context set above
-        ngx_http_set_ctx(r, nullptr, ngx_weserv_module);
+    ngx_weserv_cache_key(parsed_uri, args, lc->api_conf, ctx->cache_key);
+    ctx->cacheable = 1;
 
-        return ngx_http_output_filter(r, out);
+    rc = ngx_weserv_cache_handler(r, lc, ctx);
+    if (rc == NGX_BUSY) {
+        return ngx_weserv_cache_wait(r, lc, ctx);
     }
 
     return rc;
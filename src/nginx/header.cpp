@@ -4,6 +4,8 @@
 
 #include <algorithm>
 
+using weserv::api::enums::Output;
+
 namespace weserv::nginx {
 
 const ngx_str_t CONTENT_DISPOSITION = ngx_string("Content-Disposition");
@@ -12,6 +14,160 @@ constexpr u_char CONTENT_DISPOSITION_LOWCASE[] = "content-disposition";
 const ngx_str_t LINK = ngx_string("Link");
 constexpr u_char LINK_LOWCASE[] = "link";
 
+const ngx_str_t VARY = ngx_string("Vary");
+constexpr u_char VARY_LOWCASE[] = "vary";
+
+const ngx_str_t ACCEPT_CH = ngx_string("Accept-CH");
+constexpr u_char ACCEPT_CH_LOWCASE[] = "accept-ch";
+
+namespace {
+
+/**
+ * Finds the first request header with the given name.
+ */
+ngx_table_elt_t *find_request_header(ngx_http_request_t *r,
+                                     const ngx_str_t &name) {
+    ngx_list_part_t *part = &r->headers_in.headers.part;
+    auto *h = static_cast<ngx_table_elt_t *>(part->elts);
+
+    for (ngx_uint_t i = 0; /* void */; i++) {
+        if (i >= part->nelts) {
+            if (part->next == nullptr) {
+                break;
+            }
+
+            part = part->next;
+            h = static_cast<ngx_table_elt_t *>(part->elts);
+            i = 0;
+        }
+
+        if (h[i].hash != 0 && h[i].key.len == name.len &&
+            ngx_strncasecmp(h[i].key.data, name.data, name.len) == 0) {
+            return &h[i];
+        }
+    }
+
+    return nullptr;
+}
+
+/**
+ * Indicates if the query has the given parameter, or its synonym.
+ */
+bool has_arg(ngx_http_request_t *r, const char *name,
+             const char *synonym = nullptr) {
+    ngx_str_t value;
+
+    return ngx_http_arg(r, (u_char *)name, ngx_strlen(name), &value) ==
+               NGX_OK ||
+           (synonym != nullptr &&
+            ngx_http_arg(r, (u_char *)synonym, ngx_strlen(synonym), &value) ==
+                NGX_OK);
+}
+
+/**
+ * Appends a parameter to the query. An empty value is omitted, e.g. `&we`.
+ */
+ngx_int_t append_arg(ngx_http_request_t *r, const ngx_str_t &name,
+                     const ngx_str_t &value) {
+    size_t len = r->args.len + sizeof("&=") - 1 + name.len + value.len;
+
+    auto *p = static_cast<u_char *>(ngx_pnalloc(r->pool, len));
+    if (p == nullptr) {
+        return NGX_ERROR;
+    }
+
+    u_char *o = ngx_cpymem(p, r->args.data, r->args.len);
+
+    if (r->args.len != 0) {
+        *o++ = '&';
+    }
+
+    o = ngx_cpymem(o, name.data, name.len);
+
+    if (value.len != 0) {
+        *o++ = '=';
+        o = ngx_cpymem(o, value.data, value.len);
+    }
+
+    r->args.data = p;
+    r->args.len = o - p;
+
+    return NGX_OK;
+}
+
+/**
+ * Indicates if the parameters of a media range set its quality to zero.
+ */
+bool is_zero_quality(u_char *start, u_char *end) {
+    while (start < end) {
+        if (*start++ != ';') {
+            continue;
+        }
+
+        while (start < end && *start == ' ') {
+            start++;
+        }
+
+        if (end - start < 2 || (start[0] | 0x20) != 'q' || start[1] != '=') {
+            continue;
+        }
+
+        start += 2;
+
+        // q=0, q=0.0, q=0.00 or q=0.000
+        if (start == end || *start != '0') {
+            return false;
+        }
+
+        for (start++; start < end && (*start == '.' || *start == '0');
+             start++) {
+            // void
+        }
+
+        return start == end || *start == ' ' || *start == ';';
+    }
+
+    return false;
+}
+
+/**
+ * Indicates if the value of an Accept header lists the given media type.
+ */
+bool accept_lists(const ngx_str_t &value, const ngx_str_t &type) {
+    u_char *start = value.data;
+    u_char *end = value.data + value.len;
+
+    while (start < end) {
+        while (start < end && (*start == ' ' || *start == ',')) {
+            start++;
+        }
+
+        u_char *p = start;
+
+        while (p < end && *p != ',' && *p != ';' && *p != ' ') {
+            p++;
+        }
+
+        bool match = static_cast<size_t>(p - start) == type.len &&
+                     ngx_strncasecmp(start, type.data, type.len) == 0;
+
+        // Skip the parameters of the media range
+        start = p;
+
+        while (start < end && *start != ',') {
+            start++;
+        }
+
+        if (match && !is_zero_quality(p, start)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+}  // namespace
+
 ngx_int_t set_expires_header(ngx_http_request_t *r, time_t max_age) {
     ngx_table_elt_t *e = r->headers_out.expires;
     if (e == nullptr) {
@@ -212,4 +368,372 @@ ngx_int_t set_link_header(ngx_http_request_t *r, const ngx_str_t &url) {
     return NGX_OK;
 }
 
+ngx_int_t set_etag_header(ngx_http_request_t *r, const ngx_str_t &etag) {
+    ngx_table_elt_t *h =
+        static_cast<ngx_table_elt_t *>(ngx_list_push(&r->headers_out.headers));
+    if (h == nullptr) {
+        return NGX_ERROR;
+    }
+
+    h->hash = 1;
+#if defined(nginx_version) && nginx_version >= 1023000
+    h->next = nullptr;
+#endif
+    ngx_str_set(&h->key, "ETag");
+    h->value = etag;
+
+    r->headers_out.etag = h;
+
+    return NGX_OK;
+}
+
+ngx_int_t set_retry_after_header(ngx_http_request_t *r, time_t delay) {
+    ngx_table_elt_t *h =
+        static_cast<ngx_table_elt_t *>(ngx_list_push(&r->headers_out.headers));
+    if (h == nullptr) {
+        return NGX_ERROR;
+    }
+
+    h->value.data =
+        static_cast<u_char *>(ngx_pnalloc(r->pool, NGX_TIME_T_LEN));
+    if (h->value.data == nullptr) {
+        h->hash = 0;
+        return NGX_ERROR;
+    }
+
+    h->hash = 1;
+#if defined(nginx_version) && nginx_version >= 1023000
+    h->next = nullptr;
+#endif
+    ngx_str_set(&h->key, "Retry-After");
+    h->value.len = ngx_sprintf(h->value.data, "%T", delay) - h->value.data;
+
+    return NGX_OK;
+}
+
+ngx_int_t set_vary_header(ngx_http_request_t *r, const ngx_str_t &header) {
+    auto *h =
+        static_cast<ngx_table_elt_t *>(ngx_list_push(&r->headers_out.headers));
+    if (h == nullptr) {
+        return NGX_ERROR;
+    }
+
+    h->key = VARY;
+    h->lowcase_key = const_cast<u_char *>(VARY_LOWCASE);
+    h->hash = ngx_hash_key(const_cast<u_char *>(VARY_LOWCASE),
+                           sizeof(VARY_LOWCASE) - 1);
+#if defined(nginx_version) && nginx_version >= 1023000
+    h->next = nullptr;
+#endif
+
+    h->value = header;
+
+    return NGX_OK;
+}
+
+bool test_accept(ngx_http_request_t *r, const ngx_str_t &type) {
+    ngx_str_t name = ngx_string("Accept");
+
+    // The media ranges may be split across multiple Accept headers
+    ngx_list_part_t *part = &r->headers_in.headers.part;
+    auto *h = static_cast<ngx_table_elt_t *>(part->elts);
+
+    for (ngx_uint_t i = 0; /* void */; i++) {
+        if (i >= part->nelts) {
+            if (part->next == nullptr) {
+                break;
+            }
+
+            part = part->next;
+            h = static_cast<ngx_table_elt_t *>(part->elts);
+            i = 0;
+        }
+
+        if (h[i].hash != 0 && h[i].key.len == name.len &&
+            ngx_strncasecmp(h[i].key.data, name.data, name.len) == 0 &&
+            accept_lists(h[i].value, type)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+ngx_int_t negotiate_output(ngx_http_request_t *r, uintptr_t savers,
+                           bool by_default) {
+    ngx_str_t output;
+    bool given = ngx_http_arg(r, (u_char *)"output", 6, &output) == NGX_OK;
+
+    if (given) {
+        // An explicit output format is honored as is
+        if (output.len != 4 ||
+            ngx_strncasecmp(output.data, (u_char *)"auto", 4) != 0) {
+            return NGX_OK;
+        }
+    } else if (!by_default) {
+        return NGX_OK;
+    }
+
+    // Animations can't be saved as AVIF
+    ngx_int_t pages = get_int_arg(r, "n", "pages", 1);
+
+    static const struct {
+        Output output;
+        ngx_str_t type;
+        ngx_str_t name;
+    } candidates[] = {
+        {Output::Avif, ngx_string("image/avif"), ngx_string("avif")},
+        {Output::Webp, ngx_string("image/webp"), ngx_string("webp")},
+    };
+
+    ngx_str_t name = ngx_null_string;
+
+    for (const auto &c : candidates) {
+        if ((savers & static_cast<uintptr_t>(c.output)) == 0 ||
+            (c.output == Output::Avif && pages != 1)) {
+            continue;
+        }
+
+        if (test_accept(r, c.type)) {
+            name = c.name;
+            break;
+        }
+    }
+
+    // Keep the format of the origin image when nothing better is accepted
+    if (name.len == 0 && given) {
+        ngx_str_set(&name, "origin");
+    }
+
+    if (given) {
+        // Replace `auto` within the query
+        size_t prefix = output.data - r->args.data;
+        size_t suffix = r->args.len - prefix - output.len;
+
+        auto *p = static_cast<u_char *>(
+            ngx_pnalloc(r->pool, prefix + name.len + suffix));
+        if (p == nullptr) {
+            return NGX_ERROR;
+        }
+
+        u_char *o = ngx_cpymem(p, r->args.data, prefix);
+        o = ngx_cpymem(o, name.data, name.len);
+        o = ngx_cpymem(o, output.data + output.len, suffix);
+
+        r->args.data = p;
+        r->args.len = o - p;
+    } else if (name.len != 0) {
+        ngx_str_t key = ngx_string("output");
+
+        if (append_arg(r, key, name) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_str_t accept = ngx_string("Accept");
+
+    return set_vary_header(r, accept);
+}
+
+ngx_int_t apply_client_hints(ngx_http_request_t *r, const ngx_array_t &widths,
+                             ngx_uint_t save_data_quality) {
+    static ngx_str_t width_hint = ngx_string("Sec-CH-Width");
+    static ngx_str_t viewport_hint = ngx_string("Sec-CH-Viewport-Width");
+    static ngx_str_t dpr_hint = ngx_string("Sec-CH-DPR");
+    static ngx_str_t save_data_hint = ngx_string("Save-Data");
+
+    // Pixel ratios are rounded up to one of these, in hundredths
+    static const struct {
+        ngx_int_t ratio;
+        ngx_str_t value;
+    } ratios[] = {
+        {100, ngx_string("1")},
+        {150, ngx_string("1.5")},
+        {200, ngx_string("2")},
+        {300, ngx_string("3")},
+    };
+
+    u_char vary[128];
+    u_char *last = vary;
+
+    bool has_width = has_arg(r, "w", "width");
+    bool has_height = has_arg(r, "h", "height");
+
+    ngx_int_t dpr = NGX_ERROR;
+    ngx_table_elt_t *h = find_request_header(r, dpr_hint);
+    if (h != nullptr) {
+        dpr = ngx_atofp(h->value.data, h->value.len, 2);
+    }
+
+    if (!has_width && !has_height) {
+        last = ngx_sprintf(last, "%V, %V, %V, ", &width_hint, &viewport_hint,
+                           &dpr_hint);
+
+        // The width hint is in physical pixels, the viewport width isn't
+        ngx_int_t width = NGX_ERROR;
+        if ((h = find_request_header(r, width_hint)) != nullptr) {
+            width = ngx_atoi(h->value.data, h->value.len);
+        } else if ((h = find_request_header(r, viewport_hint)) != nullptr) {
+            width = ngx_atoi(h->value.data, h->value.len);
+            if (width != NGX_ERROR) {
+                width = width * (dpr > 0 && dpr <= 800 ? dpr : 100) / 100;
+            }
+        }
+
+        if (width > 0) {
+            auto *bucket = static_cast<ngx_uint_t *>(widths.elts);
+            ngx_uint_t n = 0;
+
+            while (n < widths.nelts - 1 &&
+                   bucket[n] < static_cast<ngx_uint_t>(width)) {
+                n++;
+            }
+
+            u_char buf[NGX_INT_T_LEN];
+            ngx_str_t value;
+            value.data = buf;
+            value.len = ngx_sprintf(buf, "%ui", bucket[n]) - buf;
+
+            ngx_str_t key = ngx_string("w");
+            ngx_str_t we = ngx_string("we");
+            ngx_str_t empty = ngx_null_string;
+
+            if (append_arg(r, key, value) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            // Don't enlarge images that are smaller than the hinted width
+            if (!has_arg(r, "we") && append_arg(r, we, empty) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+    } else if (!has_arg(r, "dpr")) {
+        last = ngx_sprintf(last, "%V, ", &dpr_hint);
+
+        if (dpr > 0) {
+            size_t n = 0;
+
+            while (n < sizeof(ratios) / sizeof(ratios[0]) - 1 &&
+                   ratios[n].ratio < dpr) {
+                n++;
+            }
+
+            ngx_str_t key = ngx_string("dpr");
+
+            if (append_arg(r, key, ratios[n].value) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    if (!has_arg(r, "q", "quality")) {
+        last = ngx_sprintf(last, "%V, ", &save_data_hint);
+
+        h = find_request_header(r, save_data_hint);
+        if (h != nullptr && h->value.len == 2 &&
+            ngx_strncasecmp(h->value.data, (u_char *)"on", 2) == 0) {
+            u_char buf[NGX_INT_T_LEN];
+            ngx_str_t value;
+            value.data = buf;
+            value.len = ngx_sprintf(buf, "%ui", save_data_quality) - buf;
+
+            ngx_str_t key = ngx_string("q");
+
+            if (append_arg(r, key, value) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    // Let browsers send the hints on subsequent requests
+    auto *accept_ch =
+        static_cast<ngx_table_elt_t *>(ngx_list_push(&r->headers_out.headers));
+    if (accept_ch == nullptr) {
+        return NGX_ERROR;
+    }
+
+    accept_ch->key = ACCEPT_CH;
+    accept_ch->lowcase_key = const_cast<u_char *>(ACCEPT_CH_LOWCASE);
+    accept_ch->hash = ngx_hash_key(const_cast<u_char *>(ACCEPT_CH_LOWCASE),
+                                   sizeof(ACCEPT_CH_LOWCASE) - 1);
+#if defined(nginx_version) && nginx_version >= 1023000
+    accept_ch->next = nullptr;
+#endif
+    ngx_str_set(&accept_ch->value,
+                "Sec-CH-Width, Sec-CH-Viewport-Width, Sec-CH-DPR");
+
+    if (last == vary) {
+        return NGX_OK;
+    }
+
+    // Without the trailing ", "
+    ngx_str_t value;
+    value.len = last - vary - 2;
+    value.data = static_cast<u_char *>(ngx_pnalloc(r->pool, value.len));
+    if (value.data == nullptr) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(value.data, vary, value.len);
+
+    return set_vary_header(r, value);
+}
+
+bool test_if_none_match(ngx_http_request_t *r, const ngx_str_t &etag) {
+    ngx_table_elt_t *header = r->headers_in.if_none_match;
+    if (header == nullptr || etag.len == 0) {
+        return false;
+    }
+
+    if (header->value.len == 1 && header->value.data[0] == '*') {
+        return true;
+    }
+
+    u_char *start = header->value.data;
+    u_char *end = header->value.data + header->value.len;
+
+    while (start < end) {
+        // If-None-Match uses the weak comparison function
+        if (end - start > 2 && start[0] == 'W' && start[1] == '/') {
+            start += 2;
+        }
+
+        if (static_cast<size_t>(end - start) >= etag.len &&
+            ngx_strncmp(start, etag.data, etag.len) == 0) {
+            u_char *p = start + etag.len;
+
+            if (p == end || *p == ' ' || *p == ',') {
+                return true;
+            }
+        }
+
+        while (start < end && *start != ',') {
+            start++;
+        }
+
+        while (start < end) {
+            if (*start != ' ' && *start != ',') {
+                break;
+            }
+
+            start++;
+        }
+    }
+
+    return false;
+}
+
+void set_not_modified(ngx_http_request_t *r) {
+    r->headers_out.status = NGX_HTTP_NOT_MODIFIED;
+    r->headers_out.status_line.len = 0;
+    r->headers_out.content_type.len = 0;
+    ngx_http_clear_content_length(r);
+    ngx_http_clear_accept_ranges(r);
+
+    if (r->headers_out.content_encoding != nullptr) {
+        r->headers_out.content_encoding->hash = 0;
+        r->headers_out.content_encoding = nullptr;
+    }
+}
+
 }  // namespace weserv::nginx
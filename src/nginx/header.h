@@ -4,6 +4,7 @@ extern "C" {
 #include <ngx_http.h>
 }
 
+#include <cstdint>
 #include <ctime>
 #include <string>
 
@@ -24,4 +25,57 @@ ngx_int_t set_location_header(ngx_http_request_t *r, ngx_str_t *value);
 
 ngx_int_t set_link_header(ngx_http_request_t *r, const ngx_str_t &url);
 
+/**
+ * Reference: ngx_http_set_etag
+ */
+ngx_int_t set_etag_header(ngx_http_request_t *r, const ngx_str_t &etag);
+
+/**
+ * Asks the client to retry after the given number of seconds.
+ */
+ngx_int_t set_retry_after_header(ngx_http_request_t *r, time_t delay);
+
+/**
+ * Adds the given request header to the Vary response header.
+ */
+ngx_int_t set_vary_header(ngx_http_request_t *r, const ngx_str_t &header);
+
+/**
+ * Indicates if any Accept request header lists the given media type with a
+ * non-zero quality. Wildcards are ignored, since browsers send them anyway.
+ */
+bool test_accept(ngx_http_request_t *r, const ngx_str_t &type);
+
+/**
+ * Negotiates the output format of `&output=auto`, or of images without an
+ * `&output=` query if by_default is set. The best format that's enabled
+ * within savers and accepted by the client is written into the query,
+ * so that it's part of the cache key and ETag.
+ */
+ngx_int_t negotiate_output(ngx_http_request_t *r, uintptr_t savers,
+                           bool by_default);
+
+/**
+ * Takes the target width, pixel ratio and quality from the Sec-CH-Width,
+ * Sec-CH-Viewport-Width, Sec-CH-DPR and Save-Data request headers, if the
+ * query omits them. Hinted widths are rounded up to one of the given widths,
+ * so that the number of variants stays small.
+ * @param widths Array of ngx_uint_t, in ascending order.
+ * @param save_data_quality The quality used if the client asks to save data.
+ */
+ngx_int_t apply_client_hints(ngx_http_request_t *r, const ngx_array_t &widths,
+                             ngx_uint_t save_data_quality);
+
+/**
+ * Indicates if the If-None-Match request header matches the given ETag.
+ * Reference: ngx_http_test_if_match
+ */
+bool test_if_none_match(ngx_http_request_t *r, const ngx_str_t &etag);
+
+/**
+ * Turns the response into a 304 Not Modified.
+ * Reference: ngx_http_not_modified_header_filter
+ */
+void set_not_modified(ngx_http_request_t *r);
+
 }  // namespace weserv::nginx
@@ -1,7 +1,9 @@
 #include "http.h"
 
 #include "alloc.h"
+#include "cache.h"
 #include "http_filter.h"
+#include "keepalive.h"
 #include "uri_parser.h"
 #include "util.h"
 
@@ -32,7 +34,9 @@ ngx_int_t ngx_weserv_upstream_process_header(ngx_http_request_t *r);
  */
 Status ngx_weserv_upstream_set_url(ngx_pool_t *pool,
                                    ngx_http_upstream_t *upstream, ngx_str_t url,
-                                   ngx_array_t *deny, ngx_str_t *host_header,
+                                   ngx_array_t *deny,
+                                   ngx_http_upstream_resolved_t **resolved,
+                                   ngx_str_t *host_header,
                                    ngx_str_t *url_path) {
     ngx_url_t parsed_url;
     ngx_memzero(&parsed_url, sizeof(parsed_url));
@@ -106,27 +110,29 @@ Status ngx_weserv_upstream_set_url(ngx_pool_t *pool,
         parsed_url.uri.data = p;
     }
 
-    // Populate the upstream config structure with the parsed URL
+    // Populate the resolved structure with the parsed URL. The host name is
+    // resolved later on, see ngx_weserv_upstream_resolve.
 
-    upstream->resolved = new (pool) ngx_http_upstream_resolved_t;
-    if (upstream->resolved == nullptr) {
+    auto *ur = new (pool) ngx_http_upstream_resolved_t;
+    if (ur == nullptr) {
         return {NGX_ERROR, "Out of memory"};
     }
 
     if (has_ip) {
         // NGINX only returned the parsed IP address, so there is just one
         // address to return. See ngx_parse_url and ngx_inet_addr for details.
-        upstream->resolved->sockaddr = parsed_url.addrs[0].sockaddr;
-        upstream->resolved->socklen = parsed_url.addrs[0].socklen;
-        upstream->resolved->naddrs = 1;
-        upstream->resolved->host = parsed_url.addrs[0].name;
+        ur->sockaddr = parsed_url.addrs[0].sockaddr;
+        ur->socklen = parsed_url.addrs[0].socklen;
+        ur->naddrs = 1;
+        ur->host = parsed_url.addrs[0].name;
     } else {
-        upstream->resolved->host = parsed_url.host;
+        ur->host = parsed_url.host;
     }
 
-    upstream->resolved->no_port = parsed_url.no_port;
-    upstream->resolved->port =
-        parsed_url.no_port ? parsed_url.default_port : parsed_url.port;
+    ur->no_port = parsed_url.no_port;
+    ur->port = parsed_url.no_port ? parsed_url.default_port : parsed_url.port;
+
+    *resolved = ur;
 
     // Return Host header and a URL path
     *host_header = parsed_url.host;
@@ -317,6 +323,98 @@ ngx_int_t ngx_weserv_upstream_reinit_request(ngx_http_request_t *r) {
     return NGX_OK;
 }
 
+/**
+ * Parses the response headers that control caching within the origin cache,
+ * or that identify the image.
+ * Reference: ngx_http_upstream_process_cache_control
+ */
+void ngx_weserv_upstream_parse_cache_header(ngx_http_request_t *r,
+                                            ngx_weserv_upstream_ctx_t *ctx,
+                                            const ngx_str_t &name,
+                                            const ngx_str_t &value) {
+    static ngx_str_t etag = ngx_string("etag");
+    static ngx_str_t last_modified = ngx_string("last-modified");
+    static ngx_str_t expires = ngx_string("expires");
+    static ngx_str_t cache_control = ngx_string("cache-control");
+
+    if (ngx_string_equal(name, etag)) {
+        ctx->origin_etag.data =
+            ngx_pstrdup(r->pool, const_cast<ngx_str_t *>(&value));
+        ctx->origin_etag.len =
+            ctx->origin_etag.data != nullptr ? value.len : 0;
+        return;
+    }
+
+    if (ngx_string_equal(name, last_modified)) {
+        ctx->origin_last_modified.data =
+            ngx_pstrdup(r->pool, const_cast<ngx_str_t *>(&value));
+        ctx->origin_last_modified.len =
+            ctx->origin_last_modified.data != nullptr ? value.len : 0;
+        return;
+    }
+
+    if (ngx_string_equal(name, expires)) {
+        // An invalid date represents a time in the past
+        ctx->expires = ngx_parse_http_time(value.data, value.len);
+        if (ctx->expires == NGX_ERROR) {
+            ctx->expires = 0;
+        }
+
+        return;
+    }
+
+    if (!ngx_string_equal(name, cache_control)) {
+        return;
+    }
+
+    u_char *start = value.data;
+    u_char *last = value.data + value.len;
+
+    if (ngx_strlcasestrn(start, last, (u_char *)"no-store", 8 - 1) != nullptr ||
+        ngx_strlcasestrn(start, last, (u_char *)"private", 7 - 1) != nullptr) {
+        ctx->no_store = 1;
+        return;
+    }
+
+    if (ngx_strlcasestrn(start, last, (u_char *)"no-cache", 8 - 1) != nullptr) {
+        ctx->no_cache = 1;
+        return;
+    }
+
+    // We're a shared cache, so s-maxage takes precedence over max-age
+    ngx_uint_t offset = 9;
+    u_char *p = ngx_strlcasestrn(start, last, (u_char *)"s-maxage=", 9 - 1);
+
+    if (p == nullptr) {
+        offset = 8;
+        p = ngx_strlcasestrn(start, last, (u_char *)"max-age=", 8 - 1);
+    }
+
+    if (p == nullptr) {
+        return;
+    }
+
+    time_t n = 0;
+
+    for (p += offset; p < last; p++) {
+        if (*p == ',' || *p == ';' || *p == ' ') {
+            break;
+        }
+
+        if (*p < '0' || *p > '9') {
+            return;
+        }
+
+        if (n >= NGX_MAX_TIME_T_VALUE / 10) {
+            return;
+        }
+
+        n = n * 10 + (*p - '0');
+    }
+
+    ctx->max_age = n;
+}
+
 /**
  * A handler called to parse response status line.
  *
@@ -369,14 +467,28 @@ ngx_int_t ngx_weserv_upstream_process_status_line(ngx_http_request_t *r) {
         return NGX_OK;
     }
 
+    // A 304 is only expected while revalidating a stale image from the origin
+    // cache, in which case the stale image can be used
+    ctx->not_modified = status.code == 304 && ctx->origin_cached != nullptr;
+
     // We assume that status codes between 300-308 are redirects
-    ctx->redirecting = status.code >= 300 && status.code <= 308;
+    ctx->redirecting = !ctx->not_modified && status.code >= 300 &&
+                       status.code <= 308;
+
+    // Forget the caching headers of any previous response in the chain
+    ctx->origin_etag.len = 0;
+    ctx->origin_last_modified.len = 0;
+    ctx->max_age = -1;
+    ctx->expires = -1;
+    ctx->no_store = 0;
+    ctx->no_cache = 0;
 
     // Don't parse further if:
     // - a non 200 status code is returned
     // - we're not redirecting
+    // - we're not revalidating a stale image
     // - we're not debugging responses
-    if (status.code != 200 && !ctx->redirecting
+    if (status.code != 200 && !ctx->redirecting && !ctx->not_modified
 #if NGX_DEBUG
         && ctx->debug == 0
 #endif
@@ -413,8 +525,9 @@ ngx_int_t ngx_weserv_upstream_process_status_line(ngx_http_request_t *r) {
     }
 
     // Store the parsed response status for later
-    ctx->response_status = {static_cast<int>(status.code), "",
-                            Status::ErrorCause::Upstream};
+    ctx->response_status = {
+        static_cast<int>(ctx->not_modified ? 200 : status.code), "",
+        Status::ErrorCause::Upstream};
 
     if (status.http_version < NGX_HTTP_VERSION_11) {
         r->upstream->headers_in.connection_close = 1;
@@ -446,6 +559,14 @@ ngx_int_t ngx_weserv_upstream_process_header(ngx_http_request_t *r) {
         return NGX_ERROR;
     }
 
+    auto *mc = static_cast<ngx_weserv_main_conf_t *>(
+        ngx_http_get_module_main_conf(r, ngx_weserv_module));
+    auto *lc = static_cast<ngx_weserv_loc_conf_t *>(
+        ngx_http_get_module_loc_conf(r, ngx_weserv_module));
+
+    // The validators also identify the image, see ngx_weserv_job_identity
+    bool parse_cache_headers = ctx->origin_cacheable || mc->identify_images;
+
     ngx_http_upstream_t *u = r->upstream;
 
     for (;;) {
@@ -489,6 +610,17 @@ ngx_int_t ngx_weserv_upstream_process_header(ngx_http_request_t *r) {
                 u->headers_in.chunked = 1;
             }
 
+            // Check if the origin intends to close the connection, in which
+            // case it can't be kept alive
+            static ngx_str_t connection = ngx_string("Connection");
+            if (name.len == connection.len &&
+                ngx_strncasecmp(name.data, connection.data, connection.len) ==
+                    0 &&
+                ngx_strlcasestrn(value.data, value.data + value.len,
+                                 (u_char *)"close", 5 - 1) != nullptr) {
+                u->headers_in.connection_close = 1;
+            }
+
             // Check if there was a redirection URI
             static ngx_str_t location = ngx_string("Location");
             if (ctx->redirecting && name.len == location.len &&
@@ -506,6 +638,10 @@ ngx_int_t ngx_weserv_upstream_process_header(ngx_http_request_t *r) {
                 (void)parse_url(r->pool, absolute_url, &ctx->location);
             }
 
+            if (parse_cache_headers) {
+                ngx_weserv_upstream_parse_cache_header(r, ctx, name, value);
+            }
+
             continue;
         }
 
@@ -531,8 +667,11 @@ ngx_int_t ngx_weserv_upstream_process_header(ngx_http_request_t *r) {
                 u->headers_in.content_length_n = -1;
             }
 
-            auto *lc = static_cast<ngx_weserv_loc_conf_t *>(
-                ngx_http_get_module_loc_conf(r, ngx_weserv_module));
+            if (ctx->not_modified) {
+                // A 304 response has no body
+                u->headers_in.content_length_n = 0;
+                u->headers_in.chunked = 0;
+            }
 
             if (lc->max_size > 0 && u->headers_in.content_length_n >
                                         static_cast<off_t>(lc->max_size)) {
@@ -676,27 +815,245 @@ void ngx_weserv_upstream_finalize_request(ngx_http_request_t *r, ngx_int_t rc) {
 }
 
 /**
- * A resolve handler. Called by NGINX when a hostname needs to be resolved.
+ * Cleans up a pending DNS query, if the request is terminated while the origin
+ * host is being resolved.
+ */
+void ngx_weserv_upstream_resolve_cleanup(void *data) {
+    auto *ctx = static_cast<ngx_weserv_upstream_ctx_t *>(data);
+
+    if (ctx->resolver != nullptr) {
+        ngx_resolve_name_done(ctx->resolver);
+        ctx->resolver = nullptr;
+    }
+}
+
+/**
+ * Copies the resolved addresses, since they are freed along with the resolver
+ * context.
+ */
+ngx_int_t ngx_weserv_upstream_copy_addrs(ngx_pool_t *pool,
+                                         ngx_resolver_ctx_t *resolver_ctx,
+                                         ngx_http_upstream_resolved_t *ur) {
+    ur->addrs = static_cast<ngx_resolver_addr_t *>(ngx_pcalloc(
+        pool, resolver_ctx->naddrs * sizeof(ngx_resolver_addr_t)));
+    if (ur->addrs == nullptr) {
+        return NGX_ERROR;
+    }
+
+    for (ngx_uint_t i = 0; i < resolver_ctx->naddrs; i++) {
+        ngx_resolver_addr_t *addr = &resolver_ctx->addrs[i];
+
+        ur->addrs[i].sockaddr =
+            static_cast<sockaddr *>(ngx_palloc(pool, addr->socklen));
+        if (ur->addrs[i].sockaddr == nullptr) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(ur->addrs[i].sockaddr, addr->sockaddr, addr->socklen);
+        ur->addrs[i].socklen = addr->socklen;
+    }
+
+    ur->naddrs = resolver_ctx->naddrs;
+
+    return NGX_OK;
+}
+
+/**
+ * Removes the resolved addresses which are blocked by weserv_deny_ip.
+ */
+Status ngx_weserv_upstream_deny_addrs(ngx_array_t *deny,
+                                      ngx_http_upstream_resolved_t *ur) {
+    if (deny == nullptr) {
+        return Status::OK;
+    }
+
+    ngx_uint_t naddrs = 0;
+
+    for (ngx_uint_t i = 0; i < ur->naddrs; i++) {
+        if (ngx_cidr_match(ur->addrs[i].sockaddr, deny) != NGX_OK) {
+            ur->addrs[naddrs++] = ur->addrs[i];
+        }
+    }
+
+    ur->naddrs = naddrs;
+
+    if (naddrs == 0) {
+        return {Status::Code::InvalidUri, "IP address blocked by policy",
+                Status::ErrorCause::Application};
+    }
+
+    return Status::OK;
+}
+
+/**
+ * Looks up the addresses of the origin host in the resolver cache, if any.
+ * ctx->resolved->naddrs is left 0 on a miss.
+ */
+Status ngx_weserv_upstream_lookup_addrs(ngx_http_request_t *r,
+                                        ngx_weserv_upstream_ctx_t *ctx) {
+    auto *lc = static_cast<ngx_weserv_loc_conf_t *>(
+        ngx_http_get_module_loc_conf(r, ngx_weserv_module));
+
+    if (lc->resolver_cache.zone == nullptr) {
+        return Status::OK;
+    }
+
+    ngx_int_t rc = ngx_weserv_cache_lookup_addrs(
+        r->pool, lc->resolver_cache.zone, ctx->resolved->host, ctx->resolved);
+    if (rc == NGX_ERROR) {
+        return {NGX_ERROR, "Out of memory"};
+    }
+
+    if (rc == NGX_DECLINED) {
+        return Status::OK;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "weserv: resolver cache hit: %V (%ui addresses)",
+                   &ctx->resolved->host, ctx->resolved->naddrs);
+
+    // The policy might differ per location, so it's applied on each use
+    return ngx_weserv_upstream_deny_addrs(lc->deny, ctx->resolved);
+}
+
+/**
+ * Stores the addresses of a resolved origin host in the resolver cache, if
+ * any. They're cached for the TTL of their records, within the configured
+ * bounds.
+ */
+void ngx_weserv_upstream_store_addrs(ngx_http_request_t *r,
+                                     ngx_resolver_ctx_t *resolver_ctx) {
+    auto *lc = static_cast<ngx_weserv_loc_conf_t *>(
+        ngx_http_get_module_loc_conf(r, ngx_weserv_module));
+
+    if (lc->resolver_cache.zone == nullptr) {
+        return;
+    }
+
+    time_t valid = resolver_ctx->valid - ngx_time();
+    valid = ngx_max(valid, lc->resolver_cache.min_valid);
+    valid = ngx_min(valid, lc->resolver_cache.max_valid);
+
+    (void)ngx_weserv_cache_store_addrs(lc->resolver_cache.zone,
+                                       resolver_ctx->name, valid,
+                                       resolver_ctx->addrs,
+                                       resolver_ctx->naddrs);
+}
+
+/**
+ * A resolve handler. Called by NGINX when the origin host is resolved.
+ *
+ * Reference: ngx_http_upstream_resolve_handler
  */
 void ngx_weserv_upstream_resolve_handler(ngx_resolver_ctx_t *resolver_ctx) {
     auto *r = static_cast<ngx_http_request_t *>(resolver_ctx->data);
+    ngx_connection_t *c = r->connection;
 
     auto *ctx = static_cast<ngx_weserv_upstream_ctx_t *>(
         ngx_http_get_module_ctx(r, ngx_weserv_module));
 
-    if (ctx == nullptr) {
-        return;
+    ngx_http_set_log_request(c->log, r);
+
+    ctx->resolver = nullptr;
+
+    ngx_int_t rc = NGX_OK;
+
+    if (resolver_ctx->state != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "%V could not be resolved (%i: %s)", &resolver_ctx->name,
+                      resolver_ctx->state,
+                      ngx_resolver_strerror(resolver_ctx->state));
+
+        // Treat refused DNS queries as blocked (aligns with the
+        // "always_refuse" setting in Unbound)
+        if (resolver_ctx->state == NGX_RESOLVE_REFUSED) {
+            ctx->response_status = {Status::Code::InvalidUri,
+                                    "Domain or TLD blocked by policy",
+                                    Status::ErrorCause::Application};
+        } else {
+            ctx->response_status = {NGX_HTTP_BAD_GATEWAY,
+                                    "Unable to resolve host",
+                                    Status::ErrorCause::Upstream};
+        }
+
+        rc = NGX_HTTP_BAD_GATEWAY;
+    } else if (ngx_weserv_upstream_copy_addrs(r->pool, resolver_ctx,
+                                              ctx->resolved) != NGX_OK) {
+        ctx->response_status = {NGX_ERROR, "Out of memory"};
+
+        rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    } else {
+        ngx_weserv_upstream_store_addrs(r, resolver_ctx);
+
+        auto *lc = static_cast<ngx_weserv_loc_conf_t *>(
+            ngx_http_get_module_loc_conf(r, ngx_weserv_module));
+
+        Status status = ngx_weserv_upstream_deny_addrs(lc->deny, ctx->resolved);
+        if (!status.ok()) {
+            ctx->response_status = status;
+
+            rc = NGX_HTTP_BAD_GATEWAY;
+        }
+    }
+
+    ngx_resolve_name_done(resolver_ctx);
+
+    if (rc == NGX_OK) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "weserv: calling ngx_http_upstream_init(%p)", r);
+
+        ngx_http_upstream_init(r);
+    } else {
+        ngx_http_finalize_request(r, rc);
     }
 
-    // Treat refused DNS queries as blocked (aligns with the "always_refuse"
-    // setting in Unbound)
-    if (resolver_ctx->state == NGX_RESOLVE_REFUSED) {
-        ctx->response_status = {Status::Code::InvalidUri,
-                                "Domain or TLD blocked by policy",
-                                Status::ErrorCause::Application};
+    ngx_http_run_posted_requests(c);
+}
+
+/**
+ * Starts resolving the origin host.
+ *
+ * Reference: ngx_http_upstream_init_request
+ */
+Status ngx_weserv_upstream_resolve(ngx_http_request_t *r,
+                                   ngx_weserv_upstream_ctx_t *ctx) {
+    auto *clcf = static_cast<ngx_http_core_loc_conf_t *>(
+        ngx_http_get_module_loc_conf(r, ngx_http_core_module));
+
+    ngx_resolver_ctx_t temp;
+    temp.name = ctx->resolved->host;
+
+    ngx_resolver_ctx_t *resolver_ctx = ngx_resolve_start(clcf->resolver, &temp);
+    if (resolver_ctx == nullptr) {
+        return {NGX_ERROR, "Out of memory"};
     }
 
-    ctx->original_resolver(resolver_ctx);
+    if (resolver_ctx == NGX_NO_RESOLVER) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "no resolver defined to resolve %V",
+                      &ctx->resolved->host);
+
+        return {NGX_HTTP_BAD_GATEWAY, "Unable to resolve host",
+                Status::ErrorCause::Upstream};
+    }
+
+    ngx_http_cleanup_t *cln = ngx_http_cleanup_add(r, 0);
+    if (cln == nullptr) {
+        ngx_resolve_name_done(resolver_ctx);
+        return {NGX_ERROR, "Out of memory"};
+    }
+
+    cln->handler = ngx_weserv_upstream_resolve_cleanup;
+    cln->data = ctx;
+
+    resolver_ctx->name = ctx->resolved->host;
+    resolver_ctx->handler = ngx_weserv_upstream_resolve_handler;
+    resolver_ctx->data = r;
+    resolver_ctx->timeout = clcf->resolver_timeout;
+
+    ctx->resolver = resolver_ctx;
+
+    return Status::OK;
 }
 
 /**
@@ -716,9 +1073,9 @@ Status initialize_upstream_request(ngx_http_request_t *r,
     ngx_http_upstream_t *u = r->upstream;
 
     // Parse the URL provided by the caller
-    Status status =
-        ngx_weserv_upstream_set_url(r->pool, u, ctx->request->url(), lc->deny,
-                                    &ctx->host_header, &ctx->url_path);
+    Status status = ngx_weserv_upstream_set_url(
+        r->pool, u, ctx->request->url(), lc->deny, &ctx->resolved,
+        &ctx->host_header, &ctx->url_path);
     if (!status.ok()) {
         return status;
     }
@@ -772,24 +1129,126 @@ ngx_int_t ngx_weserv_send_http_request(ngx_http_request_t *r,
         return NGX_ERROR;
     }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "weserv: calling ngx_http_upstream_init(%p)", r);
+    // The URL contains an IP address or the addresses of the host are
+    // cached, no need to resolve it
+    if (ctx->resolved->sockaddr == nullptr) {
+        status = ngx_weserv_upstream_lookup_addrs(r, ctx);
+        if (!status.ok()) {
+            ctx->response_status = status;
 
-    r->main->count++;
+            return NGX_ERROR;
+        }
+    }
 
-    // Initiate the upstream connection by calling NGINX upstream
-    ngx_http_upstream_init(r);
+    if (ctx->resolved->sockaddr != nullptr || ctx->resolved->naddrs != 0) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "weserv: calling ngx_http_upstream_init(%p)", r);
 
-    // Override the upstream resolve handler to our own to ensure
-    // a custom error message is provided for refused DNS queries
-    if (r->upstream->resolved->ctx != nullptr) {
-        ctx->original_resolver = r->upstream->resolved->ctx->handler;
+        r->main->count++;
 
-        r->upstream->resolved->ctx->handler =
-            ngx_weserv_upstream_resolve_handler;
+        // Initiate the upstream connection by calling NGINX upstream
+        ngx_http_upstream_init(r);
+
+        return NGX_DONE;
+    }
+
+    status = ngx_weserv_upstream_resolve(r, ctx);
+    if (!status.ok()) {
+        ctx->response_status = status;
+
+        return NGX_ERROR;
+    }
+
+    r->main->count++;
+
+    // The upstream is initiated once the host is resolved, which might
+    // happen right away
+    if (ngx_resolve_name(ctx->resolver) != NGX_OK) {
+        ctx->resolver = nullptr;
+        ctx->response_status = {NGX_ERROR, "Out of memory"};
+
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
     }
 
     return NGX_DONE;
 }
 
+ngx_int_t ngx_weserv_upstream_init_peer(ngx_http_request_t *r,
+                                        ngx_http_upstream_srv_conf_t *us) {
+    auto *ctx = static_cast<ngx_weserv_upstream_ctx_t *>(
+        ngx_http_get_module_ctx(r, ngx_weserv_module));
+
+    if (ctx == nullptr || ctx->resolved == nullptr) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_upstream_t *u = r->upstream;
+
+#if NGX_HTTP_SSL
+    // Use the origin host for SNI, rather than the name of the upstream
+    u->ssl_name = ctx->resolved->host;
+#endif
+
+    if (ngx_http_upstream_create_round_robin_peer(r, ctx->resolved) !=
+        NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    auto *lc = static_cast<ngx_weserv_loc_conf_t *>(
+        ngx_http_get_module_loc_conf(r, ngx_weserv_module));
+
+    if (lc->origin_keepalive != nullptr) {
+        return ngx_weserv_keepalive_init_peer(r, lc->origin_keepalive,
+                                              ctx->resolved->host);
+    }
+
+    return NGX_OK;
+}
+
+void ngx_weserv_origin_cache_update(ngx_http_request_t *r,
+                                    ngx_weserv_upstream_ctx_t *ctx) {
+    auto *lc = static_cast<ngx_weserv_loc_conf_t *>(
+        ngx_http_get_module_loc_conf(r, ngx_weserv_module));
+
+    if (lc->origin_cache.zone == nullptr || !ctx->origin_cacheable ||
+        ctx->no_store) {
+        return;
+    }
+
+    time_t now = ngx_time();
+    time_t valid = lc->origin_cache.valid;
+
+    if (ctx->no_cache) {
+        valid = 0;
+    } else if (ctx->max_age != -1) {
+        valid = ctx->max_age;
+    } else if (ctx->expires != -1) {
+        valid = ngx_max(ctx->expires - now, 0);
+    }
+
+    if (ctx->not_modified) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "weserv origin cache revalidated: %T", valid);
+
+        (void)ngx_weserv_cache_refresh(lc->origin_cache.zone, ctx->origin_key,
+                                       now + valid);
+        return;
+    }
+
+    // Without validators, an image that's immediately stale is useless
+    if (valid == 0 && ctx->origin_etag.len == 0 &&
+        ctx->origin_last_modified.len == 0) {
+        return;
+    }
+
+    ngx_weserv_cache_entry_t entry{};
+    entry.expires = now + valid;
+    entry.fields[0] = ctx->origin_etag;
+    entry.fields[1] = ctx->origin_last_modified;
+    entry.fields[2] = ctx->canonical;
+
+    (void)ngx_weserv_cache_store(lc->origin_cache.zone, ctx->origin_key, entry,
+                                 ctx->image);
+}
+
 }  // namespace weserv::nginx
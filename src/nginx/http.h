@@ -14,4 +14,20 @@ namespace weserv::nginx {
 ngx_int_t ngx_weserv_send_http_request(ngx_http_request_t *r,
                                        ngx_weserv_upstream_ctx_t *ctx);
 
+/**
+ * A peer initialization handler of the upstream of origins, see
+ * ngx_weserv_main_conf_t. Sets up the resolved addresses of the origin and
+ * the pool of idle connections, if any.
+ */
+ngx_int_t ngx_weserv_upstream_init_peer(ngx_http_request_t *r,
+                                        ngx_http_upstream_srv_conf_t *us);
+
+/**
+ * Stores the image received from the origin in the origin cache, or marks the
+ * cached image as fresh again if it was revalidated. Must be called once the
+ * entire image has been received.
+ */
+void ngx_weserv_origin_cache_update(ngx_http_request_t *r,
+                                    ngx_weserv_upstream_ctx_t *ctx);
+
 }  // namespace weserv::nginx
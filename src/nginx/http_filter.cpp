@@ -39,6 +39,29 @@ ngx_int_t check_image_too_large(ngx_event_pipe_t *p) {
     return NGX_OK;
 }
 
+/**
+ * Stops reading from the upstream if the response has already been sent,
+ * e.g. when the image is rejected before it has been received entirely.
+ */
+bool check_response_finished(ngx_event_pipe_t *p) {
+    auto *r = static_cast<ngx_http_request_t *>(p->input_ctx);
+
+    auto *ctx = static_cast<ngx_weserv_upstream_ctx_t *>(
+        ngx_http_get_module_ctx(r, ngx_weserv_module));
+
+    if (ctx == nullptr || !ctx->finished) {
+        return false;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, p->log, 0,
+                   "weserv response finished, closing upstream");
+
+    r->upstream->keepalive = 0;
+    p->upstream_done = 1;
+
+    return true;
+}
+
 ngx_int_t ngx_weserv_copy_filter(ngx_event_pipe_t *p, ngx_buf_t *buf) {
     if (buf->pos == buf->last) {
         return NGX_OK;
@@ -50,6 +73,10 @@ ngx_int_t ngx_weserv_copy_filter(ngx_event_pipe_t *p, ngx_buf_t *buf) {
         return NGX_OK;
     }
 
+    if (check_response_finished(p)) {
+        return NGX_OK;
+    }
+
     if (p->length == 0) {
         ngx_log_error(NGX_LOG_WARN, p->log, 0,
                       "upstream sent more data than specified in "
@@ -142,6 +169,10 @@ ngx_int_t ngx_weserv_chunked_filter(ngx_event_pipe_t *p, ngx_buf_t *buf) {
         return NGX_OK;
     }
 
+    if (check_response_finished(p)) {
+        return NGX_OK;
+    }
+
     if (p->length == 0) {
         ngx_log_error(NGX_LOG_WARN, p->log, 0,
                       "upstream sent data after final chunk");
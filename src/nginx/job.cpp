@@ -0,0 +1,201 @@
+#include "job.h"
+
+#include "admission.h"
+#include "alloc.h"
+#include "stream.h"
+#include "util.h"
+
+namespace weserv::nginx {
+
+namespace {
+
+/**
+ * Identify the image by the URL of the origin and its validators, so that the
+ * API can reuse what it learned about the image across requests. Only needed
+ * if the pyramid or saliency cache is enabled.
+ */
+std::string ngx_weserv_job_identity(ngx_weserv_main_conf_t *mc,
+                                    ngx_weserv_upstream_ctx_t *upstream_ctx) {
+    if (!mc->identify_images || upstream_ctx == nullptr ||
+        (upstream_ctx->origin_etag.len == 0 &&
+         upstream_ctx->origin_last_modified.len == 0)) {
+        return "";
+    }
+
+    return ngx_str_to_std(upstream_ctx->request->url()) + '\n' +
+           ngx_str_to_std(upstream_ctx->origin_etag) + '\n' +
+           ngx_str_to_std(upstream_ctx->origin_last_modified);
+}
+
+void ngx_weserv_job_pool_cleanup(void *data) {
+    ngx_destroy_pool(static_cast<ngx_pool_t *>(data));
+}
+
+#if NGX_THREADS
+void ngx_weserv_job_stream_cleanup(void *data) {
+    // Unblock the thread in case the request is terminated before all input
+    // has been received. This is a no-op if the input is already complete.
+    static_cast<NgxStreamingSource *>(data)->finish(true);
+}
+
+void ngx_weserv_job_thread_handler(void *data, ngx_log_t *log) {
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "weserv thread handler");
+
+    ngx_weserv_job_run(static_cast<ngx_weserv_job_t *>(data));
+}
+
+void ngx_weserv_job_event_handler(ngx_event_t *ev) {
+    auto *job = static_cast<ngx_weserv_job_t *>(ev->data);
+
+    ngx_http_request_t *r = job->request;
+    ngx_connection_t *c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "weserv thread done: \"%V?%V\"", &r->uri, &r->args);
+
+    r->main->blocked--;
+
+    if (job->stream != nullptr) {
+        auto *mc = static_cast<ngx_weserv_main_conf_t *>(
+            ngx_http_get_module_main_conf(r, ngx_weserv_module));
+
+        mc->stream_jobs--;
+    }
+
+    job->done = 1;
+
+    // The write event handler will call the body filter, which sends the
+    // output of the job to the client
+    r->write_event_handler(r);
+    ngx_http_run_posted_requests(c);
+}
+#endif
+
+}  // namespace
+
+ngx_weserv_job_t *ngx_weserv_job_create(ngx_http_request_t *r,
+                                        ngx_weserv_base_ctx_t *ctx,
+                                        ngx_weserv_upstream_ctx_t *upstream_ctx,
+                                        bool offload, bool streaming) {
+    auto *mc = static_cast<ngx_weserv_main_conf_t *>(
+        ngx_http_get_module_main_conf(r, ngx_weserv_module));
+    auto *lc = static_cast<ngx_weserv_loc_conf_t *>(
+        ngx_http_get_module_loc_conf(r, ngx_weserv_module));
+
+    auto *job = register_pool_cleanup(r->pool, new (r->pool) ngx_weserv_job_t);
+    if (job == nullptr) {
+        return nullptr;
+    }
+
+    ngx_pool_t *pool = r->pool;
+
+    if (offload) {
+        pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+        if (pool == nullptr) {
+            return nullptr;
+        }
+
+        ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == nullptr) {
+            ngx_destroy_pool(pool);
+            return nullptr;
+        }
+
+        // The output buffers must stay alive until the response is sent
+        cln->handler = ngx_weserv_job_pool_cleanup;
+        cln->data = pool;
+    }
+
+    job->request = r;
+    job->weserv = mc->weserv.get();
+    job->config = &lc->api_conf;
+    job->query = ngx_str_to_std(r->args);
+
+    auto identity = ngx_weserv_job_identity(mc, upstream_ctx);
+
+#if NGX_THREADS
+    if (streaming) {
+        auto source =
+            std::make_unique<NgxStreamingSource>(&ctx->image, identity);
+
+        ngx_http_cleanup_t *cln = ngx_http_cleanup_add(r, 0);
+        if (cln == nullptr) {
+            return nullptr;
+        }
+
+        cln->handler = ngx_weserv_job_stream_cleanup;
+        cln->data = source.get();
+
+        job->stream = source.get();
+        job->source = std::move(source);
+    } else
+#endif
+    {
+        job->source = std::make_unique<NgxSource>(&ctx->image, identity);
+    }
+
+    // A streamed image is still arriving, so its expected length is used
+    size_t input_size = ctx->image.size();
+    if (streaming && ctx->image.length() > 0) {
+        input_size = static_cast<size_t>(ctx->image.length());
+    }
+
+    // The output is scaled by the target dimensions, if the dimensions of the
+    // image are sniffed
+    double scale = 1.0;
+    double input_pixels = static_cast<double>(ctx->dimensions.width) *
+                          static_cast<double>(ctx->dimensions.height);
+    if (input_pixels > 0) {
+        scale = ngx_weserv_output_pixels(r, lc->api_conf, ctx->dimensions,
+                                         input_pixels) /
+                input_pixels;
+    }
+
+    job->target = std::make_unique<NgxTarget>(r, upstream_ctx, pool,
+                                              input_size, scale, &job->out);
+
+    return job;
+}
+
+void ngx_weserv_job_run(ngx_weserv_job_t *job) {
+    job->status = job->weserv->process(job->query, job->source, job->target,
+                                       *job->config);
+}
+
+#if NGX_THREADS
+ngx_int_t ngx_weserv_job_post(ngx_weserv_job_t *job, ngx_thread_pool_t *tp) {
+    ngx_http_request_t *r = job->request;
+
+    ngx_thread_task_t *task = ngx_thread_task_alloc(r->pool, 0);
+    if (task == nullptr) {
+        return NGX_ERROR;
+    }
+
+    task->ctx = job;
+    task->handler = ngx_weserv_job_thread_handler;
+    task->event.data = job;
+    task->event.handler = ngx_weserv_job_event_handler;
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    // Prevent the request from being freed while the job is running. Note
+    // that r->aio isn't set, since a streaming job runs while the upstream is
+    // still passing data to the body filter.
+    r->main->blocked++;
+
+    if (job->stream != nullptr) {
+        auto *mc = static_cast<ngx_weserv_main_conf_t *>(
+            ngx_http_get_module_main_conf(r, ngx_weserv_module));
+
+        mc->stream_jobs++;
+    }
+
+    return NGX_OK;
+}
+#endif
+
+}  // namespace weserv::nginx
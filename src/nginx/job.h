@@ -0,0 +1,110 @@
+#pragma once
+
+extern "C" {
+#include <ngx_http.h>
+}
+
+#include "module.h"
+#include "stream.h"
+
+#include <weserv/api_manager.h>
+#include <weserv/io/source_interface.h>
+#include <weserv/io/target_interface.h>
+#include <weserv/utils/status.h>
+
+#include <memory>
+#include <string>
+
+namespace weserv::nginx {
+
+/**
+ * An image processing job. Jobs are either run directly on the event loop or
+ * offloaded to a thread pool.
+ */
+struct ngx_weserv_job_t {
+    /**
+     * Constructor.
+     */
+    ngx_weserv_job_t() : status(api::utils::Status::OK) {}
+
+    /**
+     * The request this job belongs to.
+     */
+    ngx_http_request_t *request;
+
+    /**
+     * The module-level API Manager interface.
+     */
+    api::ApiManager *weserv;
+
+    /**
+     * API configuration, limits etc.
+     */
+    const api::Config *config;
+
+    /**
+     * Query string.
+     */
+    std::string query;
+
+    /**
+     * Source to read from and target to write to.
+     */
+    std::unique_ptr<api::io::SourceInterface> source;
+    std::unique_ptr<api::io::TargetInterface> target;
+
+#if NGX_THREADS
+    /**
+     * The source, if the image is still arriving while the job is running.
+     */
+    NgxStreamingSource *stream;
+#endif
+
+    /**
+     * The output chain, populated by the target.
+     */
+    ngx_chain_t *out;
+
+    /**
+     * The outcome of this job.
+     */
+    api::utils::Status status;
+
+    /**
+     * Set once the job is complete.
+     */
+    unsigned done : 1;
+
+    /**
+     * Set once a response has been sent, either the output of this job or an
+     * error response that was sent while the job was still running.
+     */
+    unsigned sent : 1;
+};
+
+/**
+ * Creates an image processing job for the image buffered within the context.
+ * If the job is going to be offloaded, the output buffers are allocated from a
+ * separate pool, since the request pool must not be used from within a thread.
+ * A streaming job reads the image while it's still arriving; it must be
+ * offloaded.
+ */
+ngx_weserv_job_t *ngx_weserv_job_create(ngx_http_request_t *r,
+                                        ngx_weserv_base_ctx_t *ctx,
+                                        ngx_weserv_upstream_ctx_t *upstream_ctx,
+                                        bool offload, bool streaming);
+
+/**
+ * Runs an image processing job on the calling thread.
+ */
+void ngx_weserv_job_run(ngx_weserv_job_t *job);
+
+#if NGX_THREADS
+/**
+ * Offloads an image processing job to a thread pool. The write event handler
+ * of the request is invoked as soon as the job is complete.
+ */
+ngx_int_t ngx_weserv_job_post(ngx_weserv_job_t *job, ngx_thread_pool_t *tp);
+#endif
+
+}  // namespace weserv::nginx
@@ -0,0 +1,444 @@
+#include "keepalive.h"
+
+namespace weserv::nginx {
+
+namespace {
+
+/**
+ * The maximum length of a host name, see RFC 1035.
+ */
+constexpr size_t NGX_WESERV_KEEPALIVE_HOST_LEN = 255;
+
+/**
+ * An idle connection within the pool.
+ */
+struct ngx_weserv_keepalive_item_t {
+    ngx_weserv_keepalive_t *keepalive;
+    ngx_queue_t queue;
+    ngx_connection_t *connection;
+
+    socklen_t socklen;
+    ngx_sockaddr_t sockaddr;
+
+    /**
+     * The origin host the connection was established for. Connections are
+     * not shared between hosts, since TLS handshakes are host-specific.
+     */
+    size_t host_len;
+    u_char host[NGX_WESERV_KEEPALIVE_HOST_LEN];
+
+    unsigned ssl : 1;
+};
+
+#if NGX_HTTP_SSL
+/**
+ * The TLS session of an origin, used to resume sessions on new connections.
+ */
+struct ngx_weserv_keepalive_session_t {
+    ngx_queue_t queue;
+    ngx_ssl_session_t *session;
+
+    in_port_t port;
+    size_t host_len;
+    u_char host[NGX_WESERV_KEEPALIVE_HOST_LEN];
+};
+#endif
+
+/**
+ * The keepalive state of an upstream.
+ */
+struct ngx_weserv_keepalive_peer_t {
+    ngx_weserv_keepalive_t *keepalive;
+    ngx_http_upstream_t *upstream;
+    ngx_str_t host;
+
+    unsigned ssl : 1;
+
+    /**
+     * The original peer handlers, i.e. of the round robin balancer.
+     */
+    void *data;
+    ngx_event_get_peer_pt original_get_peer;
+    ngx_event_free_peer_pt original_free_peer;
+};
+
+bool ngx_weserv_keepalive_host_eq(const u_char *host, size_t len,
+                                  const ngx_str_t &other) {
+    return len == other.len && ngx_strncasecmp(const_cast<u_char *>(host),
+                                               other.data, len) == 0;
+}
+
+/**
+ * Reference: ngx_http_upstream_keepalive_close
+ */
+void ngx_weserv_keepalive_close(ngx_connection_t *c) {
+#if NGX_HTTP_SSL
+    if (c->ssl) {
+        c->ssl->no_wait_shutdown = 1;
+        c->ssl->no_send_shutdown = 1;
+
+        if (ngx_ssl_shutdown(c) == NGX_AGAIN) {
+            c->ssl->handler = ngx_weserv_keepalive_close;
+            return;
+        }
+    }
+#endif
+
+    ngx_destroy_pool(c->pool);
+    ngx_close_connection(c);
+}
+
+void ngx_weserv_keepalive_dummy_handler(ngx_event_t *ev) {
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "weserv keepalive dummy handler");
+}
+
+/**
+ * Closes an idle connection once the origin closes it, sends unexpected data
+ * or the connection times out.
+ * Reference: ngx_http_upstream_keepalive_close_handler
+ */
+void ngx_weserv_keepalive_close_handler(ngx_event_t *ev) {
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "weserv keepalive close handler");
+
+    auto *c = static_cast<ngx_connection_t *>(ev->data);
+
+    if (!c->close && !ev->timedout) {
+        char buf[1];
+        ssize_t n = recv(c->fd, buf, 1, MSG_PEEK);
+
+        if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+            ev->ready = 0;
+
+            if (ngx_handle_read_event(c->read, 0) == NGX_OK) {
+                return;
+            }
+        }
+    }
+
+    auto *item = static_cast<ngx_weserv_keepalive_item_t *>(c->data);
+
+    ngx_weserv_keepalive_close(c);
+
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&item->keepalive->free, &item->queue);
+}
+
+/**
+ * Reference: ngx_http_upstream_get_keepalive_peer
+ */
+ngx_int_t ngx_weserv_keepalive_get_peer(ngx_peer_connection_t *pc,
+                                        void *data) {
+    auto *kp = static_cast<ngx_weserv_keepalive_peer_t *>(data);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "weserv get keepalive peer");
+
+    // Let the balancer pick an address of the origin first
+    ngx_int_t rc = kp->original_get_peer(pc, kp->data);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    ngx_queue_t *cache = &kp->keepalive->cache;
+
+    for (ngx_queue_t *q = ngx_queue_head(cache); q != ngx_queue_sentinel(cache);
+         q = ngx_queue_next(q)) {
+        auto *item = ngx_queue_data(q, ngx_weserv_keepalive_item_t, queue);
+
+        if (item->ssl != kp->ssl ||
+            !ngx_weserv_keepalive_host_eq(item->host, item->host_len,
+                                          kp->host) ||
+            ngx_memn2cmp(reinterpret_cast<u_char *>(&item->sockaddr),
+                         reinterpret_cast<u_char *>(pc->sockaddr),
+                         item->socklen, pc->socklen) != 0) {
+            continue;
+        }
+
+        ngx_queue_remove(q);
+        ngx_queue_insert_head(&kp->keepalive->free, q);
+
+        ngx_connection_t *c = item->connection;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "weserv get keepalive peer: using connection %p", c);
+
+        c->idle = 0;
+        c->sent = 0;
+        c->data = nullptr;
+        c->log = pc->log;
+        c->read->log = pc->log;
+        c->write->log = pc->log;
+        c->pool->log = pc->log;
+
+        if (c->read->timer_set) {
+            ngx_del_timer(c->read);
+        }
+
+        pc->connection = c;
+        pc->cached = 1;
+
+        return NGX_DONE;
+    }
+
+    return NGX_OK;
+}
+
+/**
+ * Reference: ngx_http_upstream_free_keepalive_peer
+ */
+void ngx_weserv_keepalive_free_peer(ngx_peer_connection_t *pc, void *data,
+                                    ngx_uint_t state) {
+    auto *kp = static_cast<ngx_weserv_keepalive_peer_t *>(data);
+    ngx_weserv_keepalive_t *keepalive = kp->keepalive;
+    ngx_http_upstream_t *u = kp->upstream;
+    ngx_connection_t *c = pc->connection;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "weserv free keepalive peer");
+
+    if (state & NGX_PEER_FAILED || c == nullptr || c->read->eof ||
+        c->read->error || c->read->timedout || c->write->error ||
+        c->write->timedout || c->requests >= keepalive->requests ||
+        !u->keepalive || !u->request_body_sent || ngx_terminate ||
+        ngx_exiting || kp->host.len > NGX_WESERV_KEEPALIVE_HOST_LEN ||
+        ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        kp->original_free_peer(pc, kp->data, state);
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "weserv free keepalive peer: saving connection %p", c);
+
+    ngx_queue_t *q;
+    ngx_weserv_keepalive_item_t *item;
+
+    if (ngx_queue_empty(&keepalive->free)) {
+        // Evict the least recently used connection
+        q = ngx_queue_last(&keepalive->cache);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_weserv_keepalive_item_t, queue);
+
+        ngx_weserv_keepalive_close(item->connection);
+    } else {
+        q = ngx_queue_head(&keepalive->free);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_weserv_keepalive_item_t, queue);
+    }
+
+    ngx_queue_insert_head(&keepalive->cache, q);
+
+    item->connection = c;
+    item->socklen = pc->socklen;
+    ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
+    item->host_len = kp->host.len;
+    ngx_memcpy(item->host, kp->host.data, kp->host.len);
+    item->ssl = kp->ssl;
+
+    pc->connection = nullptr;
+
+    c->read->delayed = 0;
+    ngx_add_timer(c->read, keepalive->timeout);
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    c->write->handler = ngx_weserv_keepalive_dummy_handler;
+    c->read->handler = ngx_weserv_keepalive_close_handler;
+
+    c->data = item;
+    c->idle = 1;
+    c->log = ngx_cycle->log;
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+    c->pool->log = ngx_cycle->log;
+
+    if (c->read->ready) {
+        ngx_weserv_keepalive_close_handler(c->read);
+    }
+
+    kp->original_free_peer(pc, kp->data, state);
+}
+
+#if NGX_HTTP_SSL
+/**
+ * Finds the TLS session of the origin the peer connects to.
+ */
+ngx_weserv_keepalive_session_t *
+ngx_weserv_keepalive_find_session(ngx_peer_connection_t *pc,
+                                  ngx_weserv_keepalive_peer_t *kp) {
+    in_port_t port = ngx_inet_get_port(pc->sockaddr);
+    ngx_queue_t *sessions = &kp->keepalive->sessions;
+
+    for (ngx_queue_t *q = ngx_queue_head(sessions);
+         q != ngx_queue_sentinel(sessions); q = ngx_queue_next(q)) {
+        auto *s = ngx_queue_data(q, ngx_weserv_keepalive_session_t, queue);
+
+        if (s->port == port &&
+            ngx_weserv_keepalive_host_eq(s->host, s->host_len, kp->host)) {
+            return s;
+        }
+    }
+
+    return nullptr;
+}
+
+/**
+ * Resumes the TLS session of the origin on a new connection, if any.
+ * Reference: ngx_http_upstream_set_round_robin_peer_session
+ */
+ngx_int_t ngx_weserv_keepalive_set_session(ngx_peer_connection_t *pc,
+                                           void *data) {
+    auto *kp = static_cast<ngx_weserv_keepalive_peer_t *>(data);
+
+    ngx_weserv_keepalive_session_t *s =
+        ngx_weserv_keepalive_find_session(pc, kp);
+    if (s == nullptr) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "weserv set keepalive session: %p", s->session);
+
+    return ngx_ssl_set_session(pc->connection, s->session);
+}
+
+/**
+ * Stores the TLS session of the origin, for use by later connections.
+ * Reference: ngx_http_upstream_save_round_robin_peer_session
+ */
+void ngx_weserv_keepalive_save_session(ngx_peer_connection_t *pc,
+                                       void *data) {
+    auto *kp = static_cast<ngx_weserv_keepalive_peer_t *>(data);
+    ngx_weserv_keepalive_t *keepalive = kp->keepalive;
+
+    if (kp->host.len > NGX_WESERV_KEEPALIVE_HOST_LEN) {
+        return;
+    }
+
+    ngx_ssl_session_t *session = ngx_ssl_get_session(pc->connection);
+    if (session == nullptr) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "weserv save keepalive session: %p", session);
+
+    ngx_weserv_keepalive_session_t *s =
+        ngx_weserv_keepalive_find_session(pc, kp);
+
+    if (s != nullptr) {
+        ngx_queue_remove(&s->queue);
+        ngx_ssl_free_session(s->session);
+    } else if (ngx_queue_empty(&keepalive->free_sessions)) {
+        // Replace the least recently used session
+        ngx_queue_t *q = ngx_queue_last(&keepalive->sessions);
+        ngx_queue_remove(q);
+
+        s = ngx_queue_data(q, ngx_weserv_keepalive_session_t, queue);
+        ngx_ssl_free_session(s->session);
+    } else {
+        ngx_queue_t *q = ngx_queue_head(&keepalive->free_sessions);
+        ngx_queue_remove(q);
+
+        s = ngx_queue_data(q, ngx_weserv_keepalive_session_t, queue);
+    }
+
+    ngx_queue_insert_head(&keepalive->sessions, &s->queue);
+
+    s->session = session;
+    s->port = ngx_inet_get_port(pc->sockaddr);
+    s->host_len = kp->host.len;
+    ngx_memcpy(s->host, kp->host.data, kp->host.len);
+}
+#endif
+
+}  // namespace
+
+ngx_weserv_keepalive_t *ngx_weserv_keepalive_create(ngx_conf_t *cf,
+                                                    ngx_uint_t max_cached) {
+    auto *keepalive = static_cast<ngx_weserv_keepalive_t *>(
+        ngx_pcalloc(cf->pool, sizeof(ngx_weserv_keepalive_t)));
+    if (keepalive == nullptr) {
+        return nullptr;
+    }
+
+    keepalive->max_cached = max_cached;
+
+    auto *items = static_cast<ngx_weserv_keepalive_item_t *>(ngx_pcalloc(
+        cf->pool, sizeof(ngx_weserv_keepalive_item_t) * max_cached));
+    if (items == nullptr) {
+        return nullptr;
+    }
+
+    ngx_queue_init(&keepalive->cache);
+    ngx_queue_init(&keepalive->free);
+
+    for (ngx_uint_t i = 0; i < max_cached; i++) {
+        ngx_queue_insert_head(&keepalive->free, &items[i].queue);
+        items[i].keepalive = keepalive;
+    }
+
+#if NGX_HTTP_SSL
+    // Remember the TLS sessions of as many origins as there are connections
+    auto *sessions = static_cast<ngx_weserv_keepalive_session_t *>(ngx_pcalloc(
+        cf->pool, sizeof(ngx_weserv_keepalive_session_t) * max_cached));
+    if (sessions == nullptr) {
+        return nullptr;
+    }
+
+    ngx_queue_init(&keepalive->sessions);
+    ngx_queue_init(&keepalive->free_sessions);
+
+    for (ngx_uint_t i = 0; i < max_cached; i++) {
+        ngx_queue_insert_head(&keepalive->free_sessions, &sessions[i].queue);
+    }
+#endif
+
+    return keepalive;
+}
+
+ngx_int_t ngx_weserv_keepalive_init_peer(ngx_http_request_t *r,
+                                         ngx_weserv_keepalive_t *keepalive,
+                                         ngx_str_t host) {
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "weserv init keepalive peer");
+
+    auto *kp = static_cast<ngx_weserv_keepalive_peer_t *>(
+        ngx_palloc(r->pool, sizeof(ngx_weserv_keepalive_peer_t)));
+    if (kp == nullptr) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_upstream_t *u = r->upstream;
+
+    kp->keepalive = keepalive;
+    kp->upstream = u;
+    kp->host = host;
+#if NGX_HTTP_SSL
+    kp->ssl = u->ssl;
+#else
+    kp->ssl = 0;
+#endif
+
+    kp->data = u->peer.data;
+    kp->original_get_peer = u->peer.get;
+    kp->original_free_peer = u->peer.free;
+
+    u->peer.data = kp;
+    u->peer.get = ngx_weserv_keepalive_get_peer;
+    u->peer.free = ngx_weserv_keepalive_free_peer;
+
+#if NGX_HTTP_SSL
+    u->peer.set_session = ngx_weserv_keepalive_set_session;
+    u->peer.save_session = ngx_weserv_keepalive_save_session;
+#endif
+
+    return NGX_OK;
+}
+
+}  // namespace weserv::nginx
@@ -0,0 +1,60 @@
+#pragma once
+
+extern "C" {
+#include <ngx_http.h>
+}
+
+namespace weserv::nginx {
+
+/**
+ * A pool of idle connections to origins, per worker process.
+ */
+struct ngx_weserv_keepalive_t {
+    /**
+     * The maximum number of idle connections.
+     */
+    ngx_uint_t max_cached;
+
+    /**
+     * How long an idle connection stays open.
+     */
+    ngx_msec_t timeout;
+
+    /**
+     * The maximum number of requests made through one connection.
+     */
+    ngx_uint_t requests;
+
+    /**
+     * The idle connections, most recently used first, and the unused items.
+     */
+    ngx_queue_t cache;
+    ngx_queue_t free;
+
+#if NGX_HTTP_SSL
+    /**
+     * The TLS sessions of origins, most recently used first, and the unused
+     * items.
+     */
+    ngx_queue_t sessions;
+    ngx_queue_t free_sessions;
+#endif
+};
+
+/**
+ * Creates a pool of at most max_cached idle connections.
+ */
+ngx_weserv_keepalive_t *ngx_weserv_keepalive_create(ngx_conf_t *cf,
+                                                    ngx_uint_t max_cached);
+
+/**
+ * Lets the upstream of the request reuse idle connections to the given origin
+ * host, and return its connection to the pool once it's done. Must be called
+ * after the peer of the upstream is initialized.
+ * Reference: ngx_http_upstream_init_keepalive_peer
+ */
+ngx_int_t ngx_weserv_keepalive_init_peer(ngx_http_request_t *r,
+                                         ngx_weserv_keepalive_t *keepalive,
+                                         ngx_str_t host);
+
+}  // namespace weserv::nginx
@@ -1,9 +1,16 @@
 #include "module.h"
 
+#include "admission.h"
 #include "alloc.h"
+#include "cache.h"
 #include "environment.h"
 #include "error.h"
 #include "handler.h"
+#include "header.h"
+#include "http.h"
+#include "job.h"
+#include "keepalive.h"
+#include "probe.h"
 #include "stream.h"
 #include "util.h"
 
@@ -20,6 +27,18 @@ namespace {
  */
 char *ngx_weserv(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 char *ngx_weserv_deny_ip(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_weserv_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_weserv_priority(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_weserv_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_weserv_resolver_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+                                void *conf);
+char *ngx_weserv_admission(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_weserv_client_hints(ngx_conf_t *cf, ngx_command_t *cmd,
+                              void *conf);
+char *ngx_weserv_origin_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
+                                  void *conf);
+char *ngx_weserv_mask_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_weserv_image_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 
 /**
  * Configuration - function declarations.
@@ -30,6 +49,11 @@ char *ngx_weserv_deny_ip(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
  */
 void *ngx_weserv_create_main_conf(ngx_conf_t *cf);
 
+/**
+ * Applies the defaults of the module's main context configuration.
+ */
+char *ngx_weserv_init_main_conf(ngx_conf_t *cf, void *conf);
+
 /**
  * Creates the module's location context configuration structure.
  */
@@ -52,6 +76,12 @@ ngx_int_t ngx_weserv_postconfiguration(ngx_conf_t *cf);
 ngx_int_t ngx_weserv_response_length_variable(ngx_http_request_t *r,
                                               ngx_http_variable_value_t *v,
                                               uintptr_t data);
+ngx_int_t ngx_weserv_cache_key_variable(ngx_http_request_t *r,
+                                        ngx_http_variable_value_t *v,
+                                        uintptr_t data);
+ngx_int_t ngx_weserv_cache_status_variable(ngx_http_request_t *r,
+                                           ngx_http_variable_value_t *v,
+                                           uintptr_t data);
 
 ngx_http_output_header_filter_pt ngx_http_next_header_filter;
 ngx_http_output_body_filter_pt ngx_http_next_body_filter;
@@ -170,6 +200,22 @@ ngx_command_t ngx_weserv_commands[] = {
      offsetof(ngx_weserv_loc_conf_t, canonical_header),
      nullptr},
 
+    {ngx_string("weserv_auto_output"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+         NGX_HTTP_LIF_CONF | NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_weserv_loc_conf_t, auto_output),
+     nullptr},
+
+    {ngx_string("weserv_client_hints"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+         NGX_CONF_1MORE,
+     ngx_weserv_client_hints,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_weserv_loc_conf_t, client_hints),
+     nullptr},
+
     {ngx_string("weserv_savers"),
      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
          NGX_CONF_1MORE,
@@ -290,6 +336,130 @@ ngx_command_t ngx_weserv_commands[] = {
      offsetof(ngx_weserv_loc_conf_t, api_conf.fail_on_error),
      nullptr},
 
+    {ngx_string("weserv_trim_preview"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+         NGX_HTTP_LIF_CONF | NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_weserv_loc_conf_t, api_conf.trim_preview),
+     nullptr},
+
+    {ngx_string("weserv_smartcrop_size"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+         NGX_HTTP_LIF_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_num_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_weserv_loc_conf_t, api_conf.smartcrop_size),
+     nullptr},
+
+    {ngx_string("weserv_thread_pool"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+         NGX_CONF_TAKE1,
+     ngx_weserv_thread_pool,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     0,
+     nullptr},
+
+    {ngx_string("weserv_priority"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+         NGX_CONF_1MORE,
+     ngx_weserv_priority,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     0,
+     nullptr},
+
+    {ngx_string("weserv_stream_input"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+         NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_weserv_loc_conf_t, stream_input),
+     nullptr},
+
+    {ngx_string("weserv_stream_input_jobs"),
+     NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_num_slot,
+     NGX_HTTP_MAIN_CONF_OFFSET,
+     offsetof(ngx_weserv_main_conf_t, stream_input_jobs),
+     nullptr},
+
+    {ngx_string("weserv_cache"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+         NGX_CONF_TAKE12,
+     ngx_weserv_cache,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_weserv_loc_conf_t, cache),
+     nullptr},
+
+    {ngx_string("weserv_cache_lock"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+         NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_weserv_loc_conf_t, cache_lock),
+     nullptr},
+
+    {ngx_string("weserv_cache_lock_timeout"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+         NGX_CONF_TAKE1,
+     ngx_conf_set_msec_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_weserv_loc_conf_t, cache_lock_timeout),
+     nullptr},
+
+    {ngx_string("weserv_origin_cache"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+         NGX_CONF_TAKE12,
+     ngx_weserv_cache,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_weserv_loc_conf_t, origin_cache),
+     nullptr},
+
+    {ngx_string("weserv_origin_keepalive"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+         NGX_CONF_TAKE123,
+     ngx_weserv_origin_keepalive,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     0,
+     nullptr},
+
+    {ngx_string("weserv_resolver_cache"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+         NGX_CONF_TAKE123,
+     ngx_weserv_resolver_cache,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_weserv_loc_conf_t, resolver_cache),
+     nullptr},
+
+    {ngx_string("weserv_admission"),
+     NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+         NGX_CONF_TAKE123,
+     ngx_weserv_admission,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     0,
+     nullptr},
+
+    {ngx_string("weserv_mask_cache"),
+     NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
+     ngx_weserv_mask_cache,
+     NGX_HTTP_MAIN_CONF_OFFSET,
+     0,
+     nullptr},
+
+    {ngx_string("weserv_pyramid_cache"),
+     NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+     ngx_weserv_image_cache,
+     NGX_HTTP_MAIN_CONF_OFFSET,
+     offsetof(ngx_weserv_main_conf_t, pyramid_cache_size),
+     nullptr},
+
+    {ngx_string("weserv_saliency_cache"),
+     NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+     ngx_weserv_image_cache,
+     NGX_HTTP_MAIN_CONF_OFFSET,
+     offsetof(ngx_weserv_main_conf_t, saliency_cache_size),
+     nullptr},
+
     ngx_null_command  // last entry
 };
 
@@ -299,6 +469,14 @@ ngx_http_variable_t ngx_weserv_vars[] = {
      ngx_weserv_response_length_variable, 0,
      NGX_HTTP_VAR_NOCACHEABLE, 0},
 
+    {ngx_string("weserv_cache_key"), nullptr,
+     ngx_weserv_cache_key_variable, 0,
+     NGX_HTTP_VAR_NOCACHEABLE, 0},
+
+    {ngx_string("weserv_cache_status"), nullptr,
+     ngx_weserv_cache_status_variable, 0,
+     0, 0},
+
     ngx_http_null_variable  // last entry
 };
 // clang-format on
@@ -338,6 +516,37 @@ ngx_int_t ngx_weserv_response_length_variable(ngx_http_request_t *r,
     return NGX_OK;
 }
 
+ngx_int_t ngx_weserv_cache_key_variable(ngx_http_request_t *r,
+                                        ngx_http_variable_value_t *v,
+                                        uintptr_t data) {
+    ngx_str_t args;
+    if (ngx_weserv_cache_args(r, &args) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    // The output negotiation and the client hints rewrite the query once the
+    // image is handled, so a value from an earlier phase mustn't be reused
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+    v->len = args.len;
+    v->data = args.data;
+
+    return NGX_OK;
+}
+
+ngx_int_t ngx_weserv_cache_status_variable(ngx_http_request_t *r,
+                                           ngx_http_variable_value_t *v,
+                                           uintptr_t data) {
+    // The value is set by ngx_weserv_cache_lookup_image, until then the cache
+    // isn't consulted
+    v->valid = 0;
+    v->no_cacheable = 1;
+    v->not_found = 1;
+
+    return NGX_OK;
+}
+
 /**
  * The module context contains initialization and configuration callbacks.
  */
@@ -349,7 +558,7 @@ ngx_http_module_t ngx_weserv_module_ctx = {
     // void *(*create_main_conf)(ngx_conf_t *cf);
     ngx_weserv_create_main_conf,
     // char *(*init_main_conf)(ngx_conf_t *cf, void *conf);
-    nullptr,
+    ngx_weserv_init_main_conf,
     // void *(*create_srv_conf)(ngx_conf_t *cf);
     nullptr,
     // char *(*merge_srv_conf)(ngx_conf_t *cf, void *prev, void *conf);
@@ -416,395 +625,1831 @@ char *ngx_weserv_deny_ip(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
     return NGX_CONF_OK;
 }
 
-/**
- * Create weserv module's main context configuration
- */
-void *ngx_weserv_create_main_conf(ngx_conf_t *cf) {
-    auto *conf =
-        register_pool_cleanup(cf->pool, new (cf->pool) ngx_weserv_main_conf_t);
-    if (conf == nullptr) {
-        return nullptr;
+char *ngx_weserv_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+#if NGX_THREADS
+    auto *lc = static_cast<ngx_weserv_loc_conf_t *>(conf);
+
+    if (lc->thread_pool != NGX_CONF_UNSET_PTR) {
+        return const_cast<char *>("is duplicate");
     }
 
-    return conf;
-}
+    auto *value = static_cast<ngx_str_t *>(cf->args->elts);
 
-/**
- * Create weserv module's location config.
- */
-void *ngx_weserv_create_loc_conf(ngx_conf_t *cf) {
-    auto *lc = new (cf->pool) ngx_weserv_loc_conf_t;
-    if (lc == nullptr) {
-        return nullptr;
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        lc->thread_pool = nullptr;
+        return NGX_CONF_OK;
     }
 
-    lc->upstream_conf.connect_timeout = NGX_CONF_UNSET_MSEC;
-    lc->upstream_conf.send_timeout = NGX_CONF_UNSET_MSEC;
-    lc->upstream_conf.read_timeout = NGX_CONF_UNSET_MSEC;
+    lc->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+    if (lc->thread_pool == nullptr) {
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
 
-    // The hardcoded values
-    lc->upstream_conf.buffering = 1;
-    lc->upstream_conf.buffer_size =
-        4 * ngx_pagesize;  // 4 memory pages should be enough for most response
-                           // headers
-    lc->upstream_conf.busy_buffers_size =
-        6 * ngx_pagesize;  // Essentially, buffer_size + 2 memory pages
-    lc->upstream_conf.bufs.num = 256;
-    lc->upstream_conf.bufs.size = ngx_pagesize;
-    lc->upstream_conf.max_temp_file_size = 0;
-    lc->upstream_conf.temp_file_write_size = 0;
+    return NGX_CONF_OK;
+#else
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"weserv_thread_pool\" requires nginx to be built "
+                       "with --with-threads");
 
-    // Attempt to do a failover with a maximum of 3 tries when a domain name
-    // resolves to several addresses
-    lc->upstream_conf.next_upstream_tries = 3;
-    lc->upstream_conf.next_upstream_timeout = 0;
-    lc->upstream_conf.next_upstream =
-        (NGX_CONF_BITMASK_SET | NGX_HTTP_UPSTREAM_FT_ERROR |
-         NGX_HTTP_UPSTREAM_FT_TIMEOUT);
+    return static_cast<char *>(NGX_CONF_ERROR);
+#endif
+}
 
-    // Do not pass the client request headers or body to the upstream
-    lc->upstream_conf.pass_request_headers = 0;
-    lc->upstream_conf.pass_request_body = 0;
+char *ngx_weserv_priority(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+#if NGX_THREADS
+    auto *lc = static_cast<ngx_weserv_loc_conf_t *>(conf);
 
-    lc->upstream_conf.hide_headers =
-        static_cast<ngx_array_t *>(NGX_CONF_UNSET_PTR);
-    lc->upstream_conf.pass_headers =
-        static_cast<ngx_array_t *>(NGX_CONF_UNSET_PTR);
+    if (lc->priorities == nullptr) {
+        lc->priorities =
+            ngx_array_create(cf->pool, 2, sizeof(ngx_weserv_priority_t));
+        if (lc->priorities == nullptr) {
+            return static_cast<char *>(NGX_CONF_ERROR);
+        }
+    }
 
-    // Set up SSL if available
-#if NGX_HTTP_SSL
-    // Initialize SSL
-    ngx_pool_cleanup_t *ssl_cleanup =
-        ngx_pool_cleanup_add(cf->pool, sizeof(ngx_ssl_t));
-    if (ssl_cleanup == nullptr) {
-        return nullptr;
+    auto *priority =
+        static_cast<ngx_weserv_priority_t *>(ngx_array_push(lc->priorities));
+    if (priority == nullptr) {
+        return static_cast<char *>(NGX_CONF_ERROR);
     }
 
-    auto *ssl = static_cast<ngx_ssl_t *>(ssl_cleanup->data);
-    ngx_memzero(ssl, sizeof(ngx_ssl_t));
-    ssl->log = cf->log;
+    ngx_memzero(priority, sizeof(ngx_weserv_priority_t));
 
-    if (ngx_ssl_create(ssl,
-                       NGX_SSL_SSLv2 | NGX_SSL_SSLv3 | NGX_SSL_TLSv1 |
-                           NGX_SSL_TLSv1_1 | NGX_SSL_TLSv1_2 | NGX_SSL_TLSv1_3,
-                       nullptr) != NGX_OK) {
-        return nullptr;
+    auto *value = static_cast<ngx_str_t *>(cf->args->elts);
+
+    priority->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+    if (priority->thread_pool == nullptr) {
+        return static_cast<char *>(NGX_CONF_ERROR);
     }
 
-#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
-    // Use the lowest OpenSSL security level to ensure maximum compatibility.
-    // This is basically the same as using OpenSSL 1.0, which lacks a minimum
-    // security policy.
-    SSL_CTX_set_security_level(ssl->ctx, 0);
-#endif
+    for (ngx_uint_t i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "output=", 7) == 0) {
+            u_char *p = value[i].data + 7;
+            u_char *last = value[i].data + value[i].len;
+
+            // A comma-separated list of the formats of weserv_savers
+            while (p < last) {
+                u_char *end = ngx_strlchr(p, last, ',');
+                if (end == nullptr) {
+                    end = last;
+                }
+
+                ngx_conf_bitmask_t *saver = ngx_weserv_savers;
+                for (/* void */; saver->name.len != 0; saver++) {
+                    if (saver->name.len == static_cast<size_t>(end - p) &&
+                        ngx_strncmp(saver->name.data, p, end - p) == 0) {
+                        break;
+                    }
+                }
+
+                if (saver->name.len == 0) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "invalid output \"%V\"", &value[i]);
+                    return static_cast<char *>(NGX_CONF_ERROR);
+                }
+
+                priority->output |= saver->mask;
+                p = end + 1;
+            }
 
-    ssl_cleanup->handler = ngx_ssl_cleanup_ctx;
+            continue;
+        }
 
-    lc->upstream_conf.ssl = ssl;
-    lc->upstream_conf.ssl_session_reuse = 1;
+        if (ngx_strcmp(value[i].data, "multipage") == 0) {
+            priority->multipage = 1;
+            continue;
+        }
 
-    if (ngx_ssl_client_session_cache(cf, lc->upstream_conf.ssl,
-                                     lc->upstream_conf.ssl_session_reuse) !=
-        NGX_OK) {
-        return nullptr;
-    }
+        uint64_t *bound = nullptr;
 
-    // For SNI (Server Name Indication) support
-    lc->upstream_conf.ssl_server_name = 1;
-#endif
+        if (ngx_strncmp(value[i].data, "min_cost=", 9) == 0) {
+            bound = &priority->min_cost;
+        } else if (ngx_strncmp(value[i].data, "max_cost=", 9) == 0) {
+            bound = &priority->max_cost;
+        }
 
-    lc->enable = NGX_CONF_UNSET;
-    lc->mode = NGX_CONF_UNSET_UINT;
-    lc->max_size = NGX_CONF_UNSET_SIZE;
-    lc->max_redirects = NGX_CONF_UNSET_UINT;
-    lc->canonical_header = NGX_CONF_UNSET;
+        if (bound != nullptr) {
+            ngx_int_t cost = ngx_atoi(value[i].data + 9, value[i].len - 9);
+            if (cost == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid cost \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
 
-    // API configuration
-    lc->api_conf.savers = 0;
-    lc->api_conf.process_timeout = NGX_CONF_UNSET;
-    lc->api_conf.limit_input_pixels = NGX_CONF_UNSET_UINT;
-    lc->api_conf.limit_output_pixels = NGX_CONF_UNSET_UINT;
-    lc->api_conf.max_pages = NGX_CONF_UNSET;
-    lc->api_conf.quality = NGX_CONF_UNSET;
-    lc->api_conf.avif_quality = NGX_CONF_UNSET;
-    lc->api_conf.jpeg_quality = NGX_CONF_UNSET;
-    lc->api_conf.tiff_quality = NGX_CONF_UNSET;
-    lc->api_conf.webp_quality = NGX_CONF_UNSET;
-    lc->api_conf.avif_effort = NGX_CONF_UNSET;
-    lc->api_conf.gif_effort = NGX_CONF_UNSET;
-    lc->api_conf.webp_effort = NGX_CONF_UNSET;
-    lc->api_conf.zlib_level = NGX_CONF_UNSET;
-    lc->api_conf.fail_on_error = NGX_CONF_UNSET;
+            // The cost is given in megapixels
+            *bound = static_cast<uint64_t>(cost) * 1000000;
 
-    return lc;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[i]);
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    return NGX_CONF_OK;
+#else
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"weserv_priority\" requires nginx to be built "
+                       "with --with-threads");
+
+    return static_cast<char *>(NGX_CONF_ERROR);
+#endif
 }
 
 /**
- * Merge weserv module's location config.
+ * Parses the zone=name[:size] parameter of the cache directives.
  */
-char *ngx_weserv_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child) {
-    auto *prev = static_cast<ngx_weserv_loc_conf_t *>(parent);
-    auto *conf = static_cast<ngx_weserv_loc_conf_t *>(child);
+ngx_int_t ngx_weserv_parse_zone(ngx_conf_t *cf, ngx_str_t &value,
+                                ngx_str_t *name, ssize_t *size) {
+    name->data = value.data + 5;
 
-    ngx_conf_merge_msec_value(conf->upstream_conf.connect_timeout,
-                              prev->upstream_conf.connect_timeout, 5000);
-    ngx_conf_merge_msec_value(conf->upstream_conf.send_timeout,
-                              prev->upstream_conf.send_timeout, 5000);
-    ngx_conf_merge_msec_value(conf->upstream_conf.read_timeout,
-                              prev->upstream_conf.read_timeout, 15000);
+    auto *p = (u_char *)ngx_strchr(name->data, ':');
+    if (p == nullptr) {
+        name->len = value.len - 5;
+        return NGX_OK;
+    }
 
-    ngx_conf_merge_value(conf->enable, prev->enable, 0);
-    ngx_conf_merge_uint_value(conf->mode, prev->mode, NGX_WESERV_PROXY_MODE);
+    name->len = p - name->data;
 
-    if (conf->deny == nullptr) {
-        conf->deny = prev->deny;
+    ngx_str_t s;
+    s.data = p + 1;
+    s.len = value.data + value.len - s.data;
+
+    *size = ngx_parse_size(&s);
+    if (*size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"",
+                           &value);
+        return NGX_ERROR;
     }
 
-    ngx_conf_merge_str_value(conf->user_agent, prev->user_agent,
-                             "Mozilla/5.0 (compatible; ImageFetcher/9.0; "
-                             "+http://wsrv.nl/)");
+    if (*size < static_cast<ssize_t>(8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is too small",
+                           &value);
+        return NGX_ERROR;
+    }
 
-    // Max image size to process is 100 MiB by default
+    return NGX_OK;
+}
+
+char *ngx_weserv_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    auto *cache = reinterpret_cast<ngx_weserv_cache_conf_t *>(
+        static_cast<char *>(conf) + cmd->offset);
+
+    if (cache->zone != NGX_CONF_UNSET_PTR) {
+        return const_cast<char *>("is duplicate");
+    }
+
+    auto *value = static_cast<ngx_str_t *>(cf->args->elts);
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            return const_cast<char *>("has invalid parameters");
+        }
+
+        cache->zone = nullptr;
+        return NGX_CONF_OK;
+    }
+
+    ngx_str_t name = ngx_null_string;
+    ssize_t size = 0;
+
+    for (ngx_uint_t i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+            if (ngx_weserv_parse_zone(cf, value[i], &name, &size) != NGX_OK) {
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "valid=", 6) == 0) {
+            ngx_str_t s;
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            cache->valid = ngx_parse_time(&s, 1);
+            if (cache->valid == static_cast<time_t>(NGX_ERROR) ||
+                cache->valid == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid valid time \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[i]);
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    cache->zone = ngx_weserv_cache_add_zone(cf, &name, size);
+    if (cache->zone == nullptr) {
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    return NGX_CONF_OK;
+}
+
+char *ngx_weserv_origin_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
+                                  void *conf) {
+    auto *lc = static_cast<ngx_weserv_loc_conf_t *>(conf);
+
+    if (lc->origin_keepalive != NGX_CONF_UNSET_PTR) {
+        return const_cast<char *>("is duplicate");
+    }
+
+    auto *value = static_cast<ngx_str_t *>(cf->args->elts);
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            return const_cast<char *>("has invalid parameters");
+        }
+
+        lc->origin_keepalive = nullptr;
+        return NGX_CONF_OK;
+    }
+
+    ngx_int_t connections = ngx_atoi(value[1].data, value[1].len);
+    if (connections == NGX_ERROR || connections == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of connections \"%V\"",
+                           &value[1]);
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    // Close idle connections after 60 seconds and reuse connections for at
+    // most 1000 requests by default (corresponds to the default values of
+    // the keepalive_timeout and keepalive_requests directives of upstreams)
+    ngx_msec_t timeout = 60000;
+    ngx_int_t requests = 1000;
+
+    for (ngx_uint_t i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+            ngx_str_t s;
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            timeout = ngx_parse_time(&s, 0);
+            if (timeout == static_cast<ngx_msec_t>(NGX_ERROR) ||
+                timeout == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid timeout \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "requests=", 9) == 0) {
+            requests = ngx_atoi(value[i].data + 9, value[i].len - 9);
+            if (requests == NGX_ERROR || requests == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid number of requests \"%V\"",
+                                   &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[i]);
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    lc->origin_keepalive = ngx_weserv_keepalive_create(cf, connections);
+    if (lc->origin_keepalive == nullptr) {
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    lc->origin_keepalive->timeout = timeout;
+    lc->origin_keepalive->requests = requests;
+
+    return NGX_CONF_OK;
+}
+
+char *ngx_weserv_resolver_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+                                void *conf) {
+    auto *cache = reinterpret_cast<ngx_weserv_resolver_cache_conf_t *>(
+        static_cast<char *>(conf) + cmd->offset);
+
+    if (cache->zone != NGX_CONF_UNSET_PTR) {
+        return const_cast<char *>("is duplicate");
+    }
+
+    auto *value = static_cast<ngx_str_t *>(cf->args->elts);
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            return const_cast<char *>("has invalid parameters");
+        }
+
+        cache->zone = nullptr;
+        return NGX_CONF_OK;
+    }
+
+    ngx_str_t name = ngx_null_string;
+    ssize_t size = 0;
+
+    for (ngx_uint_t i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+            if (ngx_weserv_parse_zone(cf, value[i], &name, &size) != NGX_OK) {
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "min_valid=", 10) == 0) {
+            ngx_str_t s;
+            s.len = value[i].len - 10;
+            s.data = value[i].data + 10;
+
+            cache->min_valid = ngx_parse_time(&s, 1);
+            if (cache->min_valid == static_cast<time_t>(NGX_ERROR)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid min_valid time \"%V\"",
+                                   &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max_valid=", 10) == 0) {
+            ngx_str_t s;
+            s.len = value[i].len - 10;
+            s.data = value[i].data + 10;
+
+            cache->max_valid = ngx_parse_time(&s, 1);
+            if (cache->max_valid == static_cast<time_t>(NGX_ERROR) ||
+                cache->max_valid == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid max_valid time \"%V\"",
+                                   &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[i]);
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    if (cache->min_valid != NGX_CONF_UNSET &&
+        cache->max_valid != NGX_CONF_UNSET &&
+        cache->min_valid > cache->max_valid) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"min_valid\" is greater than \"max_valid\"");
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    cache->zone = ngx_weserv_cache_add_zone(cf, &name, size);
+    if (cache->zone == nullptr) {
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    return NGX_CONF_OK;
+}
+
+char *ngx_weserv_admission(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    auto *lc = static_cast<ngx_weserv_loc_conf_t *>(conf);
+
+    if (lc->admission != NGX_CONF_UNSET_PTR) {
+        return const_cast<char *>("is duplicate");
+    }
+
+    auto *value = static_cast<ngx_str_t *>(cf->args->elts);
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            return const_cast<char *>("has invalid parameters");
+        }
+
+        lc->admission = nullptr;
+        return NGX_CONF_OK;
+    }
+
+    ngx_int_t budget = ngx_atoi(value[1].data, value[1].len);
+    if (budget == NGX_ERROR || budget == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid budget \"%V\"",
+                           &value[1]);
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    // Let at most 100 images wait for at most 5 seconds by default
+    ngx_int_t queue = 100;
+    ngx_msec_t timeout = 5000;
+
+    for (ngx_uint_t i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "queue=", 6) == 0) {
+            queue = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (queue == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid queue size \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+            ngx_str_t s;
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            timeout = ngx_parse_time(&s, 0);
+            if (timeout == static_cast<ngx_msec_t>(NGX_ERROR) ||
+                timeout == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid timeout \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[i]);
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    // The budget is given in megapixels
+    lc->admission = ngx_weserv_admission_create(
+        cf, static_cast<uint64_t>(budget) * 1000000);
+    if (lc->admission == nullptr) {
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    lc->admission->max_queued = queue;
+    lc->admission->timeout = timeout;
+
+    return NGX_CONF_OK;
+}
+
+char *ngx_weserv_client_hints(ngx_conf_t *cf, ngx_command_t *cmd,
+                              void *conf) {
+    auto *hints = reinterpret_cast<ngx_weserv_client_hints_conf_t *>(
+        static_cast<char *>(conf) + cmd->offset);
+
+    if (hints->widths != NGX_CONF_UNSET_PTR) {
+        return const_cast<char *>("is duplicate");
+    }
+
+    auto *value = static_cast<ngx_str_t *>(cf->args->elts);
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            return const_cast<char *>("has invalid parameters");
+        }
+
+        hints->widths = nullptr;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[1].data, "on") != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid value \"%V\"",
+                           &value[1]);
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    hints->widths = ngx_array_create(cf->pool, 8, sizeof(ngx_uint_t));
+    if (hints->widths == nullptr) {
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    // Use half of the default quality when saving data by default
+    hints->save_data_quality = 40;
+
+    ngx_str_t widths = ngx_string("160,320,640,960,1280,1920,2560");
+
+    for (ngx_uint_t i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "widths=", 7) == 0) {
+            widths.len = value[i].len - 7;
+            widths.data = value[i].data + 7;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "save_data_quality=", 18) == 0) {
+            ngx_int_t quality =
+                ngx_atoi(value[i].data + 18, value[i].len - 18);
+            if (quality == NGX_ERROR || quality < 1 || quality > 100) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid quality \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+
+            hints->save_data_quality = quality;
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[i]);
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    u_char *p = widths.data;
+    u_char *last = widths.data + widths.len;
+
+    while (p < last) {
+        u_char *next = ngx_strlchr(p, last, ',');
+        if (next == nullptr) {
+            next = last;
+        }
+
+        ngx_int_t width = ngx_atoi(p, next - p);
+
+        auto *prev = static_cast<ngx_uint_t *>(hints->widths->elts);
+        ngx_uint_t n = hints->widths->nelts;
+
+        if (width == NGX_ERROR || width == 0 ||
+            (n != 0 && prev[n - 1] >= static_cast<ngx_uint_t>(width))) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid widths \"%V\", must be ascending",
+                               &widths);
+            return static_cast<char *>(NGX_CONF_ERROR);
+        }
+
+        auto *w = static_cast<ngx_uint_t *>(ngx_array_push(hints->widths));
+        if (w == nullptr) {
+            return static_cast<char *>(NGX_CONF_ERROR);
+        }
+
+        *w = width;
+        p = next + 1;
+    }
+
+    if (hints->widths->nelts == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "empty widths");
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    return NGX_CONF_OK;
+}
+
+char *ngx_weserv_mask_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    auto *mc = static_cast<ngx_weserv_main_conf_t *>(conf);
+
+    if (mc->mask_cache_size != NGX_CONF_UNSET_SIZE) {
+        return const_cast<char *>("is duplicate");
+    }
+
+    auto *value = static_cast<ngx_str_t *>(cf->args->elts);
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            return const_cast<char *>("has invalid parameters");
+        }
+
+        mc->mask_cache_size = 0;
+        return NGX_CONF_OK;
+    }
+
+    ssize_t size = ngx_parse_size(&value[1]);
+    if (size == NGX_ERROR || size == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid size \"%V\"",
+                           &value[1]);
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    mc->mask_cache_size = size;
+
+    for (ngx_uint_t i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "preload=", 8) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[i]);
+            return static_cast<char *>(NGX_CONF_ERROR);
+        }
+
+        if (mc->mask_preload == nullptr) {
+            mc->mask_preload = ngx_array_create(
+                cf->pool, 4, sizeof(ngx_weserv_mask_preload_t));
+            if (mc->mask_preload == nullptr) {
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+        }
+
+        // A comma-separated list of shape:WIDTHxHEIGHT
+        u_char *p = value[i].data + 8;
+        u_char *last = value[i].data + value[i].len;
+
+        while (p < last) {
+            u_char *next = ngx_strlchr(p, last, ',');
+            if (next == nullptr) {
+                next = last;
+            }
+
+            u_char *colon = ngx_strlchr(p, next, ':');
+            u_char *x = colon != nullptr ? ngx_strlchr(colon, next, 'x')
+                                         : nullptr;
+
+            ngx_int_t width = x != nullptr
+                                  ? ngx_atoi(colon + 1, x - colon - 1)
+                                  : NGX_ERROR;
+            ngx_int_t height =
+                x != nullptr ? ngx_atoi(x + 1, next - x - 1) : NGX_ERROR;
+
+            if (colon == p || width == NGX_ERROR || width == 0 ||
+                height == NGX_ERROR || height == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid mask \"%*s\" in \"%V\"",
+                                   static_cast<size_t>(next - p), p,
+                                   &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+
+            auto *mask = static_cast<ngx_weserv_mask_preload_t *>(
+                ngx_array_push(mc->mask_preload));
+            if (mask == nullptr) {
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+
+            mask->query.len = sizeof("mask=") - 1 + (colon - p);
+            mask->query.data =
+                static_cast<u_char *>(ngx_pnalloc(cf->pool, mask->query.len));
+            if (mask->query.data == nullptr) {
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+
+            ngx_memcpy(ngx_cpymem(mask->query.data, "mask=",
+                                  sizeof("mask=") - 1),
+                       p, colon - p);
+
+            mask->width = width;
+            mask->height = height;
+
+            p = next + 1;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+char *ngx_weserv_image_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+                             void *conf) {
+    auto *mc = static_cast<ngx_weserv_main_conf_t *>(conf);
+
+    auto *size = reinterpret_cast<ngx_uint_t *>(reinterpret_cast<char *>(mc) +
+                                                cmd->offset);
+    if (*size != NGX_CONF_UNSET_UINT) {
+        return const_cast<char *>("is duplicate");
+    }
+
+    auto *value = static_cast<ngx_str_t *>(cf->args->elts);
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        *size = 0;
+        return NGX_CONF_OK;
+    }
+
+    ngx_int_t n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid number \"%V\"",
+                           &value[1]);
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    *size = n;
+
+    // Entries are keyed by the identity of the image
+    mc->identify_images = 1;
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * Create weserv module's main context configuration
+ */
+void *ngx_weserv_create_main_conf(ngx_conf_t *cf) {
+    auto *conf =
+        register_pool_cleanup(cf->pool, new (cf->pool) ngx_weserv_main_conf_t);
+    if (conf == nullptr) {
+        return nullptr;
+    }
+
+    ngx_str_set(&conf->origin_upstream.host, "weserv");
+    conf->origin_upstream.peer.init = ngx_weserv_upstream_init_peer;
+
+    conf->mask_cache_size = NGX_CONF_UNSET_SIZE;
+    conf->pyramid_cache_size = NGX_CONF_UNSET_UINT;
+    conf->saliency_cache_size = NGX_CONF_UNSET_UINT;
+    conf->stream_input_jobs = NGX_CONF_UNSET;
+
+    return conf;
+}
+
+/**
+ * Init weserv module's main context configuration
+ */
+char *ngx_weserv_init_main_conf(ngx_conf_t * /* unused */, void *conf) {
+    auto *mc = static_cast<ngx_weserv_main_conf_t *>(conf);
+
+    ngx_conf_init_value(mc->stream_input_jobs, 4);
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * Create weserv module's location config.
+ */
+void *ngx_weserv_create_loc_conf(ngx_conf_t *cf) {
+    auto *mc = static_cast<ngx_weserv_main_conf_t *>(
+        ngx_http_conf_get_module_main_conf(cf, ngx_weserv_module));
+
+    auto *lc = new (cf->pool) ngx_weserv_loc_conf_t;
+    if (lc == nullptr) {
+        return nullptr;
+    }
+
+    lc->upstream_conf.connect_timeout = NGX_CONF_UNSET_MSEC;
+    lc->upstream_conf.send_timeout = NGX_CONF_UNSET_MSEC;
+    lc->upstream_conf.read_timeout = NGX_CONF_UNSET_MSEC;
+
+    // The hardcoded values
+    lc->upstream_conf.buffering = 1;
+    lc->upstream_conf.buffer_size =
+        4 * ngx_pagesize;  // 4 memory pages should be enough for most response
+                           // headers
+    lc->upstream_conf.busy_buffers_size =
+        6 * ngx_pagesize;  // Essentially, buffer_size + 2 memory pages
+    lc->upstream_conf.bufs.num = 256;
+    lc->upstream_conf.bufs.size = ngx_pagesize;
+    lc->upstream_conf.max_temp_file_size = 0;
+    lc->upstream_conf.temp_file_write_size = 0;
+
+    // Request origins through the module's own upstream
+    lc->upstream_conf.upstream = &mc->origin_upstream;
+
+    // Attempt to do a failover with a maximum of 3 tries when a domain name
+    // resolves to several addresses
+    lc->upstream_conf.next_upstream_tries = 3;
+    lc->upstream_conf.next_upstream_timeout = 0;
+    lc->upstream_conf.next_upstream =
+        (NGX_CONF_BITMASK_SET | NGX_HTTP_UPSTREAM_FT_ERROR |
+         NGX_HTTP_UPSTREAM_FT_TIMEOUT);
+
+    // Do not pass the client request headers or body to the upstream
+    lc->upstream_conf.pass_request_headers = 0;
+    lc->upstream_conf.pass_request_body = 0;
+
+    lc->upstream_conf.hide_headers =
+        static_cast<ngx_array_t *>(NGX_CONF_UNSET_PTR);
+    lc->upstream_conf.pass_headers =
+        static_cast<ngx_array_t *>(NGX_CONF_UNSET_PTR);
+
+    // Set up SSL if available
+#if NGX_HTTP_SSL
+    // Initialize SSL
+    ngx_pool_cleanup_t *ssl_cleanup =
+        ngx_pool_cleanup_add(cf->pool, sizeof(ngx_ssl_t));
+    if (ssl_cleanup == nullptr) {
+        return nullptr;
+    }
+
+    auto *ssl = static_cast<ngx_ssl_t *>(ssl_cleanup->data);
+    ngx_memzero(ssl, sizeof(ngx_ssl_t));
+    ssl->log = cf->log;
+
+    if (ngx_ssl_create(ssl,
+                       NGX_SSL_SSLv2 | NGX_SSL_SSLv3 | NGX_SSL_TLSv1 |
+                           NGX_SSL_TLSv1_1 | NGX_SSL_TLSv1_2 | NGX_SSL_TLSv1_3,
+                       nullptr) != NGX_OK) {
+        return nullptr;
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+    // Use the lowest OpenSSL security level to ensure maximum compatibility.
+    // This is basically the same as using OpenSSL 1.0, which lacks a minimum
+    // security policy.
+    SSL_CTX_set_security_level(ssl->ctx, 0);
+#endif
+
+    ssl_cleanup->handler = ngx_ssl_cleanup_ctx;
+
+    lc->upstream_conf.ssl = ssl;
+    lc->upstream_conf.ssl_session_reuse = 1;
+
+    if (ngx_ssl_client_session_cache(cf, lc->upstream_conf.ssl,
+                                     lc->upstream_conf.ssl_session_reuse) !=
+        NGX_OK) {
+        return nullptr;
+    }
+
+    // For SNI (Server Name Indication) support
+    lc->upstream_conf.ssl_server_name = 1;
+#endif
+
+    lc->enable = NGX_CONF_UNSET;
+    lc->mode = NGX_CONF_UNSET_UINT;
+    lc->max_size = NGX_CONF_UNSET_SIZE;
+    lc->max_redirects = NGX_CONF_UNSET_UINT;
+    lc->canonical_header = NGX_CONF_UNSET;
+    lc->auto_output = NGX_CONF_UNSET;
+    lc->client_hints.widths = static_cast<ngx_array_t *>(NGX_CONF_UNSET_PTR);
+    lc->stream_input = NGX_CONF_UNSET;
+    lc->cache.zone = static_cast<ngx_shm_zone_t *>(NGX_CONF_UNSET_PTR);
+    lc->cache.valid = NGX_CONF_UNSET;
+    lc->cache_lock = NGX_CONF_UNSET;
+    lc->cache_lock_timeout = NGX_CONF_UNSET_MSEC;
+    lc->origin_cache.zone = static_cast<ngx_shm_zone_t *>(NGX_CONF_UNSET_PTR);
+    lc->origin_cache.valid = NGX_CONF_UNSET;
+    lc->origin_keepalive =
+        static_cast<ngx_weserv_keepalive_t *>(NGX_CONF_UNSET_PTR);
+    lc->resolver_cache.zone =
+        static_cast<ngx_shm_zone_t *>(NGX_CONF_UNSET_PTR);
+    lc->resolver_cache.min_valid = NGX_CONF_UNSET;
+    lc->resolver_cache.max_valid = NGX_CONF_UNSET;
+#if NGX_THREADS
+    lc->thread_pool = static_cast<ngx_thread_pool_t *>(NGX_CONF_UNSET_PTR);
+#endif
+    lc->admission = static_cast<ngx_weserv_admission_t *>(NGX_CONF_UNSET_PTR);
+
+    // API configuration
+    lc->api_conf.savers = 0;
+    lc->api_conf.process_timeout = NGX_CONF_UNSET;
+    lc->api_conf.limit_input_pixels = NGX_CONF_UNSET_UINT;
+    lc->api_conf.limit_output_pixels = NGX_CONF_UNSET_UINT;
+    lc->api_conf.max_pages = NGX_CONF_UNSET;
+    lc->api_conf.quality = NGX_CONF_UNSET;
+    lc->api_conf.avif_quality = NGX_CONF_UNSET;
+    lc->api_conf.jpeg_quality = NGX_CONF_UNSET;
+    lc->api_conf.tiff_quality = NGX_CONF_UNSET;
+    lc->api_conf.webp_quality = NGX_CONF_UNSET;
+    lc->api_conf.avif_effort = NGX_CONF_UNSET;
+    lc->api_conf.gif_effort = NGX_CONF_UNSET;
+    lc->api_conf.webp_effort = NGX_CONF_UNSET;
+    lc->api_conf.zlib_level = NGX_CONF_UNSET;
+    lc->api_conf.fail_on_error = NGX_CONF_UNSET;
+    lc->api_conf.trim_preview = NGX_CONF_UNSET;
+    lc->api_conf.smartcrop_size = NGX_CONF_UNSET;
+
+    return lc;
+}
+
+/**
+ * Merge weserv module's location config.
+ */
+char *ngx_weserv_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child) {
+    auto *prev = static_cast<ngx_weserv_loc_conf_t *>(parent);
+    auto *conf = static_cast<ngx_weserv_loc_conf_t *>(child);
+
+    ngx_conf_merge_msec_value(conf->upstream_conf.connect_timeout,
+                              prev->upstream_conf.connect_timeout, 5000);
+    ngx_conf_merge_msec_value(conf->upstream_conf.send_timeout,
+                              prev->upstream_conf.send_timeout, 5000);
+    ngx_conf_merge_msec_value(conf->upstream_conf.read_timeout,
+                              prev->upstream_conf.read_timeout, 15000);
+
+    ngx_conf_merge_value(conf->enable, prev->enable, 0);
+    ngx_conf_merge_uint_value(conf->mode, prev->mode, NGX_WESERV_PROXY_MODE);
+
+    if (conf->deny == nullptr) {
+        conf->deny = prev->deny;
+    }
+
+    ngx_conf_merge_str_value(conf->user_agent, prev->user_agent,
+                             "Mozilla/5.0 (compatible; ImageFetcher/9.0; "
+                             "+http://wsrv.nl/)");
+
+    // Max image size to process is 100 MiB by default
     ngx_conf_merge_size_value(conf->max_size, prev->max_size,
                               100 * 1024 * 1024);
 
-    // Follow 10 redirects by default
-    ngx_conf_merge_uint_value(conf->max_redirects, prev->max_redirects, 10);
+    // Follow 10 redirects by default
+    ngx_conf_merge_uint_value(conf->max_redirects, prev->max_redirects, 10);
+
+    // Set the rel="canonical" response header by default on proxied images
+    ngx_conf_merge_value(conf->canonical_header, prev->canonical_header, 1);
+
+    // Only negotiate the output format of `&output=auto` by default
+    ngx_conf_merge_value(conf->auto_output, prev->auto_output, 0);
+
+    // Ignore client hints by default
+    if (conf->client_hints.widths == NGX_CONF_UNSET_PTR) {
+        conf->client_hints = prev->client_hints;
+    }
+
+    if (conf->client_hints.widths == NGX_CONF_UNSET_PTR) {
+        conf->client_hints.widths = nullptr;
+    }
+
+#if NGX_THREADS
+    // Process images on the event loop by default
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, nullptr);
+
+    if (conf->priorities == nullptr) {
+        conf->priorities = prev->priorities;
+    }
+#endif
+
+    // Don't limit the cost of the images being processed by default
+    ngx_conf_merge_ptr_value(conf->admission, prev->admission, nullptr);
+
+    // Wait for the entire image to arrive before processing by default
+    ngx_conf_merge_value(conf->stream_input, prev->stream_input, 0);
+
+    // Don't cache transformed images by default, otherwise cache them for
+    // 1 hour
+    ngx_conf_merge_ptr_value(conf->cache.zone, prev->cache.zone, nullptr);
+    ngx_conf_merge_sec_value(conf->cache.valid, prev->cache.valid, 60 * 60);
+
+    // Don't let concurrent requests wait for each other by default, otherwise
+    // wait for at most 5 seconds
+    ngx_conf_merge_value(conf->cache_lock, prev->cache_lock, 0);
+    ngx_conf_merge_msec_value(conf->cache_lock_timeout,
+                              prev->cache_lock_timeout, 5000);
+
+    // Don't cache images received from the origin by default, otherwise
+    // consider them fresh for 10 minutes if the origin doesn't specify
+    // otherwise
+    ngx_conf_merge_ptr_value(conf->origin_cache.zone, prev->origin_cache.zone,
+                             nullptr);
+    ngx_conf_merge_sec_value(conf->origin_cache.valid, prev->origin_cache.valid,
+                             10 * 60);
+
+    // Close connections to origins after each request by default
+    ngx_conf_merge_ptr_value(conf->origin_keepalive, prev->origin_keepalive,
+                             nullptr);
+
+    // Don't cache resolved origin hosts by default, otherwise cache them for
+    // the TTL of their records, but for at most 1 hour
+    ngx_conf_merge_ptr_value(conf->resolver_cache.zone,
+                             prev->resolver_cache.zone, nullptr);
+    ngx_conf_merge_sec_value(conf->resolver_cache.min_valid,
+                             prev->resolver_cache.min_valid, 0);
+    ngx_conf_merge_sec_value(conf->resolver_cache.max_valid,
+                             prev->resolver_cache.max_valid, 60 * 60);
+
+    if (conf->resolver_cache.min_valid > conf->resolver_cache.max_valid) {
+        conf->resolver_cache.min_valid = conf->resolver_cache.max_valid;
+    }
+
+    // All supported savers are enabled by default
+    ngx_conf_merge_bitmask_value(
+        conf->api_conf.savers, prev->api_conf.savers,
+        (NGX_CONF_BITMASK_SET | static_cast<ngx_uint_t>(Output::All)));
+
+    // Abort image processing after 10 seconds by default
+    ngx_conf_merge_value(conf->api_conf.process_timeout,
+                         prev->api_conf.process_timeout, 10);
+
+    // Process at the maximum 256 pages, which should be plenty
+    ngx_conf_merge_value(conf->api_conf.max_pages, prev->api_conf.max_pages,
+                         256);
+
+    // Do not process images where the number of pixels exceeds 71000000
+    ngx_conf_merge_uint_value(conf->api_conf.limit_input_pixels,
+                              prev->api_conf.limit_input_pixels, 71000000);
+
+    // Do not output images where the number of pixels exceeds 71000000
+    ngx_conf_merge_uint_value(conf->api_conf.limit_output_pixels,
+                              prev->api_conf.limit_output_pixels, 71000000);
+
+    // The default quality of 80 usually produces excellent results
+    ngx_conf_merge_value(conf->api_conf.quality, prev->api_conf.quality, 80);
+    ngx_conf_merge_value(conf->api_conf.avif_quality,
+                         prev->api_conf.avif_quality, conf->api_conf.quality);
+    ngx_conf_merge_value(conf->api_conf.jpeg_quality,
+                         prev->api_conf.jpeg_quality, conf->api_conf.quality);
+    ngx_conf_merge_value(conf->api_conf.tiff_quality,
+                         prev->api_conf.tiff_quality, conf->api_conf.quality);
+    ngx_conf_merge_value(conf->api_conf.webp_quality,
+                         prev->api_conf.webp_quality, conf->api_conf.quality);
+
+    // A default compromise between speed and compression effectiveness
+    // (corresponds to the default values in libvips)
+    ngx_conf_merge_value(conf->api_conf.avif_effort, prev->api_conf.avif_effort,
+                         4);
+    ngx_conf_merge_value(conf->api_conf.gif_effort, prev->api_conf.gif_effort,
+                         7);
+    ngx_conf_merge_value(conf->api_conf.webp_effort, prev->api_conf.webp_effort,
+                         4);
+    ngx_conf_merge_value(conf->api_conf.zlib_level, prev->api_conf.zlib_level,
+                         6);
+
+    // Do a "best effort" to decode images, even if the data is corrupt or
+    // invalid
+    ngx_conf_merge_value(conf->api_conf.fail_on_error,
+                         prev->api_conf.fail_on_error, 0);
+
+    // Find the bounding box of `&trim=` on a downscaled preview
+    ngx_conf_merge_value(conf->api_conf.trim_preview,
+                         prev->api_conf.trim_preview, 0);
+
+    // Search the smart crop window at full resolution
+    ngx_conf_merge_value(conf->api_conf.smartcrop_size,
+                         prev->api_conf.smartcrop_size, 0);
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * weserv module initialization.
+ */
+ngx_int_t ngx_weserv_init_module(ngx_cycle_t *cycle) {
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cycle->log, 0, "ngx_weserv_init_module");
+
+    auto *mc = static_cast<ngx_weserv_main_conf_t *>(
+        ngx_http_cycle_get_module_main_conf(cycle, ngx_weserv_module));
+    if (mc == nullptr) {
+        // Handle the case where there is no http section at all
+        return NGX_OK;
+    }
+
+    api::ApiManagerFactory weserv_factory;
+    mc->weserv = weserv_factory.create_api_manager(
+        std::make_unique<NgxEnvironment>(cycle->log));
+
+    return NGX_OK;
+}
+
+/**
+ * weserv worker process initialization.
+ */
+ngx_int_t ngx_weserv_init_process(ngx_cycle_t *cycle) {
+    auto *mc = static_cast<ngx_weserv_main_conf_t *>(
+        ngx_http_cycle_get_module_main_conf(cycle, ngx_weserv_module));
+    if (mc == nullptr) {
+        return NGX_OK;
+    }
+
+    if (mc->pyramid_cache_size != NGX_CONF_UNSET_UINT) {
+        mc->weserv->set_pyramid_cache_size(mc->pyramid_cache_size);
+    }
+
+    if (mc->saliency_cache_size != NGX_CONF_UNSET_UINT) {
+        mc->weserv->set_saliency_cache_size(mc->saliency_cache_size);
+    }
+
+    if (mc->mask_cache_size == NGX_CONF_UNSET_SIZE ||
+        mc->mask_cache_size == 0) {
+        return NGX_OK;
+    }
+
+    mc->weserv->set_mask_cache_size(mc->mask_cache_size);
+
+    if (mc->mask_preload == nullptr) {
+        return NGX_OK;
+    }
+
+    auto *masks =
+        static_cast<ngx_weserv_mask_preload_t *>(mc->mask_preload->elts);
+
+    for (ngx_uint_t i = 0; i < mc->mask_preload->nelts; i++) {
+        ngx_weserv_mask_preload_t *mask = &masks[i];
+
+        Status status = mc->weserv->preload_mask(
+            std::string(reinterpret_cast<char *>(mask->query.data),
+                        mask->query.len),
+            static_cast<int>(mask->width), static_cast<int>(mask->height));
+        if (!status.ok()) {
+            ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                          "weserv: failed to preload \"%V\" at %uix%ui: %s",
+                          &mask->query, mask->width, mask->height,
+                          status.message().c_str());
+        }
+    }
+
+    return NGX_OK;
+}
+
+ngx_int_t ngx_weserv_image_header_filter(ngx_http_request_t *r) {
+    if (r->headers_out.status == NGX_HTTP_NOT_MODIFIED) {
+        return ngx_http_next_header_filter(r);
+    }
+
+    if (r != r->main) {
+        return ngx_http_next_header_filter(r);
+    }
+
+    auto *lc = static_cast<ngx_weserv_loc_conf_t *>(
+        ngx_http_get_module_loc_conf(r, ngx_weserv_module));
+
+    if (!lc->enable) {
+        return ngx_http_next_header_filter(r);
+    }
+
+    auto *ctx = static_cast<ngx_weserv_base_ctx_t *>(
+        ngx_http_get_module_ctx(r, ngx_weserv_module));
+
+    if (ctx == nullptr) {
+        // Context must always be available for proxy mode
+        if (lc->mode == NGX_WESERV_PROXY_MODE) {
+            return ngx_http_next_header_filter(r);
+        }
+
+        // For filter mode; we allocate and register a weserv base module
+        // context on first use
+        ctx = register_pool_cleanup(r->pool,
+                                    new (r->pool) ngx_weserv_base_ctx_t());
 
-    // Set the rel="canonical" response header by default on proxied images
-    ngx_conf_merge_value(conf->canonical_header, prev->canonical_header, 1);
+        if (ctx == nullptr) {
+            return NGX_ERROR;
+        }
 
-    // All supported savers are enabled by default
-    ngx_conf_merge_bitmask_value(
-        conf->api_conf.savers, prev->api_conf.savers,
-        (NGX_CONF_BITMASK_SET | static_cast<ngx_uint_t>(Output::All)));
+        // Set the request's weserv module context
+        ngx_http_set_ctx(r, ctx, ngx_weserv_module);
 
-    // Abort image processing after 10 seconds by default
-    ngx_conf_merge_value(conf->api_conf.process_timeout,
-                         prev->api_conf.process_timeout, 10);
+        // Negotiate the output format and apply the client hints before the
+        // cache key is calculated
+        if (negotiate_output(r, lc->api_conf.savers, lc->auto_output) !=
+            NGX_OK) {
+            return NGX_ERROR;
+        }
 
-    // Process at the maximum 256 pages, which should be plenty
-    ngx_conf_merge_value(conf->api_conf.max_pages, prev->api_conf.max_pages,
-                         256);
+        if (lc->client_hints.widths != nullptr &&
+            apply_client_hints(r, *lc->client_hints.widths,
+                               lc->client_hints.save_data_quality) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
 
-    // Do not process images where the number of pixels exceeds 71000000
-    ngx_conf_merge_uint_value(conf->api_conf.limit_input_pixels,
-                              prev->api_conf.limit_input_pixels, 71000000);
+    ngx_buf_t *stale = nullptr;
 
-    // Do not output images where the number of pixels exceeds 71000000
-    ngx_conf_merge_uint_value(conf->api_conf.limit_output_pixels,
-                              prev->api_conf.limit_output_pixels, 71000000);
+    if (lc->mode == NGX_WESERV_PROXY_MODE) {
+        auto *upstream_ctx = dynamic_cast<ngx_weserv_upstream_ctx_t *>(ctx);
 
-    // The default quality of 80 usually produces excellent results
-    ngx_conf_merge_value(conf->api_conf.quality, prev->api_conf.quality, 80);
-    ngx_conf_merge_value(conf->api_conf.avif_quality,
-                         prev->api_conf.avif_quality, conf->api_conf.quality);
-    ngx_conf_merge_value(conf->api_conf.jpeg_quality,
-                         prev->api_conf.jpeg_quality, conf->api_conf.quality);
-    ngx_conf_merge_value(conf->api_conf.tiff_quality,
-                         prev->api_conf.tiff_quality, conf->api_conf.quality);
-    ngx_conf_merge_value(conf->api_conf.webp_quality,
-                         prev->api_conf.webp_quality, conf->api_conf.quality);
+        // The origin confirmed that the stale image from the origin cache is
+        // still valid, so that image is used instead of the empty response
+        if (upstream_ctx->not_modified) {
+            stale = upstream_ctx->origin_cached;
+            r->headers_out.content_length_n = ngx_buf_size(stale);
+        }
+    }
 
-    // A default compromise between speed and compression effectiveness
-    // (corresponds to the default values in libvips)
-    ngx_conf_merge_value(conf->api_conf.avif_effort, prev->api_conf.avif_effort,
-                         4);
-    ngx_conf_merge_value(conf->api_conf.gif_effort, prev->api_conf.gif_effort,
-                         7);
-    ngx_conf_merge_value(conf->api_conf.webp_effort, prev->api_conf.webp_effort,
-                         4);
-    ngx_conf_merge_value(conf->api_conf.zlib_level, prev->api_conf.zlib_level,
-                         6);
+    // Slabs are allocated as data arrives when the length is unknown
+    ctx->image.init(r->pool, r->headers_out.content_length_n, lc->max_size);
 
-    // Do a "best effort" to decode images, even if the data is corrupt or
-    // invalid
-    ngx_conf_merge_value(conf->api_conf.fail_on_error,
-                         prev->api_conf.fail_on_error, 0);
+    if (stale != nullptr &&
+        ctx->image.append(stale->pos, stale->last - stale->pos) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->main_filter_need_in_memory = 1;
+
+    ngx_http_clear_content_length(r);
+    ngx_http_clear_accept_ranges(r);
+    ngx_http_clear_last_modified(r);
+    ngx_http_clear_etag(r);
+
+    // For proxy mode, the cache is already consulted before the image is
+    // requested. Any response other than the image itself, e.g. a 403 of an
+    // access rule or a 404 of a deleted image, must not be replaced by the
+    // cached image.
+    if (lc->cache.zone != nullptr && lc->mode == NGX_WESERV_FILTER_MODE &&
+        r->headers_out.status == NGX_HTTP_OK) {
+        ngx_str_t origin;
+        origin.len = r->headers_in.server.len + r->uri.len;
+        origin.data = static_cast<u_char *>(ngx_pnalloc(r->pool, origin.len));
+        if (origin.data == nullptr) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(ngx_cpymem(origin.data, r->headers_in.server.data,
+                              r->headers_in.server.len),
+                   r->uri.data, r->uri.len);
+
+        ngx_str_t args;
+        if (ngx_weserv_cache_args(r, &args) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_weserv_cache_key(origin, args, lc->api_conf, ctx->cache_key);
+        ctx->cacheable = 1;
+
+        ngx_int_t rc = ngx_weserv_cache_lookup_image(r, lc->cache.zone,
+                                                     ctx->cache_key,
+                                                     &ctx->cached);
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        // The client already has the cached image
+        if (rc == NGX_HTTP_NOT_MODIFIED) {
+            ctx->finished = 1;
+
+            return ngx_http_next_header_filter(r);
+        }
+
+        // The cached image is sent as soon as the body filter is called, the
+        // response of the origin is discarded
+        ctx->cache_hit = rc == NGX_OK;
+    }
+
+    return NGX_OK;
+}
+
+ngx_int_t ngx_weserv_image_filter_read(ngx_http_request_t *r,
+                                       ngx_weserv_base_ctx_t *ctx,
+                                       ngx_chain_t *in) {
+    for (ngx_chain_t *cl = in; cl; cl = cl->next) {
+        ngx_buf_t *b = cl->buf;
+        size_t size = b->last - b->pos;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "image buf: %uz", size);
+
+        ngx_int_t rc = ctx->image.append(b->pos, size);
+        if (rc == NGX_DECLINED) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "weserv image filter: too big response");
+        }
+
+        if (rc != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        b->pos += size;
+
+        if (b->last_buf) {
+            ngx_free_chain(r->pool, cl);
+
+            return NGX_OK;
+        }
+    }
+
+    r->connection->buffered |= NGX_WESERV_IMAGE_BUFFERED;
+
+    return NGX_AGAIN;
+}
+
+ngx_int_t ngx_weserv_finish(ngx_http_request_t *r, ngx_chain_t *out) {
+    ngx_int_t rc = ngx_http_next_header_filter(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_next_body_filter(r, out);
+}
+
+/**
+ * Calculates the ETag of the transformation, once the entire image has been
+ * received.
+ */
+ngx_int_t ngx_weserv_etag(ngx_http_request_t *r, ngx_weserv_loc_conf_t *lc,
+                          ngx_weserv_base_ctx_t *ctx) {
+    auto *clcf = static_cast<ngx_http_core_loc_conf_t *>(
+        ngx_http_get_module_loc_conf(r, ngx_http_core_module));
+
+    if (!clcf->etag) {
+        return NGX_OK;
+    }
+
+    return ngx_weserv_cache_etag(r, lc->api_conf, ctx->image, &ctx->etag);
+}
+
+/**
+ * Sends a 304 Not Modified response, without processing the image.
+ */
+ngx_int_t ngx_weserv_finish_not_modified(ngx_http_request_t *r,
+                                         ngx_weserv_base_ctx_t *ctx) {
+    ctx->finished = 1;
+    ctx->image.free();
+
+    r->connection->buffered &= ~NGX_WESERV_IMAGE_BUFFERED;
+
+    if (set_etag_header(r, ctx->etag) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    set_not_modified(r);
+
+    ngx_int_t rc = ngx_http_next_header_filter(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_next_body_filter(r, nullptr);
+}
+
+#if NGX_DEBUG
+ngx_int_t ngx_weserv_finish_debug_chain(ngx_http_request_t *r,
+                                        ngx_chain_t *out) {
+    off_t content_length = 0;
+
+    for (ngx_chain_t *cl = out; cl; cl = cl->next) {
+        content_length += cl->buf->last - cl->buf->pos;
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_type_len = sizeof("text/plain") - 1;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_lowcase = nullptr;
+    r->headers_out.content_length_n = content_length;
+
+    return ngx_weserv_finish(r, out);
+}
+
+ngx_int_t ngx_weserv_finish_debug_output(ngx_http_request_t *r,
+                                         ngx_weserv_base_ctx_t *ctx) {
+    size_t size = ctx->image.size();
+
+    ngx_buf_t *buf = ngx_create_temp_buf(r->pool, size);
+    if (buf == nullptr) {
+        return NGX_ERROR;
+    }
+
+    buf->last_buf = 1;
+    buf->last_in_chain = 1;
+    ctx->image.copy(0, buf->last, size);
+    buf->last += size;
+
+    ngx_chain_t *out = ngx_alloc_chain_link(r->pool);
+    if (out == nullptr) {
+        return NGX_ERROR;
+    }
+
+    out->buf = buf;
+    out->next = nullptr;
+
+    return ngx_weserv_finish_debug_chain(r, out);
+}
+#endif
+
+/**
+ * Sends the outcome of an image processing job to the next filters.
+ */
+ngx_int_t ngx_weserv_job_output(ngx_http_request_t *r,
+                                ngx_weserv_base_ctx_t *ctx,
+                                ngx_weserv_upstream_ctx_t *upstream_ctx,
+                                ngx_weserv_job_t *job) {
+    // Memory is released immediately after the image output is complete,
+    // without waiting for the entire response to be sent to the client
+    ctx->image.free();
+
+    // Let the waiting images be processed
+    ngx_weserv_admission_release(ctx->ticket);
+
+    ngx_chain_t *out = job->out;
+
+    if (job->status.ok() &&
+        static_cast<NgxTarget *>(job->target.get())->set_headers() != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (job->status.ok() && ctx->etag.len != 0 &&
+        set_etag_header(r, ctx->etag) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (!job->status.ok()) {
+        // Let the waiting requests try for themselves
+        ngx_weserv_cache_unlock(ctx);
+
+        out = ngx_weserv_error_chain(r, upstream_ctx, job->status);
+        if (out == NGX_CHAIN_ERROR) {
+            return NGX_ERROR;
+        }
+
+        return ngx_weserv_finish(r, out);
+    }
+
+    auto *lc = static_cast<ngx_weserv_loc_conf_t *>(
+        ngx_http_get_module_loc_conf(r, ngx_weserv_module));
+
+    if (lc->cache.zone != nullptr && ctx->cacheable) {
+        auto *target = static_cast<NgxTarget *>(job->target.get());
+
+        ngx_str_t canonical = ngx_null_string;
+        if (upstream_ctx != nullptr) {
+            canonical = upstream_ctx->canonical;
+        }
+
+        // A failure to store the image is not fatal
+        (void)ngx_weserv_cache_store_image(
+            lc->cache.zone, ctx->cache_key, lc->cache.valid,
+            target->extension(), canonical, ctx->etag, out,
+            target->content_length());
+    }
+
+    // The waiting requests can be served from the cache now
+    ngx_weserv_cache_unlock(ctx);
+
+    if (is_base64_needed(r)) {
+        out = output_chain_to_base64(r, out);
+        if (out == NGX_CHAIN_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    return ngx_weserv_finish(r, out);
+}
+
+/**
+ * Creates an error response for images that exceed weserv_max_size.
+ */
+ngx_chain_t *
+ngx_weserv_too_large_chain(ngx_http_request_t *r, ngx_weserv_loc_conf_t *lc,
+                           ngx_weserv_upstream_ctx_t *upstream_ctx) {
+    Status status = {Status::Code::ImageTooLarge,
+                     "The image is too large to be processed. "
+                     "Max image size: " +
+                         std::to_string(lc->max_size) + " bytes",
+                     Status::ErrorCause::Application};
+
+    return ngx_weserv_error_chain(r, upstream_ctx, status);
+}
+
+/**
+ * Creates an error response for images that exceed
+ * weserv_limit_input_pixels.
+ */
+ngx_chain_t *
+ngx_weserv_too_many_pixels_chain(ngx_http_request_t *r,
+                                 ngx_weserv_loc_conf_t *lc,
+                                 ngx_weserv_upstream_ctx_t *upstream_ctx) {
+    Status status = {Status::Code::ImageTooLarge,
+                     "Input image exceeds pixel limit. "
+                     "Width x height should be less than " +
+                         std::to_string(lc->api_conf.limit_input_pixels),
+                     Status::ErrorCause::Application};
+
+    return ngx_weserv_error_chain(r, upstream_ctx, status);
+}
+
+/**
+ * Creates an error response for images that don't fit in the cost budget of
+ * weserv_admission.
+ */
+ngx_chain_t *
+ngx_weserv_overloaded_chain(ngx_http_request_t *r, ngx_weserv_loc_conf_t *lc,
+                            ngx_weserv_upstream_ctx_t *upstream_ctx) {
+    // Ask the client to come back once the waiting images are likely
+    // processed
+    auto delay = static_cast<time_t>(lc->admission->timeout / 1000);
+    delay = ngx_max(delay, 1);
+    if (set_retry_after_header(r, delay) != NGX_OK) {
+        return NGX_CHAIN_ERROR;
+    }
+
+    Status status = {Status::Code::Overloaded,
+                     "The server is too busy to process this image. "
+                     "Please try again later.",
+                     Status::ErrorCause::Application};
+
+    return ngx_weserv_error_chain(r, upstream_ctx, status);
+}
+
+/**
+ * Claims the estimated cost of processing the image from the budget of
+ * weserv_admission, if any.
+ * @param wait Whether to wait for the budget if the image doesn't fit.
+ * @return See ngx_weserv_admission_acquire.
+ */
+ngx_int_t ngx_weserv_admit(ngx_http_request_t *r, ngx_weserv_loc_conf_t *lc,
+                           ngx_weserv_base_ctx_t *ctx, bool wait) {
+    if (lc->admission == nullptr) {
+        return NGX_OK;
+    }
 
-    return NGX_CONF_OK;
+    uint64_t cost = ngx_weserv_admission_cost(r, lc->api_conf, ctx->dimensions,
+                                              ctx->image.size());
+
+    return ngx_weserv_admission_acquire(r, lc->admission, cost, wait,
+                                        &ctx->ticket);
 }
 
 /**
- * weserv module initialization.
+ * Sniffs the dimensions of the incoming image as it arrives, so that images
+ * that exceed weserv_limit_input_pixels are rejected without receiving them
+ * entirely, and so that the cost of processing them can be estimated, also
+ * before they're streamed. The dimensions are only sniffed from the first slab
+ * of the image. Images of which a page is selected aren't rejected early.
+ * @param complete Whether the entire image has been received.
+ * @return NGX_DECLINED if the image exceeds the limit, NGX_OK otherwise.
  */
-ngx_int_t ngx_weserv_init_module(ngx_cycle_t *cycle) {
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cycle->log, 0, "ngx_weserv_init_module");
+ngx_int_t ngx_weserv_image_probe(ngx_http_request_t *r,
+                                 ngx_weserv_loc_conf_t *lc,
+                                 ngx_weserv_base_ctx_t *ctx, bool complete) {
+    if (ctx->probed || (lc->api_conf.limit_input_pixels == 0 &&
+                        lc->admission == nullptr && !lc->stream_input)) {
+        return NGX_OK;
+    }
 
-    auto *mc = static_cast<ngx_weserv_main_conf_t *>(
-        ngx_http_cycle_get_module_main_conf(cycle, ngx_weserv_module));
-    if (mc == nullptr) {
-        // Handle the case where there is no http section at all
+    ngx_str_t head = ctx->image.head();
+
+    ngx_weserv_probe_t probe;
+    ngx_int_t rc = ngx_weserv_probe(head.data, head.len, &probe);
+
+    if (rc == NGX_AGAIN && !complete && head.len == ctx->image.size()) {
         return NGX_OK;
     }
 
-    api::ApiManagerFactory weserv_factory;
-    mc->weserv = weserv_factory.create_api_manager(
-        std::make_unique<NgxEnvironment>(cycle->log));
+    ctx->probed = 1;
 
-    return NGX_OK;
-}
+    if (rc != NGX_OK) {
+        return NGX_OK;
+    }
 
-ngx_int_t ngx_weserv_image_header_filter(ngx_http_request_t *r) {
-    if (r->headers_out.status == NGX_HTTP_NOT_MODIFIED) {
-        return ngx_http_next_header_filter(r);
+    ctx->dimensions = probe;
+
+    if (lc->api_conf.limit_input_pixels == 0 ||
+        probe.width * probe.height <= lc->api_conf.limit_input_pixels) {
+        return NGX_OK;
     }
 
-    if (r != r->main) {
-        return ngx_http_next_header_filter(r);
+    // Only the primary image or the first frame is sniffed, which might not
+    // be the page that's selected, e.g. within a HEIF image. libvips checks
+    // the limit on the selected pages after loading.
+    ngx_str_t value;
+    if (ngx_http_arg(r, (u_char *)"page", 4, &value) == NGX_OK ||
+        ngx_http_arg(r, (u_char *)"n", 1, &value) == NGX_OK ||
+        ngx_http_arg(r, (u_char *)"pages", 5, &value) == NGX_OK) {
+        return NGX_OK;
     }
 
-    auto *lc = static_cast<ngx_weserv_loc_conf_t *>(
-        ngx_http_get_module_loc_conf(r, ngx_weserv_module));
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "weserv image filter: too many pixels: %uLx%uL",
+                  probe.width, probe.height);
 
-    if (!lc->enable) {
-        return ngx_http_next_header_filter(r);
+    return NGX_DECLINED;
+}
+
+/**
+ * Marks the given input as consumed, without using it.
+ */
+void ngx_weserv_discard_chain(ngx_chain_t *in) {
+    for (ngx_chain_t *cl = in; cl; cl = cl->next) {
+        cl->buf->pos = cl->buf->last;
     }
+}
 
-    auto *ctx = static_cast<ngx_weserv_base_ctx_t *>(
-        ngx_http_get_module_ctx(r, ngx_weserv_module));
+#if NGX_THREADS
+/**
+ * Selects the thread pool to process the image in: the one of the first
+ * matching weserv_priority rule, otherwise the one of weserv_thread_pool.
+ * @return The thread pool, or nullptr if the image is processed on the event
+ *         loop.
+ */
+ngx_thread_pool_t *ngx_weserv_thread_pool_select(ngx_http_request_t *r,
+                                                 ngx_weserv_loc_conf_t *lc,
+                                                 ngx_weserv_base_ctx_t *ctx) {
+    if (lc->priorities == nullptr) {
+        return lc->thread_pool;
+    }
 
-    if (ctx == nullptr) {
-        // Context must always be available for proxy mode
-        if (lc->mode == NGX_WESERV_PROXY_MODE) {
-            return ngx_http_next_header_filter(r);
+    auto output = static_cast<ngx_uint_t>(get_output_arg(r));
+    ngx_int_t pages = get_int_arg(r, "n", "pages", 1);
+
+    // Only estimated if there's a rule that needs it
+    uint64_t cost = 0;
+    bool estimated = false;
+
+    auto *priority = static_cast<ngx_weserv_priority_t *>(lc->priorities->elts);
+
+    for (ngx_uint_t i = 0; i < lc->priorities->nelts; i++, priority++) {
+        if (priority->output != 0 && (priority->output & output) == 0) {
+            continue;
         }
 
-        // For filter mode; we allocate and register a weserv base module
-        // context on first use
-        ctx = register_pool_cleanup(r->pool,
-                                    new (r->pool) ngx_weserv_base_ctx_t());
+        if (priority->multipage && pages != -1 && pages <= 1) {
+            continue;
+        }
 
-        if (ctx == nullptr) {
-            return NGX_ERROR;
+        if ((priority->min_cost != 0 || priority->max_cost != 0) &&
+            !estimated) {
+            cost = ngx_weserv_admission_cost(r, lc->api_conf, ctx->dimensions,
+                                             ctx->image.size());
+            estimated = true;
         }
 
-        // Set the request's weserv module context
-        ngx_http_set_ctx(r, ctx, ngx_weserv_module);
+        if (cost < priority->min_cost ||
+            (priority->max_cost != 0 && cost > priority->max_cost)) {
+            continue;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "weserv priority: rule %ui, cost: %uL", i, cost);
+
+        return priority->thread_pool;
     }
 
-    off_t len = r->headers_out.content_length_n;
+    return lc->thread_pool;
+}
 
-    if (len == -1) {
-        ctx->length = lc->max_size;
-    } else {
-        ctx->length = static_cast<size_t>(len);
+/**
+ * Offloads the image processing to a thread pool.
+ */
+ngx_int_t ngx_weserv_job_start(ngx_http_request_t *r,
+                               ngx_weserv_base_ctx_t *ctx,
+                               ngx_weserv_upstream_ctx_t *upstream_ctx,
+                               ngx_thread_pool_t *tp, bool streaming) {
+    ngx_weserv_job_t *job =
+        ngx_weserv_job_create(r, ctx, upstream_ctx, true, streaming);
+    if (job == nullptr || ngx_weserv_job_post(job, tp) != NGX_OK) {
+        return NGX_ERROR;
     }
 
-    r->main_filter_need_in_memory = 1;
+    ctx->job = job;
 
-    ngx_http_clear_content_length(r);
-    ngx_http_clear_accept_ranges(r);
-    ngx_http_clear_last_modified(r);
-    ngx_http_clear_etag(r);
+    // Hold back the response until the job is complete
+    r->connection->buffered |= NGX_WESERV_IMAGE_BUFFERED;
 
     return NGX_OK;
 }
+#endif
 
-ngx_int_t ngx_weserv_image_filter_read(ngx_http_request_t *r,
-                                       ngx_weserv_base_ctx_t *ctx,
-                                       ngx_chain_t *in) {
-    if (ctx->image == nullptr) {
-        ctx->image = static_cast<u_char *>(ngx_palloc(r->pool, ctx->length));
-        if (ctx->image == nullptr) {
-            return NGX_ERROR;
-        }
-
-        ctx->last = ctx->image;
+/**
+ * Processes the entirely received image, as soon as the budget of
+ * weserv_admission admits it.
+ */
+ngx_int_t ngx_weserv_image_process(ngx_http_request_t *r,
+                                   ngx_weserv_loc_conf_t *lc,
+                                   ngx_weserv_base_ctx_t *ctx,
+                                   ngx_weserv_upstream_ctx_t *upstream_ctx) {
+    ngx_int_t rc = ngx_weserv_admit(r, lc, ctx, true);
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
     }
 
-    u_char *p = ctx->last;
+    if (rc == NGX_AGAIN) {
+        // Hold back the response until the image is admitted
+        r->connection->buffered |= NGX_WESERV_IMAGE_BUFFERED;
 
-    for (ngx_chain_t *cl = in; cl; cl = cl->next) {
-        ngx_buf_t *b = cl->buf;
-        size_t size = b->last - b->pos;
+        return NGX_OK;
+    }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "image buf: %uz", size);
+    if (rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "weserv image filter: over budget");
 
-        size_t rest = ctx->image + ctx->length - p;
+        ctx->finished = 1;
+        ctx->image.free();
+        r->connection->buffered &= ~NGX_WESERV_IMAGE_BUFFERED;
 
-        if (size > rest) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "weserv image filter: too big response");
+        // Let the waiting requests try for themselves
+        ngx_weserv_cache_unlock(ctx);
+
+        ngx_chain_t *out = ngx_weserv_overloaded_chain(r, lc, upstream_ctx);
+        if (out == NGX_CHAIN_ERROR) {
             return NGX_ERROR;
         }
 
-        p = ngx_cpymem(p, b->pos, size);
-        b->pos += size;
-
-        if (b->last_buf) {
-            ngx_free_chain(r->pool, cl);
-
-            ctx->last = p;
-            return NGX_OK;
-        }
+        return ngx_weserv_finish(r, out);
     }
 
-    ctx->last = p;
-    r->connection->buffered |= NGX_WESERV_IMAGE_BUFFERED;
-
-    return NGX_AGAIN;
-}
+#if NGX_THREADS
+    ngx_thread_pool_t *tp = ngx_weserv_thread_pool_select(r, lc, ctx);
+    if (tp != nullptr) {
+        return ngx_weserv_job_start(r, ctx, upstream_ctx, tp, false);
+    }
+#endif
 
-ngx_int_t ngx_weserv_finish(ngx_http_request_t *r, ngx_chain_t *out) {
-    ngx_int_t rc = ngx_http_next_header_filter(r);
+    r->connection->buffered &= ~NGX_WESERV_IMAGE_BUFFERED;
 
-    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+    ngx_weserv_job_t *job =
+        ngx_weserv_job_create(r, ctx, upstream_ctx, false, false);
+    if (job == nullptr) {
         return NGX_ERROR;
     }
 
-    return ngx_http_next_body_filter(r, out);
+    ngx_weserv_job_run(job);
+
+    ctx->finished = 1;
+
+    return ngx_weserv_job_output(r, ctx, upstream_ctx, job);
 }
 
-#if NGX_DEBUG
-ngx_int_t ngx_weserv_finish_debug_chain(ngx_http_request_t *r,
-                                        ngx_chain_t *out) {
-    off_t content_length = 0;
+/**
+ * The body filter, while serving an image from the cache.
+ */
+ngx_int_t ngx_weserv_cache_body_filter(ngx_http_request_t *r,
+                                       ngx_weserv_base_ctx_t *ctx,
+                                       ngx_chain_t *in) {
+    ngx_weserv_discard_chain(in);
 
-    for (ngx_chain_t *cl = out; cl; cl = cl->next) {
-        content_length += cl->buf->last - cl->buf->pos;
+    ngx_chain_t *out = ctx->cached;
+    if (out == nullptr) {
+        return ngx_http_next_body_filter(r, nullptr);
     }
 
-    r->headers_out.status = NGX_HTTP_OK;
-    r->headers_out.content_type_len = sizeof("text/plain") - 1;
-    ngx_str_set(&r->headers_out.content_type, "text/plain");
-    r->headers_out.content_type_lowcase = nullptr;
-    r->headers_out.content_length_n = content_length;
+    ctx->cached = nullptr;
+
+    if (is_base64_needed(r)) {
+        out = output_chain_to_base64(r, out);
+        if (out == NGX_CHAIN_ERROR) {
+            return NGX_ERROR;
+        }
+    }
 
     return ngx_weserv_finish(r, out);
 }
 
-ngx_int_t ngx_weserv_finish_debug_output(ngx_http_request_t *r,
-                                         ngx_weserv_base_ctx_t *ctx) {
-    size_t size = ctx->last - ctx->image;
+/**
+ * The body filter, while an image processing job is attached to the request.
+ */
+ngx_int_t ngx_weserv_job_body_filter(ngx_http_request_t *r,
+                                     ngx_weserv_loc_conf_t *lc,
+                                     ngx_weserv_base_ctx_t *ctx,
+                                     ngx_chain_t *in) {
+    ngx_weserv_job_t *job = ctx->job;
 
-    ngx_buf_t *buf = ngx_create_temp_buf(r->pool, size);
-    if (buf == nullptr) {
-        return NGX_ERROR;
+    ngx_weserv_upstream_ctx_t *upstream_ctx =
+        lc->mode == NGX_WESERV_PROXY_MODE
+            ? dynamic_cast<ngx_weserv_upstream_ctx_t *>(ctx)
+            : nullptr;
+
+    if (job->sent) {
+        ngx_weserv_discard_chain(in);
+
+        return ngx_http_next_body_filter(r, nullptr);
     }
 
-    buf->last_buf = 1;
-    buf->last_in_chain = 1;
-    buf->last = ngx_cpymem(buf->last, ctx->image, size);
+#if NGX_THREADS
+    // A streaming job may succeed before the trailing bytes of the image have
+    // arrived, in which case its output waits for them, so that it's sent
+    // with the ETag of the entire image
+    bool receiving = job->stream != nullptr && !job->stream->complete() &&
+                     (!job->done || job->status.ok());
 
-    ngx_chain_t *out = ngx_alloc_chain_link(r->pool);
-    if (out == nullptr) {
-        return NGX_ERROR;
+    if (receiving && in == nullptr && job->done) {
+        return ngx_http_next_body_filter(r, nullptr);
     }
 
-    out->buf = buf;
-    out->next = nullptr;
+    // Pass the arriving data to the streaming job
+    if (receiving && in != nullptr) {
+        ngx_int_t rc = ngx_weserv_image_filter_read(r, ctx, in);
 
-    return ngx_weserv_finish_debug_chain(r, out);
-}
+        if (rc == NGX_ERROR) {
+            // Let the job fail, the response is sent right away
+            job->stream->finish(true);
+            job->sent = 1;
+            ctx->finished = 1;
+            r->connection->buffered &= ~NGX_WESERV_IMAGE_BUFFERED;
+
+            ngx_chain_t *out = ngx_weserv_too_large_chain(r, lc, upstream_ctx);
+            if (out == NGX_CHAIN_ERROR) {
+                return NGX_ERROR;
+            }
+
+            return ngx_weserv_finish(r, out);
+        }
+
+        job->stream->append(ctx->image.size());
+
+        if (rc == NGX_AGAIN) {
+            return NGX_OK;
+        }
+
+        job->stream->finish(false);
+
+        if (upstream_ctx != nullptr) {
+            ngx_weserv_origin_cache_update(r, upstream_ctx);
+        }
+
+        // Too late to skip processing, but the response still gets an ETag
+        if (ngx_weserv_etag(r, lc, ctx) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (!job->done) {
+            return NGX_OK;
+        }
+    }
 #endif
 
-ngx_int_t ngx_weserv_image_body_filter(ngx_http_request_t *r, ngx_chain_t *in) {
-    if (in == nullptr) {
-        return ngx_http_next_body_filter(r, in);
+    if (job->done) {
+        ngx_weserv_discard_chain(in);
+
+        job->sent = 1;
+        r->connection->buffered &= ~NGX_WESERV_IMAGE_BUFFERED;
+
+        // A streaming job may fail before all input has been received, e.g.
+        // on an invalid image, in which case the upstream can be closed
+        ctx->finished = 1;
+
+        return ngx_weserv_job_output(r, ctx, upstream_ctx, job);
     }
 
+    // Wait for the offloaded image processing to complete
+    ngx_weserv_discard_chain(in);
+
+    return ngx_http_next_body_filter(r, nullptr);
+}
+
+ngx_int_t ngx_weserv_image_body_filter(ngx_http_request_t *r, ngx_chain_t *in) {
     if (r != r->main) {
         return ngx_http_next_body_filter(r, in);
     }
@@ -819,6 +2464,39 @@ ngx_int_t ngx_weserv_image_body_filter(ngx_http_request_t *r, ngx_chain_t *in) {
     auto *ctx = static_cast<ngx_weserv_base_ctx_t *>(
         ngx_http_get_module_ctx(r, ngx_weserv_module));
 
+    if (ctx != nullptr && ctx->finished) {
+        ngx_weserv_discard_chain(in);
+
+        return ngx_http_next_body_filter(r, nullptr);
+    }
+
+    if (ctx != nullptr && ctx->cache_hit) {
+        return ngx_weserv_cache_body_filter(r, ctx, in);
+    }
+
+    if (ctx != nullptr && ctx->job != nullptr) {
+        return ngx_weserv_job_body_filter(r, lc, ctx, in);
+    }
+
+    // The image is waiting for the budget of weserv_admission
+    if (ctx != nullptr && ctx->ticket != nullptr) {
+        ngx_weserv_discard_chain(in);
+
+        if (ctx->ticket->waiting) {
+            return ngx_http_next_body_filter(r, nullptr);
+        }
+
+        return ngx_weserv_image_process(
+            r, lc, ctx,
+            lc->mode == NGX_WESERV_PROXY_MODE
+                ? dynamic_cast<ngx_weserv_upstream_ctx_t *>(ctx)
+                : nullptr);
+    }
+
+    if (in == nullptr) {
+        return ngx_http_next_body_filter(r, in);
+    }
+
     // Context must always be available
     if (ctx == nullptr) {
         return ngx_weserv_finish(r, in);
@@ -861,18 +2539,25 @@ ngx_int_t ngx_weserv_image_body_filter(ngx_http_request_t *r, ngx_chain_t *in) {
     }
 
     ngx_int_t rc = ngx_weserv_image_filter_read(r, ctx, in);
-    if (rc == NGX_AGAIN) {
-        return NGX_OK;
+    if (rc == NGX_ERROR) {
+        ctx->finished = 1;
+
+        ngx_chain_t *out = ngx_weserv_too_large_chain(r, lc, upstream_ctx);
+        if (out == NGX_CHAIN_ERROR) {
+            return NGX_ERROR;
+        }
+
+        return ngx_weserv_finish(r, out);
     }
 
-    if (rc == NGX_ERROR) {
-        Status status = {Status::Code::ImageTooLarge,
-                         "The image is too large to be processed. "
-                         "Max image size: " +
-                             std::to_string(lc->max_size) + " bytes",
-                         Status::ErrorCause::Application};
+    // Reject images with too many pixels before the rest of them arrives
+    if (ngx_weserv_image_probe(r, lc, ctx, rc == NGX_OK) == NGX_DECLINED) {
+        ctx->finished = 1;
+        ctx->image.free();
+        r->connection->buffered &= ~NGX_WESERV_IMAGE_BUFFERED;
 
-        ngx_chain_t *out = ngx_weserv_error_chain(r, upstream_ctx, status);
+        ngx_chain_t *out =
+            ngx_weserv_too_many_pixels_chain(r, lc, upstream_ctx);
         if (out == NGX_CHAIN_ERROR) {
             return NGX_ERROR;
         }
@@ -880,44 +2565,70 @@ ngx_int_t ngx_weserv_image_body_filter(ngx_http_request_t *r, ngx_chain_t *in) {
         return ngx_weserv_finish(r, out);
     }
 
-    r->connection->buffered &= ~NGX_WESERV_IMAGE_BUFFERED;
+    if (rc == NGX_AGAIN) {
+#if NGX_THREADS
+        // Start processing while the rest of the image is still arriving, but
+        // only if the budget admits the image right away. Otherwise, it waits
+        // for the budget once it's entirely received.
+        // Streaming waits for the dimensions of the image, so that it's
+        // checked against weserv_limit_input_pixels and priced by them first.
+        // It's skipped for conditional requests, since an ETag can't be
+        // tested before the entire image has been received.
+        // A streaming job holds on to its thread while it waits for the
+        // input, so only a few may stream at once, to leave threads for the
+        // jobs of images that are entirely received.
+        auto *mc = static_cast<ngx_weserv_main_conf_t *>(
+            ngx_http_get_module_main_conf(r, ngx_weserv_module));
+
+        ngx_thread_pool_t *tp =
+            lc->stream_input && ctx->image.reserved() &&
+                    ctx->dimensions.width != 0 &&
+                    r->headers_in.if_none_match == nullptr &&
+                    mc->stream_jobs <
+                        static_cast<ngx_uint_t>(mc->stream_input_jobs)
+                ? ngx_weserv_thread_pool_select(r, lc, ctx)
+                : nullptr;
+        if (tp != nullptr
+#if NGX_DEBUG
+            && !debug_output
+#endif
+        ) {
+            rc = ngx_weserv_admit(r, lc, ctx, false);
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            if (rc == NGX_OK) {
+                return ngx_weserv_job_start(r, ctx, upstream_ctx, tp, true);
+            }
+        }
+#endif
+
+        return NGX_OK;
+    }
 
 #if NGX_DEBUG
     if (debug_output) {
+        r->connection->buffered &= ~NGX_WESERV_IMAGE_BUFFERED;
+
         return ngx_weserv_finish_debug_output(r, ctx);
     }
 #endif
 
-    auto *mc = static_cast<ngx_weserv_main_conf_t *>(
-        ngx_http_get_module_main_conf(r, ngx_weserv_module));
-
-    ngx_chain_t *out = nullptr;
-    Status status = mc->weserv->process(
-        ngx_str_to_std(r->args),
-        std::make_unique<NgxSource>(ctx->image, ctx->last - ctx->image),
-        std::make_unique<NgxTarget>(r, upstream_ctx, &out), lc->api_conf);
-
-    // Memory is released immediately after the image output is complete,
-    // without waiting for the entire response to be sent to the client
-    ngx_pfree(r->pool, ctx->image);
-
-    if (!status.ok()) {
-        out = ngx_weserv_error_chain(r, upstream_ctx, status);
-        if (out == NGX_CHAIN_ERROR) {
-            return NGX_ERROR;
-        }
+    if (upstream_ctx != nullptr) {
+        ngx_weserv_origin_cache_update(r, upstream_ctx);
+    }
 
-        return ngx_weserv_finish(r, out);
+    if (ngx_weserv_etag(r, lc, ctx) != NGX_OK) {
+        return NGX_ERROR;
     }
 
-    if (is_base64_needed(r)) {
-        out = output_chain_to_base64(r, out);
-        if (out == NGX_CHAIN_ERROR) {
-            return NGX_ERROR;
-        }
+    // The client already has the outcome of this transformation
+    if (test_if_none_match(r, ctx->etag)) {
+        return ngx_weserv_finish_not_modified(r, ctx);
     }
 
-    return ngx_weserv_finish(r, out);
+    return ngx_weserv_image_process(r, lc, ctx, upstream_ctx);
 }
 
 /*
@@ -945,6 +2656,15 @@ ngx_int_t ngx_weserv_preconfiguration(ngx_conf_t *cf) {
  * pipeline.
  */
 ngx_int_t ngx_weserv_postconfiguration(ngx_conf_t *cf) {
+    auto *mc = static_cast<ngx_weserv_main_conf_t *>(
+        ngx_http_conf_get_module_main_conf(cf, ngx_weserv_module));
+
+    ngx_str_t cache_status = ngx_string("weserv_cache_status");
+    mc->cache_status_index = ngx_http_get_variable_index(cf, &cache_status);
+    if (mc->cache_status_index == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
     ngx_http_next_header_filter = ngx_http_top_header_filter;
     ngx_http_top_header_filter = ngx_weserv_image_header_filter;
 
@@ -973,7 +2693,7 @@ ngx_module_t ngx_weserv_module = {
     // ngx_int_t (*init_module)(ngx_cycle_t *cycle);
     weserv::nginx::ngx_weserv_init_module,
     // ngx_int_t (*init_process)(ngx_cycle_t *cycle);
-    nullptr,
+    weserv::nginx::ngx_weserv_init_process,
     // ngx_int_t (*init_thread)(ngx_cycle_t *cycle);
     nullptr,
     // void (*exit_thread)(ngx_cycle_t *cycle);
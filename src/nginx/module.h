@@ -7,17 +7,39 @@ extern "C" {
 #include <weserv/api_manager.h>
 #include <weserv/config.h>
 
+#include "buffer.h"
 #include "http_request.h"
+#include "probe.h"
 
 #include <memory>
 
 #define NGX_WESERV_IMAGE_BUFFERED 0x08
 
+#define NGX_WESERV_CACHE_KEY_LEN 16
+
 #define NGX_WESERV_PROXY_MODE 0
 #define NGX_WESERV_FILTER_MODE 1
 
 namespace weserv::nginx {
 
+struct ngx_weserv_admission_t;
+struct ngx_weserv_admission_ticket_t;
+struct ngx_weserv_job_t;
+struct ngx_weserv_keepalive_t;
+
+/**
+ * A mask to rasterize when a worker process starts.
+ */
+struct ngx_weserv_mask_preload_t {
+    /**
+     * The query of the mask, e.g. `mask=circle`.
+     */
+    ngx_str_t query;
+
+    ngx_uint_t width;
+    ngx_uint_t height;
+};
+
 /**
  * weserv Module Configuration - main context.
  */
@@ -26,8 +48,136 @@ struct ngx_weserv_main_conf_t {
      * The module-level API Manager interface.
      */
     std::shared_ptr<api::ApiManager> weserv;
+
+    /**
+     * The upstream through which origins are requested. Origins are resolved
+     * by the module itself, so that the peer initialization can be hooked.
+     */
+    ngx_http_upstream_srv_conf_t origin_upstream;
+
+    /**
+     * The maximum size of the cache of rasterized masks, per worker process.
+     */
+    size_t mask_cache_size;
+
+    /**
+     * Array of ngx_weserv_mask_preload_t, the masks to rasterize when a worker
+     * process starts.
+     */
+    ngx_array_t *mask_preload;
+
+    /**
+     * The maximum number of multi-page TIFF images of which the page layout
+     * is cached, per worker process.
+     */
+    ngx_uint_t pyramid_cache_size;
+
+    /**
+     * The maximum number of smart crop windows that are cached, per worker
+     * process.
+     */
+    ngx_uint_t saliency_cache_size;
+
+    /**
+     * Set if any cache that is keyed by the identity of the image is enabled,
+     * i.e. the images need to be identified.
+     */
+    ngx_flag_t identify_images;
+
+    /**
+     * The index of the $weserv_cache_status variable, which is set when the
+     * cache is looked up.
+     */
+    ngx_int_t cache_status_index;
+
+    /**
+     * The maximum number of jobs that stream their input at once, per worker
+     * process.
+     */
+    ngx_int_t stream_input_jobs;
+
+    /**
+     * The number of jobs that are currently streaming their input in this
+     * worker process.
+     */
+    ngx_uint_t stream_jobs;
 };
 
+/**
+ * Configuration of a cache.
+ */
+struct ngx_weserv_cache_conf_t {
+    /**
+     * The shared memory zone to cache in, if any.
+     */
+    ngx_shm_zone_t *zone;
+
+    /**
+     * How long entries are cached.
+     */
+    time_t valid;
+};
+
+/**
+ * Configuration of the cache of resolved origin hosts.
+ */
+struct ngx_weserv_resolver_cache_conf_t {
+    /**
+     * The shared memory zone to cache in, if any.
+     */
+    ngx_shm_zone_t *zone;
+
+    /**
+     * The bounds of how long resolved addresses are cached, regardless of the
+     * TTL of their records.
+     */
+    time_t min_valid;
+    time_t max_valid;
+};
+
+/**
+ * Configuration of the sizing and quality by client hints.
+ */
+struct ngx_weserv_client_hints_conf_t {
+    /**
+     * Array of ngx_uint_t, the widths to round hinted widths up to, in
+     * ascending order. nullptr if client hints are disabled.
+     */
+    ngx_array_t *widths;
+
+    /**
+     * The quality used if the client asks to save data.
+     */
+    ngx_uint_t save_data_quality;
+};
+
+#if NGX_THREADS
+/**
+ * A weserv_priority rule, which routes the images that match all of its
+ * conditions to a thread pool.
+ */
+struct ngx_weserv_priority_t {
+    ngx_thread_pool_t *thread_pool;
+
+    /**
+     * Bitmask of the requested output formats to match, 0 if any.
+     */
+    ngx_uint_t output;
+
+    /**
+     * Match images of which more than one page is requested.
+     */
+    ngx_flag_t multipage;
+
+    /**
+     * The bounds of the estimated cost to match, in pixels. A maximum of 0
+     * means unbounded.
+     */
+    uint64_t min_cost;
+    uint64_t max_cost;
+};
+#endif
+
 /**
  * weserv Module Configuration - location context.
  */
@@ -58,6 +208,67 @@ struct ngx_weserv_loc_conf_t {
     ngx_uint_t max_redirects;
 
     ngx_flag_t canonical_header;
+
+    /**
+     * Negotiate the output format of images without an `&output=` query, as
+     * if `&output=auto` was given.
+     */
+    ngx_flag_t auto_output;
+
+    /**
+     * Size and compress images by client hints, if the query omits it.
+     */
+    ngx_weserv_client_hints_conf_t client_hints;
+
+    /**
+     * Start processing while the image is still arriving.
+     */
+    ngx_flag_t stream_input;
+
+    /**
+     * The cache of transformed images.
+     */
+    ngx_weserv_cache_conf_t cache;
+
+    /**
+     * Let concurrent requests for the same transformation wait for the first
+     * one, for at most cache_lock_timeout.
+     */
+    ngx_flag_t cache_lock;
+    ngx_msec_t cache_lock_timeout;
+
+    /**
+     * The cache of images received from the origin, for proxy mode only.
+     */
+    ngx_weserv_cache_conf_t origin_cache;
+
+    /**
+     * The pool of idle connections to origins, for proxy mode only.
+     */
+    ngx_weserv_keepalive_t *origin_keepalive;
+
+    /**
+     * The cache of resolved origin hosts, for proxy mode only.
+     */
+    ngx_weserv_resolver_cache_conf_t resolver_cache;
+
+#if NGX_THREADS
+    /**
+     * The thread pool to offload image processing to, if any.
+     */
+    ngx_thread_pool_t *thread_pool;
+
+    /**
+     * Array of ngx_weserv_priority_t, checked in order before falling back
+     * to thread_pool.
+     */
+    ngx_array_t *priorities;
+#endif
+
+    /**
+     * The budget for the estimated cost of processing images, if any.
+     */
+    ngx_weserv_admission_t *admission;
 };
 
 /**
@@ -72,9 +283,70 @@ struct ngx_weserv_base_ctx_t {
     /**
      * The incoming image.
      */
-    u_char *image;
-    u_char *last;
-    size_t length;
+    NgxInputBuffer image;
+
+    /**
+     * The pending image processing job, if offloaded to a thread pool.
+     */
+    ngx_weserv_job_t *job;
+
+    /**
+     * The claim on the budget of weserv_admission, if any.
+     */
+    ngx_weserv_admission_ticket_t *ticket;
+
+    /**
+     * The dimensions of the incoming image, if sniffed.
+     */
+    ngx_weserv_probe_t dimensions;
+
+    /**
+     * The key of the transformed image within the cache.
+     */
+    u_char cache_key[NGX_WESERV_CACHE_KEY_LEN];
+
+    /**
+     * The cache zone in which the cache key is locked, while the image is
+     * processed.
+     */
+    ngx_shm_zone_t *cache_lock;
+
+    /**
+     * Identifies our lock, see ngx_weserv_cache_lock.
+     */
+    ngx_uint_t cache_lock_owner;
+
+    /**
+     * The image served from the cache, until it's sent.
+     */
+    ngx_chain_t *cached;
+
+    /**
+     * The strong ETag of the transformed image, if calculated.
+     */
+    ngx_str_t etag;
+
+    /**
+     * Set if the cache key is calculated, i.e. if the outcome can be cached.
+     */
+    unsigned cacheable : 1;
+
+    /**
+     * Set if the response is served from the cache.
+     */
+    unsigned cache_hit : 1;
+
+    /**
+     * Set if the response is sent before the image is processed, e.g. a 304
+     * Not Modified. Any further input is discarded.
+     */
+    unsigned finished : 1;
+
+    /**
+     * Set once the dimensions of the incoming image are sniffed, or found to
+     * be unavailable.
+     */
+    unsigned probed : 1;
 };
 
 /**
@@ -104,9 +376,14 @@ struct ngx_weserv_upstream_ctx_t : ngx_weserv_base_ctx_t {
     std::unique_ptr<HTTPRequest> request;
 
     /**
-     * The original DNS resolver handler.
+     * The address(es) of the origin, once resolved.
+     */
+    ngx_http_upstream_resolved_t *resolved;
+
+    /**
+     * The pending DNS query for the origin host, if any.
      */
-    ngx_resolver_handler_pt original_resolver;
+    ngx_resolver_ctx_t *resolver;
 
     /**
      * Response information.
@@ -140,6 +417,37 @@ struct ngx_weserv_upstream_ctx_t : ngx_weserv_base_ctx_t {
      */
     api::utils::Status response_status;
 
+    /**
+     * The key of the image within the origin cache.
+     */
+    u_char origin_key[NGX_WESERV_CACHE_KEY_LEN];
+
+    /**
+     * The stale image from the origin cache, while revalidating it.
+     */
+    ngx_buf_t *origin_cached;
+
+    /**
+     * Parsed caching headers of the response.
+     */
+    ngx_str_t origin_etag;
+    ngx_str_t origin_last_modified;
+    time_t max_age;
+    time_t expires;
+    unsigned no_store : 1;
+    unsigned no_cache : 1;
+
+    /**
+     * Set if the origin cache key is calculated.
+     */
+    unsigned origin_cacheable : 1;
+
+    /**
+     * Set if the origin responded with a 304 to our conditional request, i.e.
+     * the stale image can be used.
+     */
+    unsigned not_modified : 1;
+
 #if NGX_DEBUG
     /**
      * Debug mode.
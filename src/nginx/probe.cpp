@@ -0,0 +1,426 @@
+#include "probe.h"
+
+namespace weserv::nginx {
+
+namespace {
+
+uint32_t read_be16(const u_char *p) {
+    return static_cast<uint32_t>(p[0]) << 8 | p[1];
+}
+
+uint32_t read_be32(const u_char *p) {
+    return static_cast<uint32_t>(p[0]) << 24 |
+           static_cast<uint32_t>(p[1]) << 16 |
+           static_cast<uint32_t>(p[2]) << 8 | p[3];
+}
+
+uint64_t read_be64(const u_char *p) {
+    return static_cast<uint64_t>(read_be32(p)) << 32 | read_be32(p + 4);
+}
+
+uint32_t read_le16(const u_char *p) {
+    return static_cast<uint32_t>(p[1]) << 8 | p[0];
+}
+
+uint32_t read_le24(const u_char *p) {
+    return static_cast<uint32_t>(p[2]) << 16 |
+           static_cast<uint32_t>(p[1]) << 8 | p[0];
+}
+
+constexpr uint32_t fourcc(const char (&type)[5]) {
+    return static_cast<uint32_t>(type[0]) << 24 |
+           static_cast<uint32_t>(type[1]) << 16 |
+           static_cast<uint32_t>(type[2]) << 8 | static_cast<uint32_t>(type[3]);
+}
+
+/**
+ * Reference: https://www.w3.org/TR/png/#11IHDR
+ */
+ngx_int_t probe_png(const u_char *data, size_t len, ngx_weserv_probe_t *probe) {
+    // The signature is followed by the length and type of the IHDR chunk
+    if (len < 24) {
+        return NGX_AGAIN;
+    }
+
+    if (ngx_memcmp(data + 12, "IHDR", 4) != 0) {
+        return NGX_DECLINED;
+    }
+
+    probe->width = read_be32(data + 16);
+    probe->height = read_be32(data + 20);
+
+    return NGX_OK;
+}
+
+/**
+ * Reference: https://www.w3.org/Graphics/GIF/spec-gif89a.txt
+ */
+ngx_int_t probe_gif(const u_char *data, size_t len, ngx_weserv_probe_t *probe) {
+    // The signature is followed by the logical screen descriptor
+    if (len < 10) {
+        return NGX_AGAIN;
+    }
+
+    probe->width = read_le16(data + 6);
+    probe->height = read_le16(data + 8);
+
+    return NGX_OK;
+}
+
+/**
+ * Reference: https://www.w3.org/Graphics/JPEG/itu-t81.pdf, B.1.1.3 and B.2.2
+ */
+ngx_int_t probe_jpeg(const u_char *data, size_t len,
+                     ngx_weserv_probe_t *probe) {
+    // Skip the SOI marker
+    size_t i = 2;
+
+    for (;;) {
+        if (i >= len) {
+            return NGX_AGAIN;
+        }
+
+        if (data[i] != 0xff) {
+            return NGX_DECLINED;
+        }
+
+        // Skip any fill bytes
+        while (i < len && data[i] == 0xff) {
+            i++;
+        }
+
+        if (i >= len) {
+            return NGX_AGAIN;
+        }
+
+        u_char marker = data[i++];
+
+        // Markers without a segment (TEM, RSTn and SOI)
+        if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd8)) {
+            continue;
+        }
+
+        // The image data starts before any frame header was found
+        if (marker == 0xd9 || marker == 0xda) {
+            return NGX_DECLINED;
+        }
+
+        if (len - i < 2) {
+            return NGX_AGAIN;
+        }
+
+        size_t length = read_be16(data + i);
+        if (length < 2) {
+            return NGX_DECLINED;
+        }
+
+        // SOFn, except for DHT, JPG and DAC
+        if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 &&
+            marker != 0xc8 && marker != 0xcc) {
+            // Length, sample precision, number of lines and samples per line
+            if (len - i < 7) {
+                return NGX_AGAIN;
+            }
+
+            probe->height = read_be16(data + i + 3);
+            probe->width = read_be16(data + i + 5);
+
+            return NGX_OK;
+        }
+
+        i += length;
+    }
+}
+
+/**
+ * Reference: https://developers.google.com/speed/webp/docs/riff_container
+ */
+ngx_int_t probe_webp(const u_char *data, size_t len,
+                     ngx_weserv_probe_t *probe) {
+    // The RIFF header is followed by the header of the first chunk
+    if (len < 20) {
+        return NGX_AGAIN;
+    }
+
+    const u_char *chunk = data + 12;
+    const u_char *payload = data + 20;
+
+    if (ngx_memcmp(chunk, "VP8X", 4) == 0) {
+        // Flags, reserved bits and the canvas width and height minus one
+        if (len < 30) {
+            return NGX_AGAIN;
+        }
+
+        probe->width = 1 + read_le24(payload + 4);
+        probe->height = 1 + read_le24(payload + 7);
+
+        return NGX_OK;
+    }
+
+    if (ngx_memcmp(chunk, "VP8 ", 4) == 0) {
+        // Frame tag, start code and the 14-bit width and height
+        if (len < 30) {
+            return NGX_AGAIN;
+        }
+
+        if (payload[3] != 0x9d || payload[4] != 0x01 || payload[5] != 0x2a) {
+            return NGX_DECLINED;
+        }
+
+        probe->width = read_le16(payload + 6) & 0x3fff;
+        probe->height = read_le16(payload + 8) & 0x3fff;
+
+        return NGX_OK;
+    }
+
+    if (ngx_memcmp(chunk, "VP8L", 4) == 0) {
+        // Signature and the 14-bit width and height minus one
+        if (len < 25) {
+            return NGX_AGAIN;
+        }
+
+        if (payload[0] != 0x2f) {
+            return NGX_DECLINED;
+        }
+
+        uint32_t bits = read_le16(payload + 1) | read_le16(payload + 3) << 16;
+
+        probe->width = 1 + (bits & 0x3fff);
+        probe->height = 1 + ((bits >> 14) & 0x3fff);
+
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+/**
+ * An ISO base media file format box.
+ */
+struct ngx_weserv_box_t {
+    uint32_t type;
+    const u_char *body;
+    const u_char *end;
+};
+
+/**
+ * Reads the box at the given position.
+ * @return NGX_OK, NGX_AGAIN if the box is incomplete or NGX_DECLINED if it's
+ *         invalid.
+ */
+ngx_int_t read_box(const u_char *p, const u_char *end, ngx_weserv_box_t *box) {
+    if (end - p < 8) {
+        return NGX_AGAIN;
+    }
+
+    uint64_t size = read_be32(p);
+    size_t header = 8;
+
+    if (size == 1) {
+        if (end - p < 16) {
+            return NGX_AGAIN;
+        }
+
+        size = read_be64(p + 8);
+        header = 16;
+    }
+
+    // A size of 0 extends the box to the end of the file, which isn't known
+    if (size < header) {
+        return NGX_DECLINED;
+    }
+
+    box->type = read_be32(p + 4);
+    box->body = p + header;
+
+    if (size > static_cast<uint64_t>(end - p)) {
+        box->end = nullptr;
+        return NGX_AGAIN;
+    }
+
+    box->end = p + size;
+
+    return NGX_OK;
+}
+
+/**
+ * Finds the ispe property associated with the primary item.
+ * Reference: ISO/IEC 23008-12, 9.3.1 and 9.3.2
+ */
+ngx_int_t probe_heif_properties(uint32_t primary, const ngx_weserv_box_t &ipco,
+                                const ngx_weserv_box_t &ipma,
+                                ngx_weserv_probe_t *probe) {
+    const u_char *p = ipma.body;
+
+    if (ipma.end - p < 8) {
+        return NGX_DECLINED;
+    }
+
+    u_char version = p[0];
+    bool large_index = (p[3] & 1) != 0;
+    uint32_t entries = read_be32(p + 4);
+
+    p += 8;
+
+    for (uint32_t i = 0; i < entries; i++) {
+        size_t id_size = version < 1 ? 2 : 4;
+        if (static_cast<size_t>(ipma.end - p) < id_size + 1) {
+            return NGX_DECLINED;
+        }
+
+        uint32_t id = version < 1 ? read_be16(p) : read_be32(p);
+        u_char associations = p[id_size];
+
+        p += id_size + 1;
+
+        size_t index_size = large_index ? 2 : 1;
+        if (static_cast<size_t>(ipma.end - p) < associations * index_size) {
+            return NGX_DECLINED;
+        }
+
+        if (id != primary) {
+            p += associations * index_size;
+            continue;
+        }
+
+        for (u_char j = 0; j < associations; j++, p += index_size) {
+            uint32_t index = large_index ? read_be16(p) & 0x7fff : p[0] & 0x7f;
+
+            // Property indices are 1-based, 0 means no property
+            const u_char *q = ipco.body;
+            ngx_weserv_box_t property{};
+
+            for (uint32_t k = 1; k <= index; k++, q = property.end) {
+                if (read_box(q, ipco.end, &property) != NGX_OK) {
+                    return NGX_DECLINED;
+                }
+            }
+
+            if (index == 0 || property.type != fourcc("ispe")) {
+                continue;
+            }
+
+            // Version, flags and the image width and height
+            if (property.end - property.body < 12) {
+                return NGX_DECLINED;
+            }
+
+            probe->width = read_be32(property.body + 4);
+            probe->height = read_be32(property.body + 8);
+
+            return NGX_OK;
+        }
+
+        return NGX_DECLINED;
+    }
+
+    return NGX_DECLINED;
+}
+
+/**
+ * Reference: ISO/IEC 23008-12 and ISO/IEC 14496-12
+ */
+ngx_int_t probe_heif(const u_char *data, size_t len,
+                     ngx_weserv_probe_t *probe) {
+    const u_char *end = data + len;
+    ngx_weserv_box_t box{};
+
+    // Find the meta box, which usually follows the ftyp box
+    for (const u_char *p = data;; p = box.end) {
+        ngx_int_t rc = read_box(p, end, &box);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        if (box.type == fourcc("meta")) {
+            break;
+        }
+    }
+
+    bool has_primary = false;
+    uint32_t primary = 0;
+    ngx_weserv_box_t ipco{};
+    ngx_weserv_box_t ipma{};
+
+    // Skip the version and flags
+    const u_char *meta_end = box.end;
+
+    for (const u_char *p = box.body + 4; p < meta_end; p = box.end) {
+        if (read_box(p, meta_end, &box) != NGX_OK) {
+            return NGX_DECLINED;
+        }
+
+        if (box.type == fourcc("pitm")) {
+            // Version, flags and the item ID
+            if (box.end - box.body < 6) {
+                return NGX_DECLINED;
+            }
+
+            if (box.body[0] == 0) {
+                primary = read_be16(box.body + 4);
+            } else if (box.end - box.body >= 8) {
+                primary = read_be32(box.body + 4);
+            } else {
+                return NGX_DECLINED;
+            }
+
+            has_primary = true;
+        } else if (box.type == fourcc("iprp")) {
+            ngx_weserv_box_t child{};
+
+            for (const u_char *q = box.body; q < box.end; q = child.end) {
+                if (read_box(q, box.end, &child) != NGX_OK) {
+                    return NGX_DECLINED;
+                }
+
+                if (child.type == fourcc("ipco")) {
+                    ipco = child;
+                } else if (child.type == fourcc("ipma")) {
+                    ipma = child;
+                }
+            }
+        }
+    }
+
+    if (!has_primary || ipco.body == nullptr || ipma.body == nullptr) {
+        return NGX_DECLINED;
+    }
+
+    return probe_heif_properties(primary, ipco, ipma, probe);
+}
+
+}  // namespace
+
+ngx_int_t ngx_weserv_probe(const u_char *data, size_t len,
+                           ngx_weserv_probe_t *probe) {
+    // Enough to recognize any of the formats below
+    if (len < 12) {
+        return NGX_AGAIN;
+    }
+
+    if (data[0] == 0xff && data[1] == 0xd8 && data[2] == 0xff) {
+        return probe_jpeg(data, len, probe);
+    }
+
+    if (ngx_memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0) {
+        return probe_png(data, len, probe);
+    }
+
+    if (ngx_memcmp(data, "GIF87a", 6) == 0 ||
+        ngx_memcmp(data, "GIF89a", 6) == 0) {
+        return probe_gif(data, len, probe);
+    }
+
+    if (ngx_memcmp(data, "RIFF", 4) == 0 &&
+        ngx_memcmp(data + 8, "WEBP", 4) == 0) {
+        return probe_webp(data, len, probe);
+    }
+
+    if (ngx_memcmp(data + 4, "ftyp", 4) == 0) {
+        return probe_heif(data, len, probe);
+    }
+
+    return NGX_DECLINED;
+}
+
+}  // namespace weserv::nginx
@@ -0,0 +1,33 @@
+#pragma once
+
+extern "C" {
+#include <ngx_core.h>
+}
+
+#include <cstdint>
+
+namespace weserv::nginx {
+
+/**
+ * The dimensions of an image, sniffed from its first bytes.
+ */
+struct ngx_weserv_probe_t {
+    uint64_t width;
+    uint64_t height;
+};
+
+/**
+ * Sniffs the dimensions of a JPEG (SOF), PNG (IHDR), GIF (logical screen
+ * descriptor), WebP (VP8X, VP8 or VP8L) or HEIF/AVIF (ispe of the primary
+ * item) image from its first bytes, without decoding it.
+ * @param data The first bytes of the image.
+ * @param len The number of bytes available.
+ * @param probe Output dimensions.
+ * @return NGX_OK if the dimensions are found, NGX_AGAIN if more bytes are
+ *         needed or NGX_DECLINED if the format isn't recognized or the
+ *         dimensions can't be determined.
+ */
+ngx_int_t ngx_weserv_probe(const u_char *data, size_t len,
+                           ngx_weserv_probe_t *probe);
+
+}  // namespace weserv::nginx
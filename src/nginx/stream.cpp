@@ -11,10 +11,41 @@ ngx_str_t application_json = ngx_string("application/json");
 // See: https://github.com/weserv/images/issues/186
 constexpr time_t MAX_AGE_DEFAULT = 60 * 60 * 24 * 365;
 
+// The bounds of the output slab size.
+constexpr size_t NGX_WESERV_OUTPUT_SLAB_SIZE_MIN = 4 * 1024;
+constexpr size_t NGX_WESERV_OUTPUT_SLAB_SIZE_MAX = 512 * 1024;
+
+namespace {
+
+/**
+ * Estimate the size of the output image, based on the size of the input scaled
+ * by the ratio of output to input pixels, e.g. a thumbnail is much smaller
+ * than its input. Lossy encoders usually produce considerably smaller images
+ * than the input, while lossless encoders tend to produce images of about the
+ * same size per pixel.
+ */
+size_t estimate_output_size(const std::string &extension, size_t input_size,
+                            double scale) {
+    auto size = static_cast<size_t>(static_cast<double>(input_size) * scale);
+
+    if (extension == ".jpg" || extension == ".webp" || extension == ".avif") {
+        size /= 4;
+    } else if (extension != ".png" && extension != ".gif" &&
+               extension != ".tiff") {
+        // JSON output
+        size = NGX_WESERV_OUTPUT_SLAB_SIZE_MIN;
+    }
+
+    return ngx_min(ngx_max(size, NGX_WESERV_OUTPUT_SLAB_SIZE_MIN),
+                   NGX_WESERV_OUTPUT_SLAB_SIZE_MAX);
+}
+
+}  // namespace
+
 int64_t NgxSource::read(void *data, size_t length) {
     int64_t bytes_read =
         ngx_min(static_cast<int64_t>(length), length_ - read_position_);
-    ngx_memcpy(data, data_ + read_position_, bytes_read);
+    image_->copy(read_position_, data, bytes_read);
     read_position_ += bytes_read;
     return bytes_read;
 }
@@ -43,154 +74,246 @@ int64_t NgxSource::seek(int64_t offset, int whence) {
     return new_pos;
 }
 
+#if NGX_THREADS
+int64_t NgxStreamingSource::read(void *data, size_t length) {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    cond_.wait(lock,
+               [this] { return complete_ || length_ > read_position_; });
+
+    if (aborted_) {
+        return -1;
+    }
+
+    int64_t available = length_;
+
+    lock.unlock();
+
+    // The data before the received length is never modified, so there's no
+    // need to hold the lock while copying
+    int64_t bytes_read =
+        ngx_min(static_cast<int64_t>(length), available - read_position_);
+    image_->copy(read_position_, data, bytes_read);
+    read_position_ += bytes_read;
+    return bytes_read;
+}
+
+int64_t NgxStreamingSource::seek(int64_t offset, int whence) {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    int64_t new_pos = 0;
+
+    switch (whence) {
+        case SEEK_SET:
+            new_pos = offset;
+            break;
+        case SEEK_CUR:
+            new_pos = read_position_ + offset;
+            break;
+        case SEEK_END:
+            // The length is only known once all input has been received
+            cond_.wait(lock, [this] { return complete_; });
+            new_pos = length_ + offset;
+            break;
+    }
+
+    cond_.wait(lock, [this, new_pos] {
+        return complete_ || length_ >= new_pos;
+    });
+
+    // Don't allow out of range seeks
+    if (aborted_ || new_pos < 0 || new_pos > length_) {
+        return -1;
+    }
+
+    read_position_ = new_pos;
+    return new_pos;
+}
+
+void NgxStreamingSource::append(int64_t length) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        length_ = length;
+    }
+
+    cond_.notify_all();
+}
+
+void NgxStreamingSource::finish(bool aborted) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        complete_ = true;
+        aborted_ = aborted_ || aborted;
+    }
+
+    cond_.notify_all();
+}
+#endif
+
 void NgxTarget::setup(const std::string &extension) {
     extension_ = extension;
+    slab_size_ = estimate_output_size(extension, input_size_, scale_);
 }
 
-int64_t NgxTarget::write(const void *data, size_t length) {
-    int64_t padding = 0;
+ngx_int_t NgxTarget::copy(int64_t offset, const void *data, size_t length) {
+    if (slab_size_ == 0) {
+        slab_size_ = NGX_WESERV_OUTPUT_SLAB_SIZE_MIN;
+    }
 
-    if (write_position_ != content_length_) {
-        int64_t bytes_written = 0;
+    auto *p = static_cast<const u_char *>(data);
 
-        for (/* void */; seek_cl_; seek_cl_ = seek_cl_->next) {
-            ngx_buf_t *b = seek_cl_->buf;
-            size_t size =
-                ngx_min(static_cast<size_t>(b->last - b->pos), length);
-            ngx_memcpy(b->pos, data, size);
-            bytes_written += size;
-            length -= size;
+    while (length > 0) {
+        size_t index = static_cast<size_t>(offset) / slab_size_;
+        size_t slab_offset = static_cast<size_t>(offset) % slab_size_;
 
-            if (length == 0) {
-                write_position_ += bytes_written;
+        while (index >= slabs_.size()) {
+            ngx_chain_t *cl = ngx_alloc_chain_link(pool_);
+            if (cl == nullptr) {
+                return NGX_ERROR;
+            }
 
-                return bytes_written;
+            cl->buf = ngx_create_temp_buf(pool_, slab_size_);
+            if (cl->buf == nullptr) {
+                return NGX_ERROR;
             }
+
+            cl->next = nullptr;
+
+            if (!slabs_.empty()) {
+                slabs_.back()->next = cl;
+            }
+
+            slabs_.push_back(cl);
         }
 
-        write_position_ += bytes_written;
-        padding = write_position_ - content_length_;
-    }
+        ngx_buf_t *b = slabs_[index]->buf;
+        size_t n = ngx_min(length, slab_size_ - slab_offset);
 
-    ngx_buf_t *b = ngx_create_temp_buf(r_->pool, length + padding);
-    if (b == nullptr) {
-        return -1;
-    }
+        if (p != nullptr) {
+            ngx_memcpy(b->start + slab_offset, p, n);
+            p += n;
+        } else {
+            ngx_memzero(b->start + slab_offset, n);
+        }
 
-    if (padding > 0) {
-        ngx_memzero(b->last, padding);
-        b->last += padding;
+        b->last = ngx_max(b->last, b->start + slab_offset + n);
+
+        offset += n;
+        length -= n;
     }
 
-    b->last = ngx_cpymem(b->last, data, length);
-    b->last_buf = 1;
+    return NGX_OK;
+}
 
-    ngx_chain_t *cl = ngx_alloc_chain_link(r_->pool);
-    if (cl == nullptr) {
+int64_t NgxTarget::write(const void *data, size_t length) {
+    // Pad with zeros if we've seeked beyond the end
+    if (position_ > content_length_ &&
+        copy(content_length_, nullptr, position_ - content_length_) !=
+            NGX_OK) {
         return -1;
     }
 
-    cl->buf = b;
-    cl->next = nullptr;
-
-    *ll_ = cl;
-    ll_ = &cl->next;
+    if (copy(position_, data, length) != NGX_OK) {
+        return -1;
+    }
 
-    content_length_ += length + padding;
-    write_position_ += length;
+    position_ += length;
+    content_length_ = ngx_max(content_length_, position_);
 
     return length;
 }
 
 int64_t NgxTarget::read(void *data, size_t length) {
-    int64_t bytes_read = 0;
+    if (position_ >= content_length_) {
+        return 0;
+    }
 
-    for (/* void */; seek_cl_; seek_cl_ = seek_cl_->next) {
-        ngx_buf_t *b = seek_cl_->buf;
-        size_t size = ngx_min(static_cast<size_t>(b->last - b->pos), length);
+    auto *p = static_cast<u_char *>(data);
+    int64_t bytes_read =
+        ngx_min(static_cast<int64_t>(length), content_length_ - position_);
 
-        data = ngx_cpymem(data, b->pos, size);
-        b->pos += size;
-        bytes_read += size;
-        length -= size;
+    for (int64_t rest = bytes_read; rest > 0; /* void */) {
+        size_t slab_offset = static_cast<size_t>(position_) % slab_size_;
+        size_t n = ngx_min(static_cast<size_t>(rest), slab_size_ - slab_offset);
 
-        if (length == 0) {
-            break;
-        }
+        ngx_buf_t *b = slabs_[static_cast<size_t>(position_) / slab_size_]->buf;
+
+        p = ngx_cpymem(p, b->start + slab_offset, n);
+
+        position_ += n;
+        rest -= n;
     }
 
-    write_position_ += bytes_read;
     return bytes_read;
 }
 
 int64_t NgxTarget::seek(int64_t offset, int whence) {
+    int64_t new_pos = 0;
+
     switch (whence) {
         case SEEK_SET:
-            seek_cl_ = *first_ll_;
-            write_position_ = offset;
+            new_pos = offset;
             break;
         case SEEK_CUR:
-            write_position_ += offset;
+            new_pos = position_ + offset;
             break;
         case SEEK_END:
-            seek_cl_ = nullptr;
-            write_position_ = content_length_ + offset;
+            new_pos = content_length_ + offset;
             break;
     }
 
-    int64_t remainder = 0;
-
-    for (/* void */; seek_cl_; seek_cl_ = seek_cl_->next) {
-        ngx_buf_t *b = seek_cl_->buf;
-        int64_t size = b->end - b->start;
-        int64_t to_seek = ngx_min(size, offset);
-        offset -= to_seek;
+    if (new_pos < 0) {
+        return -1;
+    }
 
-        if (to_seek == size) {
-            continue;
-        }
+    position_ = new_pos;
+    return new_pos;
+}
 
-        if (offset == 0) {
-            remainder = to_seek;
-            break;
-        }
+int NgxTarget::end() {
+    if (!slabs_.empty()) {
+        slabs_.back()->buf->last_buf = 1;
+        *out_ = slabs_.front();
     }
 
-    // Mark subsequent buffers as unconsumed
-    for (ngx_chain_t *cl = seek_cl_; cl; cl = cl->next) {
-        cl->buf->pos = cl->buf->start + remainder;
-        remainder = 0;
+    return 0;
+}
+
+ngx_int_t NgxTarget::set_headers() {
+    // Only set the Link header if there's an upstream context available
+    ngx_str_t canonical = ngx_null_string;
+    if (upstream_ctx_ != nullptr) {
+        canonical = upstream_ctx_->canonical;
     }
 
-    return write_position_;
+    return set_image_headers(r_, extension_, content_length_, canonical);
 }
 
-int NgxTarget::end() {
-    ngx_str_t mime_type = extension_to_mime_type(extension_);
+ngx_int_t set_image_headers(ngx_http_request_t *r, const std::string &extension,
+                            off_t content_length, const ngx_str_t &canonical) {
+    ngx_str_t mime_type = extension_to_mime_type(extension);
 
-    r_->headers_out.status = NGX_HTTP_OK;
-    r_->headers_out.content_type = mime_type;
-    r_->headers_out.content_type_len = mime_type.len;
-    r_->headers_out.content_type_lowcase = nullptr;
-    r_->headers_out.content_length_n = content_length_;
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_type = mime_type;
+    r->headers_out.content_type_len = mime_type.len;
+    r->headers_out.content_type_lowcase = nullptr;
+    r->headers_out.content_length_n = content_length;
 
     // Only set the Content-Disposition header on images
-    if (!is_base64_needed(r_) &&
+    if (!is_base64_needed(r) &&
         !ngx_string_equal(mime_type, application_json) &&
-        set_content_disposition_header(r_, extension_) != NGX_OK) {
-        return -1;
+        set_content_disposition_header(r, extension) != NGX_OK) {
+        return NGX_ERROR;
     }
 
-    // Only set the Link header if there's an upstream context available
-    if (upstream_ctx_ != nullptr &&
-        set_link_header(r_, upstream_ctx_->canonical) != NGX_OK) {
-        return -1;
+    if (set_link_header(r, canonical) != NGX_OK) {
+        return NGX_ERROR;
     }
 
     time_t max_age = MAX_AGE_DEFAULT;
 
     ngx_str_t max_age_str;
-    if (ngx_http_arg(r_, (u_char *)"maxage", 6, &max_age_str) == NGX_OK) {
+    if (ngx_http_arg(r, (u_char *)"maxage", 6, &max_age_str) == NGX_OK) {
         max_age = parse_max_age(max_age_str);
         if (max_age == static_cast<time_t>(NGX_ERROR)) {
             max_age = MAX_AGE_DEFAULT;
@@ -198,18 +321,7 @@ int NgxTarget::end() {
     }
 
     // Only set Cache-Control and Expires headers on non-error responses
-    if (set_expires_header(r_, max_age) != NGX_OK) {
-        return -1;
-    }
-
-    // Mark all output buffers as unconsumed
-    for (ngx_chain_t *cl = *first_ll_; cl; cl = cl->next) {
-        cl->buf->pos = cl->buf->start;
-    }
-
-    *ll_ = nullptr;
-
-    return 0;
+    return set_expires_header(r, max_age);
 }
 
 }  // namespace weserv::nginx
@@ -9,6 +9,15 @@ extern "C" {
 #include <weserv/io/source_interface.h>
 #include <weserv/io/target_interface.h>
 
+#include <string>
+#include <utility>
+#include <vector>
+
+#if NGX_THREADS
+#include <condition_variable>
+#include <mutex>
+#endif
+
 namespace weserv::nginx {
 
 /**
@@ -16,7 +25,9 @@ namespace weserv::nginx {
  */
 class NgxSource : public api::io::SourceInterface {
  public:
-    NgxSource(u_char *data, int64_t length) : data_(data), length_(length) {}
+    explicit NgxSource(const NgxInputBuffer *image, std::string identity = "")
+        : image_(image), identity_(std::move(identity)),
+          length_(image->size()) {}
 
     ~NgxSource() override = default;
 
@@ -24,8 +35,13 @@ class NgxSource : public api::io::SourceInterface {
 
     int64_t seek(int64_t offset, int whence) override;
 
+    std::string identity() const override {
+        return identity_;
+    }
+
  private:
-    u_char *data_;
+    const NgxInputBuffer *image_;
+    std::string identity_;
     int64_t length_;
 
     /* The current read point.
@@ -33,15 +49,96 @@ class NgxSource : public api::io::SourceInterface {
     int64_t read_position_ = 0;
 };
 
+#if NGX_THREADS
 /**
- * The NGINX implementation of io::TargetInterface.
+ * The NGINX implementation of io::SourceInterface for an image that's still
+ * arriving. The event loop appends the received data, while an image
+ * processing thread reads it. Reads and seeks beyond the received data block
+ * until more data has arrived or the input is complete.
+ */
+class NgxStreamingSource : public api::io::SourceInterface {
+ public:
+    explicit NgxStreamingSource(const NgxInputBuffer *image,
+                                std::string identity = "")
+        : image_(image), identity_(std::move(identity)),
+          length_(image->size()) {}
+
+    ~NgxStreamingSource() override = default;
+
+    int64_t read(void *data, size_t length) override;
+
+    int64_t seek(int64_t offset, int whence) override;
+
+    std::string identity() const override {
+        return identity_;
+    }
+
+    /**
+     * Make the data received so far available to the reading thread.
+     * Must be called from the event loop.
+     * @param length The total number of bytes received.
+     */
+    void append(int64_t length);
+
+    /**
+     * Signal that no more data will arrive. Must be called from the event
+     * loop.
+     * @param aborted Whether the input is incomplete, in which case subsequent
+     *                reads and seeks will fail.
+     */
+    void finish(bool aborted);
+
+    /**
+     * Indicates if all input has been received. Must be called from the event
+     * loop.
+     */
+    bool complete() const {
+        return complete_;
+    }
+
+ private:
+    const NgxInputBuffer *image_;
+    std::string identity_;
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+
+    /* The number of bytes received so far, protected by the mutex.
+     */
+    int64_t length_;
+    bool complete_ = false;
+    bool aborted_ = false;
+
+    /* The current read point.
+     */
+    int64_t read_position_ = 0;
+};
+#endif
+
+/**
+ * The NGINX implementation of io::TargetInterface. The image is written into
+ * equally sized slabs, which are sized from an estimate of the output size and
+ * directly used as output buffers. Since all slabs have the same size, seeking
+ * and overwriting (as done by libtiff) doesn't need to walk the chain.
  */
 class NgxTarget : public api::io::TargetInterface {
  public:
+    /**
+     * Constructor.
+     * @param r The request.
+     * @param upstream_ctx The upstream context, if any.
+     * @param pool The pool to allocate the output buffers from.
+     * @param input_size The size of the input image, used to estimate the
+     *                   size of the output.
+     * @param scale The estimated ratio of the number of output pixels to the
+     *              number of input pixels.
+     * @param out Set to the output chain once the image is written.
+     */
     NgxTarget(ngx_http_request_t *r, ngx_weserv_upstream_ctx_t *upstream_ctx,
+              ngx_pool_t *pool, size_t input_size, double scale,
               ngx_chain_t **out)
-        : r_(r), upstream_ctx_(upstream_ctx), ll_(out), first_ll_(out),
-          seek_cl_(*out) {}
+        : r_(r), upstream_ctx_(upstream_ctx), pool_(pool),
+          input_size_(input_size), scale_(scale), out_(out) {}
 
     ~NgxTarget() override = default;
 
@@ -55,20 +152,72 @@ class NgxTarget : public api::io::TargetInterface {
 
     int end() override;
 
+    /**
+     * Set the response headers for the written image. Must be called from
+     * the event loop, as it allocates from the request pool.
+     */
+    ngx_int_t set_headers();
+
+    /**
+     * The extension of the written image.
+     */
+    const std::string &extension() const {
+        return extension_;
+    }
+
+    /**
+     * The length of the written image.
+     */
+    off_t content_length() const {
+        return content_length_;
+    }
+
  private:
+    /**
+     * Copy data into the slabs, allocating them as needed.
+     * @param offset Offset to start copying to.
+     * @param data Input buffer, or nullptr to fill with zeros.
+     * @param length Number of bytes to copy.
+     * @return NGX_OK on success or NGX_ERROR if the allocation failed.
+     */
+    ngx_int_t copy(int64_t offset, const void *data, size_t length);
+
     ngx_http_request_t *r_;
     ngx_weserv_upstream_ctx_t *upstream_ctx_;
-    ngx_chain_t **ll_;
-    ngx_chain_t **first_ll_;
 
-    ngx_chain_t *seek_cl_;
+    /**
+     * The pool to allocate the output buffers from.
+     */
+    ngx_pool_t *pool_;
+
+    size_t input_size_;
+    double scale_;
+
+    ngx_chain_t **out_;
+
+    /**
+     * The output chain, indexed by slab.
+     */
+    std::vector<ngx_chain_t *> slabs_;
+    size_t slab_size_ = 0;
 
     std::string extension_;
     off_t content_length_ = 0;
 
-    /* The current write point.
+    /* The current read/write point.
      */
-    int64_t write_position_ = 0;
+    int64_t position_ = 0;
 };
 
+/**
+ * Set the response headers for an image with the given extension, e.g. the
+ * output of a job or an image served from the cache.
+ * @param r The request.
+ * @param extension The extension of the image.
+ * @param content_length The length of the image.
+ * @param canonical The canonical URL of the image, or an empty string.
+ */
+ngx_int_t set_image_headers(ngx_http_request_t *r, const std::string &extension,
+                            off_t content_length, const ngx_str_t &canonical);
+
 }  // namespace weserv::nginx
@@ -1,5 +1,7 @@
 #include "util.h"
 
+using weserv::api::enums::Output;
+
 namespace weserv::nginx {
 
 std::string ngx_str_to_std(const ngx_str_t &src) {
@@ -25,6 +27,53 @@ bool is_base64_needed(ngx_http_request_t *r) {
            ngx_strncasecmp(encoding.data, (u_char *)"base64", 6) == 0;
 }
 
+Output get_output_arg(ngx_http_request_t *r) {
+    ngx_str_t output;
+    if (ngx_http_arg(r, (u_char *)"output", 6, &output) != NGX_OK) {
+        return Output::Origin;
+    }
+
+    // Keep in sync with parse<enums::Output> in src/api/parsers/enumeration.h
+    static const struct {
+        ngx_str_t name;
+        Output output;
+    } outputs[] = {
+        {ngx_string("jpeg"), Output::Jpeg}, {ngx_string("jpg"), Output::Jpeg},
+        {ngx_string("png"), Output::Png},   {ngx_string("gif"), Output::Gif},
+        {ngx_string("tiff"), Output::Tiff}, {ngx_string("tif"), Output::Tiff},
+        {ngx_string("webp"), Output::Webp}, {ngx_string("avif"), Output::Avif},
+        {ngx_string("av1"), Output::Avif},  {ngx_string("json"), Output::Json},
+    };
+
+    for (const auto &o : outputs) {
+        if (ngx_string_equal(output, o.name)) {
+            return o.output;
+        }
+    }
+
+    return Output::Origin;
+}
+
+ngx_int_t get_int_arg(ngx_http_request_t *r, const char *name,
+                      const char *synonym, ngx_int_t def) {
+    ngx_str_t value;
+    if (ngx_http_arg(r, (u_char *)name, ngx_strlen(name), &value) != NGX_OK &&
+        ngx_http_arg(r, (u_char *)synonym, ngx_strlen(synonym), &value) !=
+            NGX_OK) {
+        return def;
+    }
+
+    bool negative = value.len > 0 && value.data[0] == '-';
+
+    ngx_int_t n = negative ? ngx_atoi(value.data + 1, value.len - 1)
+                           : ngx_atoi(value.data, value.len);
+    if (n == NGX_ERROR) {
+        return def;
+    }
+
+    return negative ? -n : n;
+}
+
 ngx_chain_t *output_chain_to_base64(ngx_http_request_t *r, ngx_chain_t *in) {
     size_t prefix_size = sizeof("data:") - 1;
     size_t suffix_size = sizeof(";base64,") - 1;
@@ -4,6 +4,8 @@ extern "C" {
 #include <ngx_http.h>
 }
 
+#include <weserv/enums.h>
+
 #include <ctime>
 #include <string>
 
@@ -25,6 +27,19 @@ bool has_valid_scheme(const ngx_str_t &url);
  */
 bool is_base64_needed(ngx_http_request_t *r);
 
+/**
+ * Get the output format given within the &output= query, Output::Origin if
+ * none or unknown.
+ */
+api::enums::Output get_output_arg(ngx_http_request_t *r);
+
+/**
+ * Get an integer query parameter, or its synonym.
+ * @return The value, or def if it's absent or not an integer.
+ */
+ngx_int_t get_int_arg(ngx_http_request_t *r, const char *name,
+                      const char *synonym, ngx_int_t def);
+
 /**
  * Converts an entire output chain to base64.
  */
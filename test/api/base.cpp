@@ -4,6 +4,13 @@
 
 #include "test_environment.h"
 
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+
 std::shared_ptr<Fixtures> fixtures;
 std::shared_ptr<weserv::api::ApiManager> api_manager;
 
@@ -121,6 +128,103 @@ Status process_file(const std::string &file, std::string *out_buf,
     return api_manager->process_file(query, file, out_buf, config);
 }
 
+namespace {
+
+/**
+ * An in-memory source that claims the given identity.
+ */
+class IdentifiedSource : public SourceInterface {
+ public:
+    IdentifiedSource(const std::string &file, std::string identity)
+        : identity_(std::move(identity)) {
+        std::ifstream stream(file, std::ios::binary);
+        buffer_.assign(std::istreambuf_iterator<char>(stream),
+                       std::istreambuf_iterator<char>());
+    }
+
+    int64_t read(void *data, size_t length) override {
+        auto size = static_cast<int64_t>(buffer_.size());
+        auto available =
+            std::min(static_cast<int64_t>(length), size - read_pos_);
+
+        buffer_.copy(static_cast<char *>(data), available, read_pos_);
+        read_pos_ += available;
+        return available;
+    }
+
+    int64_t seek(int64_t offset, int whence) override {
+        auto size = static_cast<int64_t>(buffer_.size());
+        int64_t new_pos = offset;
+
+        if (whence == SEEK_CUR) {
+            new_pos += read_pos_;
+        } else if (whence == SEEK_END) {
+            new_pos += size;
+        }
+
+        if (new_pos < 0 || new_pos > size) {
+            return -1;
+        }
+
+        read_pos_ = new_pos;
+        return new_pos;
+    }
+
+    std::string identity() const override {
+        return identity_;
+    }
+
+ private:
+    std::string buffer_;
+    std::string identity_;
+    int64_t read_pos_{0};
+};
+
+/**
+ * A target that appends to a string.
+ */
+class StringTarget : public TargetInterface {
+ public:
+    explicit StringTarget(std::string *out) : out_(out) {}
+
+    void setup(const std::string & /* unsused */) override {}
+
+    int64_t write(const void *data, size_t length) override {
+        out_->append(static_cast<const char *>(data), length);
+        return static_cast<int64_t>(length);
+    }
+
+    int64_t read(void * /* unsused */, size_t /* unsused */) override {
+        return -1;
+    }
+
+    int64_t seek(int64_t /* unsused */, int /* unsused */) override {
+        return -1;
+    }
+
+    int end() override {
+        return 0;
+    }
+
+ private:
+    std::string *out_;
+};
+
+}  // namespace
+
+VImage process_identified(const std::string &file, const std::string &identity,
+                          const std::string &query, const Config &config) {
+    std::string out_buf;
+    Status status =
+        process(std::make_unique<IdentifiedSource>(file, identity),
+                std::make_unique<StringTarget>(&out_buf), query, config);
+    if (!status.ok()) {
+        throw std::runtime_error(status.message());
+    }
+
+    return VImage::new_from_buffer(out_buf, "");
+}
+
 int main(const int argc, const char *argv[]) {
     Catch::Session session;
 
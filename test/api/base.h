@@ -2,6 +2,8 @@
 
 #include "fixtures.h"
 
+#include <functional>
+#include <utility>
 #include <vips/vips8>
 #include <weserv/api_manager.h>
 #include <weserv/enums.h>
@@ -49,3 +51,34 @@ extern Status process_file(const std::string &file,
                            std::string *out_buf = nullptr,
                            const std::string &query = "",
                            const Config &config = Config());
+
+/**
+ * Process a file through a source that claims the given identity, as the
+ * caches that are keyed by the identity of the source require.
+ */
+extern VImage process_identified(const std::string &file,
+                                 const std::string &identity,
+                                 const std::string &query = "",
+                                 const Config &config = Config());
+
+/**
+ * Sets the size of a process-wide cache for the duration of a scope, and
+ * disables the cache again once it ends, even if an assertion fails.
+ */
+class CacheSizeGuard {
+ public:
+    CacheSizeGuard(std::function<void(size_t)> set_size, size_t size)
+        : set_size_(std::move(set_size)) {
+        set_size_(size);
+    }
+
+    ~CacheSizeGuard() {
+        set_size_(0);
+    }
+
+    CacheSizeGuard(const CacheSizeGuard &) = delete;
+    CacheSizeGuard &operator=(const CacheSizeGuard &) = delete;
+
+ private:
+    std::function<void(size_t)> set_size_;
+};
@@ -81,3 +81,44 @@ TEST_CASE("query ignore", "[query]") {
         CHECK(image.width() == 200);
     }
 }
+
+TEST_CASE("query canonical", "[query]") {
+    SECTION("sorted keys") {
+        CHECK_THAT(api_manager->canonical_query("w=300&h=200&q=80"),
+                   Equals("h=200&q=80&w=300"));
+    }
+
+    SECTION("synonyms") {
+        CHECK_THAT(api_manager->canonical_query("width=300&quality=80"),
+                   Equals("q=80&w=300"));
+    }
+
+    SECTION("defaults") {
+        CHECK_THAT(api_manager->canonical_query("w=300&h=0&q=80"),
+                   Equals("q=80&w=300"));
+        CHECK_THAT(api_manager->canonical_query("w=300&dpr=1&flip=false"),
+                   Equals("w=300"));
+        CHECK_THAT(api_manager->canonical_query("sharp=1,2,3"),
+                   Equals("sharp=3"));
+    }
+
+    SECTION("invalid values") {
+        CHECK_THAT(api_manager->canonical_query("w=300&q=120&bri=-200"),
+                   Equals("w=300"));
+        CHECK_THAT(api_manager->canonical_query("n=0&trim=255"), Equals(""));
+    }
+
+    SECTION("numeric formatting") {
+        CHECK_THAT(api_manager->canonical_query("q=80&w=300.0"),
+                   Equals("q=80&w=300"));
+        CHECK_THAT(api_manager->canonical_query("dpr=2.50&w=50%25"),
+                   Equals("dpr=2.5&w=50%"));
+        CHECK_THAT(api_manager->canonical_query("bg=red"),
+                   Equals("bg=ffff0000"));
+    }
+
+    SECTION("flags") {
+        CHECK_THAT(api_manager->canonical_query("we=true&fsol=0"),
+                   Equals("fsol=0&we"));
+    }
+}
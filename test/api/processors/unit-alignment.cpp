@@ -1,6 +1,7 @@
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/matchers/catch_matchers_string.hpp>
 
+#include "../../../src/api/processors/saliency.h"
 #include "../base.h"
 #include "../similar_image.h"
 
@@ -8,6 +9,7 @@
 
 using Catch::Matchers::Equals;
 using vips::VImage;
+using weserv::api::processors::Saliency;
 
 TEST_CASE("crop positions", "[alignment]") {
     struct CropPosition {
@@ -220,6 +222,114 @@ TEST_CASE("attention crop", "[alignment]") {
 
         CHECK_THAT(image, is_similar_image(expected_image));
     }
+
+    SECTION("downscaled search") {
+        auto test_image = fixtures->input_jpg;
+        auto expected_image =
+            fixtures->expected_dir + "/crop-strategy-attention.jpg";
+        auto params = "w=80&h=320&fit=cover&a=attention";
+        auto config = Config();
+        config.smartcrop_size = 256;
+
+        VImage image = process_file<VImage>(test_image, params, config);
+
+        CHECK(image.bands() == 3);
+        CHECK(image.width() == 80);
+        CHECK(image.height() == 320);
+        CHECK(!image.has_alpha());
+
+        CHECK_THAT(image, is_similar_image(expected_image));
+    }
+}
+
+TEST_CASE("saliency cache", "[alignment]") {
+    CacheSizeGuard guard(
+        [](size_t size) { api_manager->set_saliency_cache_size(size); }, 16);
+
+    auto test_image = fixtures->input_jpg;
+
+    // The cached copy is downscaled to 256 pixels, as if that was configured
+    auto config = Config();
+    config.smartcrop_size = 256;
+
+    SECTION("attention") {
+        auto params = "w=80&h=320&fit=cover&a=attention";
+
+        VImage expected = process_file<VImage>(test_image, params, config);
+        VImage image =
+            process_identified(test_image, "saliency-attention", params);
+
+        CHECK(image.width() == 80);
+        CHECK(image.height() == 320);
+
+        CHECK_THAT(image, is_similar_image(expected));
+
+        // Another crop of the same image is searched on the cached copy
+        auto hits = Saliency::cache_hits();
+        params = "w=320&h=80&fit=cover&a=attention";
+
+        expected = process_file<VImage>(test_image, params, config);
+        image = process_identified(test_image, "saliency-attention", params);
+
+        CHECK(Saliency::cache_hits() > hits);
+        CHECK(image.width() == 320);
+        CHECK(image.height() == 80);
+
+        CHECK_THAT(image, is_similar_image(expected));
+    }
+
+    SECTION("entropy") {
+        auto params = "w=80&h=320&fit=cover&a=entropy";
+
+        VImage expected = process_file<VImage>(test_image, params, config);
+        VImage image = process_identified(test_image, "saliency-entropy", params);
+
+        CHECK(image.width() == 80);
+        CHECK(image.height() == 320);
+
+        CHECK_THAT(image, is_similar_image(expected));
+
+        auto hits = Saliency::cache_hits();
+        params = "w=200&h=200&fit=cover&a=entropy";
+
+        expected = process_file<VImage>(test_image, params, config);
+        image = process_identified(test_image, "saliency-entropy", params);
+
+        CHECK(Saliency::cache_hits() > hits);
+        CHECK(image.width() == 200);
+        CHECK(image.height() == 200);
+
+        CHECK_THAT(image, is_similar_image(expected));
+    }
+
+    SECTION("focal point defaults to attention") {
+        VImage expected = process_identified(
+            test_image, "saliency-focal", "w=80&h=320&fit=cover&a=attention");
+
+        // Without a focal point, the cached copy tells where to focus
+        auto hits = Saliency::cache_hits();
+        VImage image = process_identified(test_image, "saliency-focal",
+                                          "w=80&h=320&fit=cover&a=focal");
+
+        CHECK(Saliency::cache_hits() > hits);
+        CHECK(image.width() == 80);
+        CHECK(image.height() == 320);
+
+        CHECK_THAT(image, is_similar_image(expected));
+    }
+
+    SECTION("greyscale") {
+        auto test_image = fixtures->input_jpg_with_gamma_holiness;
+        auto params = "w=80&h=80&fit=cover&a=attention";
+
+        VImage expected = process_file<VImage>(test_image, params, config);
+        VImage image = process_identified(test_image, "saliency-grey", params);
+
+        CHECK(image.width() == 80);
+        CHECK(image.height() == 80);
+
+        CHECK_THAT(image, is_similar_image(expected));
+    }
 }
 
 TEST_CASE("animated image", "[alignment]") {
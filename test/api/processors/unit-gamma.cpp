@@ -3,6 +3,8 @@
 #include "../base.h"
 #include "../similar_image.h"
 
+#include <string>
+
 #include <vips/vips8>
 
 using vips::VImage;
@@ -52,6 +54,24 @@ TEST_CASE("gamma", "[gamma]") {
         CHECK_THAT(image, is_similar_image(expected_image));
     }
 
+    SECTION("shrink-on-load") {
+        auto test_image = fixtures->input_jpg;
+        auto params = "w=320&output=png";
+
+        // Gamma correction is applied after the resize, so the image can
+        // still be shrunk on load
+        VImage expected =
+            process_file<VImage>(test_image, params)
+                .gamma(VImage::option()->set("exponent", 1.0 / 2.2));
+        VImage image =
+            process_file<VImage>(test_image, std::string(params) + "&gam=2.2");
+
+        CHECK(image.width() == 320);
+
+        // Allow for rounding when the result is saved
+        CHECK((image - expected).abs().max() <= 1.0);
+    }
+
     SECTION("invalid") {
         auto test_image = fixtures->input_jpg;
         auto params = "gam=1000000000";
@@ -1,11 +1,13 @@
 #include <catch2/catch_test_macros.hpp>
 
+#include "../../../src/api/processors/mask.h"
 #include "../base.h"
 #include "../similar_image.h"
 
 #include <vips/vips8>
 
 using vips::VImage;
+using weserv::api::processors::Mask;
 
 TEST_CASE("mask", "[mask]") {
     SECTION("circle") {
@@ -220,3 +222,65 @@ TEST_CASE("mask", "[mask]") {
         CHECK_THAT(image, is_similar_image(test_image));
     }
 }
+
+TEST_CASE("mask cache", "[mask]") {
+    auto set_cache_size = [](size_t size) {
+        api_manager->set_mask_cache_size(size);
+    };
+
+    SECTION("same as uncached") {
+        auto test_image = fixtures->input_png_overlay_layer_0;
+        auto params = "w=320&h=240&fit=cover&mask=star&mbg=red&output=png";
+
+        VImage expected = process_file<VImage>(test_image, params);
+
+        CacheSizeGuard guard(set_cache_size, 16 * 1024 * 1024);
+
+        // The first request rasterizes the mask, the second takes it from the
+        // cache
+        auto hits = Mask::cache_hits();
+        VImage image = process_file<VImage>(test_image, params);
+        VImage cached = process_file<VImage>(test_image, params);
+
+        CHECK(Mask::cache_hits() > hits);
+        CHECK((image - expected).abs().max() == 0.0);
+        CHECK((cached - expected).abs().max() == 0.0);
+    }
+
+    SECTION("preload") {
+        auto test_image = fixtures->input_jpg;
+        auto params = "w=64&h=64&fit=cover&mask=circle";
+
+        CacheSizeGuard guard(set_cache_size, 16 * 1024 * 1024);
+
+        CHECK(api_manager->preload_mask("mask=circle", 64, 64).ok());
+        CHECK(api_manager->preload_mask("w=64", 64, 64).code() ==
+              static_cast<int>(Status::Code::InvalidUri));
+
+        // The mask is taken from the cache, rather than rasterized again
+        auto hits = Mask::cache_hits();
+        VImage image = process_file<VImage>(test_image, params);
+
+        CHECK(image.width() == 64);
+        CHECK(image.height() == 64);
+        CHECK(Mask::cache_hits() > hits);
+    }
+
+    SECTION("too large to cache") {
+        auto test_image = fixtures->input_jpg;
+        auto params = "w=320&h=240&fit=cover&mask=circle";
+
+        VImage expected = process_file<VImage>(test_image, params);
+
+        // A 320x240 mask doesn't fit in 1 KiB, so it's never cached
+        CacheSizeGuard guard(set_cache_size, 1024);
+
+        auto hits = Mask::cache_hits();
+        VImage image = process_file<VImage>(test_image, params);
+        VImage uncached = process_file<VImage>(test_image, params);
+
+        CHECK(Mask::cache_hits() == hits);
+        CHECK((image - expected).abs().max() == 0.0);
+        CHECK((uncached - expected).abs().max() == 0.0);
+    }
+}
@@ -0,0 +1,93 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include "../base.h"
+
+#include <string>
+#include <vector>
+
+#include <vips/vips8>
+
+using vips::VImage;
+
+TEST_CASE("point operations before embed", "[pipeline]") {
+    SECTION("background") {
+        auto test_image = fixtures->input_jpg;
+        auto params = "w=320&h=320&fit=contain&cbg=white&filt=negate";
+
+        VImage image = process_file<VImage>(test_image, params);
+
+        CHECK(image.width() == 320);
+        CHECK(image.height() == 320);
+        CHECK(image.bands() == 3);
+
+        // The negated background
+        CHECK(image.getpoint(0, 0) == std::vector<double>{0, 0, 0});
+    }
+
+    SECTION("same as after embed") {
+        auto test_image = fixtures->input_jpg;
+        auto params = "w=320&h=320&fit=contain&cbg=red&output=png";
+
+        VImage expected = process_file<VImage>(test_image, params)
+                              .colourspace(VIPS_INTERPRETATION_B_W);
+        VImage image = process_file<VImage>(
+            test_image, std::string(params) + "&filt=greyscale");
+
+        CHECK(image.bands() == expected.bands());
+        CHECK((image - expected).abs().max() == 0.0);
+    }
+
+    SECTION("transparent background") {
+        auto test_image = fixtures->input_jpg;
+        auto params = "w=320&h=320&fit=contain&gam=2.2&output=png";
+
+        VImage image = process_file<VImage>(test_image, params);
+
+        CHECK(image.bands() == 4);
+        CHECK(image.getpoint(0, 0)[3] == 0.0);
+    }
+}
+
+TEST_CASE("fused band operations", "[pipeline]") {
+    SECTION("same as one by one") {
+        auto test_image = fixtures->input_jpg;
+        auto params = "w=320&h=240&fit=cover&output=png";
+
+        VImage expected = process_file<VImage>(test_image, params)
+                              .gamma(VImage::option()->set("exponent", 0.5))
+                              .invert();
+        VImage image = process_file<VImage>(
+            test_image, std::string(params) + "&gam=2&filt=negate");
+
+        CHECK(image.width() == 320);
+        CHECK(image.height() == 240);
+
+        // Allow for rounding when the result is saved
+        CHECK((image - expected).abs().max() <= 1.0);
+    }
+
+    SECTION("alpha is preserved") {
+        auto test_image = fixtures->input_png_with_transparency;
+        auto params = "w=320&h=240&fit=cover";
+
+        VImage expected = process_file<VImage>(test_image, params);
+        VImage image = process_file<VImage>(
+            test_image, std::string(params) + "&gam=2&filt=negate");
+
+        CHECK(image.bands() == 4);
+        CHECK((image[3] - expected[3]).abs().max() == 0.0);
+    }
+}
+
+TEST_CASE("fold no-ops", "[pipeline]") {
+    SECTION("full hue rotation") {
+        auto test_image = fixtures->input_jpg;
+        auto params = "w=320&h=240&fit=cover&output=png";
+
+        VImage expected = process_file<VImage>(test_image, params);
+        VImage image = process_file<VImage>(
+            test_image, std::string(params) + "&hue=360");
+
+        CHECK((image - expected).abs().max() == 0.0);
+    }
+}
@@ -1,6 +1,7 @@
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/matchers/catch_matchers_string.hpp>
 
+#include "../../../src/api/io/page_index.h"
 #include "../base.h"
 
 #include <cstdio>
@@ -11,6 +12,7 @@ using Catch::Matchers::ContainsSubstring;
 using Catch::Matchers::Equals;
 using Catch::Matchers::StartsWith;
 using vips::VImage;
+using weserv::api::io::PageIndex;
 
 TEST_CASE("output", "[stream]") {
     SECTION("jpeg") {
@@ -182,6 +184,69 @@ TEST_CASE("special page", "[stream]") {
         CHECK(image.width() == 125);
         CHECK(image.height() == 25);
     }
+
+    SECTION("largest tiff") {
+        if (vips_type_find("VipsOperation", "tiffload_buffer") == 0 ||
+            vips_type_find("VipsOperation", "tiffsave_buffer") == 0) {
+            SUCCEED("no tiff support, skipping test");
+            return;
+        }
+
+        auto test_image = fixtures->input_tiff_pyramid;
+        auto params = "page=-1";
+
+        VImage image = process_file<VImage>(test_image, params);
+
+        CHECK_THAT(image.get_string("vips-loader"), Equals("tiffload_buffer"));
+
+        CHECK(image.width() == 4000);
+        CHECK(image.height() == 828);
+    }
+}
+
+TEST_CASE("pyramid cache", "[stream]") {
+    if (vips_type_find("VipsOperation", "tiffload_source") == 0) {
+        SUCCEED("no tiff support, skipping test");
+        return;
+    }
+
+    CacheSizeGuard guard(
+        [](size_t size) { api_manager->set_pyramid_cache_size(size); }, 16);
+
+    SECTION("same identity") {
+        auto test_image = fixtures->input_tiff_pyramid;
+        auto params = "page=-2&output=png";
+
+        VImage image = process_identified(test_image, "pyramid-same", params);
+
+        CHECK(image.width() == 125);
+        CHECK(image.height() == 25);
+
+        // The second request takes the layout from the cache, rather than
+        // walking the IFD chain again
+        auto hits = PageIndex::cache_hits();
+        image = process_identified(test_image, "pyramid-same", params);
+
+        CHECK(PageIndex::cache_hits() > hits);
+        CHECK(image.width() == 125);
+        CHECK(image.height() == 25);
+    }
+
+    SECTION("changed image") {
+        VImage image = process_identified(fixtures->input_tiff_pyramid,
+                                          "pyramid-changed",
+                                          "page=-2&output=png");
+
+        CHECK(image.width() == 125);
+        CHECK(image.height() == 25);
+
+        // The cached layout disagrees with the image, so it's rediscovered
+        image = process_identified(fixtures->input_tiff_multi_page,
+                                   "pyramid-changed", "page=-1&output=png");
+
+        CHECK(image.width() == 600);
+        CHECK(image.height() == 75);
+    }
 }
 
 TEST_CASE("quality and compression", "[stream]") {
@@ -53,6 +53,23 @@ TEST_CASE("trim", "[trim]") {
         CHECK_THAT(image, is_similar_image(expected_image));
     }
 
+    SECTION("trim preview keeps shrink-on-load") {
+        auto test_image = fixtures->input_jpg_overlay_layer_2;
+        auto expected_image =
+            fixtures->expected_dir + "/alpha-layer-2-trim-resize.jpg";
+        auto params = "w=300&trim=10";
+        auto config = Config();
+        config.trim_preview = 1;
+
+        VImage image = process_file<VImage>(test_image, params, config);
+
+        CHECK(image.width() == 300);
+        CHECK(image.height() == 300);
+        CHECK(!image.has_alpha());
+
+        CHECK_THAT(image, is_similar_image(expected_image));
+    }
+
     SECTION("aggressive trim returns original image") {
         auto test_image = fixtures->input_png_overlay_layer_0;
         auto params = "trim=200";
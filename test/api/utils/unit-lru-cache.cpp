@@ -0,0 +1,107 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include "../../../src/api/utils/lru_cache.h"
+
+#include <string>
+
+using weserv::api::utils::LruCache;
+
+TEST_CASE("lru cache", "[lru_cache]") {
+    SECTION("disabled by default") {
+        LruCache<int> cache;
+        int value = 0;
+
+        CHECK(!cache.enabled());
+
+        cache.insert("a", 1);
+
+        CHECK(!cache.find("a", &value));
+        CHECK(cache.hits() == 0);
+    }
+
+    SECTION("find") {
+        LruCache<int> cache;
+        cache.set_max_size(2);
+
+        cache.insert("a", 1);
+
+        int value = 0;
+        CHECK(cache.find("a", &value));
+        CHECK(value == 1);
+        CHECK(!cache.find("b", &value));
+        CHECK(cache.hits() == 1);
+    }
+
+    SECTION("keeps the first value of a key") {
+        LruCache<int> cache;
+        cache.set_max_size(2);
+
+        cache.insert("a", 1);
+        cache.insert("a", 2);
+
+        int value = 0;
+        CHECK(cache.find("a", &value));
+        CHECK(value == 1);
+    }
+
+    SECTION("evicts the least recently used entry") {
+        LruCache<int> cache;
+        cache.set_max_size(2);
+
+        cache.insert("a", 1);
+        cache.insert("b", 2);
+
+        // Mark "a" as most recently used, so that "b" is evicted
+        int value = 0;
+        CHECK(cache.find("a", &value));
+
+        cache.insert("c", 3);
+
+        CHECK(cache.find("a", &value));
+        CHECK(!cache.find("b", &value));
+        CHECK(cache.find("c", &value));
+    }
+
+    SECTION("evicts by cost") {
+        LruCache<std::string> cache(
+            [](const std::string &value) { return value.size(); });
+        cache.set_max_size(8);
+
+        CHECK(cache.fits(8));
+        CHECK(!cache.fits(9));
+
+        cache.insert("a", "1234");
+        cache.insert("b", "1234");
+        cache.insert("c", "12");
+
+        std::string value;
+        CHECK(!cache.find("a", &value));
+        CHECK(cache.find("b", &value));
+        CHECK(cache.find("c", &value));
+
+        // Too large to be cached, nothing is evicted for it
+        cache.insert("d", "123456789");
+
+        CHECK(!cache.find("d", &value));
+        CHECK(cache.find("b", &value));
+    }
+
+    SECTION("shrinking evicts") {
+        LruCache<int> cache;
+        cache.set_max_size(2);
+
+        cache.insert("a", 1);
+        cache.insert("b", 2);
+
+        cache.set_max_size(1);
+
+        int value = 0;
+        CHECK(!cache.find("a", &value));
+        CHECK(cache.find("b", &value));
+
+        cache.set_max_size(0);
+
+        CHECK(!cache.enabled());
+        CHECK(!cache.find("b", &value));
+    }
+}
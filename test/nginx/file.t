@@ -2,7 +2,7 @@
 
 use Test::Nginx::Socket;
 
-plan tests => repeat_each() * (blocks() * 5);
+plan tests => repeat_each() * (blocks() * 5 + 20);
 
 $ENV{TEST_NGINX_HTML_DIR} ||= html_dir();
 
@@ -16,6 +16,14 @@ our $TestGif = unhex(qq{
 0x0020:  01 00 01 00 00 02 02 4c  01 00 3b                 |.......L ..;|
 });
 
+# The same image, claiming a logical screen of 100x100 pixels
+our $TestLargeGif = $TestGif;
+substr($TestLargeGif, 6, 4, pack("v2", 100, 100));
+
+# The header of a WebP image with a canvas of 100x100 pixels
+our $TestLargeWebp = "RIFF" . pack("V", 22) . "WEBP" . "VP8X" . pack("V", 10)
+    . pack("V", 0) . substr(pack("V", 99), 0, 3) . substr(pack("V", 99), 0, 3);
+
 sub unhex {
     my ($input) = @_;
     my $buffer = '';
@@ -100,3 +108,415 @@ $::TestGif"
 --- no_error_log
 [error]
 [warn]
+
+
+=== TEST 4: GIF output - thread pool
+--- http_config eval: $::HttpConfig
+--- config
+    location /images {
+        weserv filter;
+        weserv_thread_pool default;
+        alias $TEST_NGINX_HTML_DIR;
+    }
+--- request
+    GET /images/test.gif
+--- user_files eval
+">>> test.gif
+$::TestGif"
+--- response_headers
+Content-Disposition: inline; filename=image.gif
+--- response_body_filters eval
+\&::gif_size
+--- response_body: 1 1
+--- no_error_log
+[error]
+[warn]
+
+
+=== TEST 5: GIF output - streaming input
+--- http_config eval: $::HttpConfig
+--- config
+    location /images {
+        weserv filter;
+        weserv_thread_pool default;
+        weserv_stream_input on;
+        alias $TEST_NGINX_HTML_DIR;
+    }
+--- request
+    GET /images/test.gif
+--- user_files eval
+">>> test.gif
+$::TestGif"
+--- response_headers
+Content-Disposition: inline; filename=image.gif
+--- response_body_filters eval
+\&::gif_size
+--- response_body: 1 1
+--- no_error_log
+[error]
+[warn]
+
+
+=== TEST 6: GIF output - result cache
+--- http_config eval: $::HttpConfig
+--- config
+    location /images {
+        weserv filter;
+        weserv_cache zone=images:1m;
+        add_header X-Cache-Status $weserv_cache_status;
+        alias $TEST_NGINX_HTML_DIR;
+    }
+--- request eval
+["GET /images/test.gif", "GET /images/test.gif"]
+--- user_files eval
+">>> test.gif
+$::TestGif"
+--- response_headers eval
+["X-Cache-Status: MISS", "X-Cache-Status: HIT"]
+--- response_body_filters eval
+\&::gif_size
+--- response_body eval
+["1 1", "1 1"]
+--- no_error_log
+[error]
+[warn]
+
+
+=== TEST 7: GIF output - modified
+--- http_config eval: $::HttpConfig
+--- config
+    location /images {
+        weserv filter;
+        alias $TEST_NGINX_HTML_DIR;
+    }
+--- request
+    GET /images/test.gif
+--- more_headers
+If-None-Match: "0123456789abcdef0123456789abcdef"
+--- user_files eval
+">>> test.gif
+$::TestGif"
+--- response_headers_like
+ETag: "[0-9a-f]{32}"
+--- response_body_filters eval
+\&::gif_size
+--- response_body: 1 1
+--- error_code: 200
+--- no_error_log
+[error]
+[warn]
+
+
+=== TEST 8: GIF output - too many pixels
+--- http_config eval: $::HttpConfig
+--- config
+    location /images {
+        weserv filter;
+        weserv_limit_input_pixels 1000;
+        alias $TEST_NGINX_HTML_DIR;
+    }
+--- request
+    GET /images/test.gif
+--- user_files eval
+">>> test.gif
+$::TestLargeGif"
+--- response_headers
+!Content-Disposition
+--- response_body_like: exceeds pixel limit
+--- error_code: 404
+--- error_log
+too many pixels: 100x100
+--- no_error_log
+[warn]
+
+
+=== TEST 9: GIF output - admission control
+--- http_config eval: $::HttpConfig
+--- config
+    location /images {
+        weserv filter;
+        weserv_admission 1 queue=0;
+        alias $TEST_NGINX_HTML_DIR;
+    }
+--- request
+    GET /images/test.gif
+--- user_files eval
+">>> test.gif
+$::TestGif"
+--- response_headers
+Content-Disposition: inline; filename=image.gif
+--- response_body_filters eval
+\&::gif_size
+--- response_body: 1 1
+--- no_error_log
+[error]
+[warn]
+
+
+=== TEST 10: JSON output - priority lane
+--- http_config eval: $::HttpConfig
+--- config
+    location /images {
+        weserv filter;
+        weserv_priority default output=json;
+        alias $TEST_NGINX_HTML_DIR;
+    }
+--- request
+    GET /images/test.gif?output=json
+--- user_files eval
+">>> test.gif
+$::TestGif"
+--- response_headers
+!Content-Disposition
+--- response_body_like: ^.*"format":"gif","width":1,"height":1,.*$
+--- no_error_log
+[error]
+[warn]
+
+
+=== TEST 11: WebP output - negotiated
+--- http_config eval: $::HttpConfig
+--- config
+    location /images {
+        weserv filter;
+        weserv_auto_output on;
+        alias $TEST_NGINX_HTML_DIR;
+    }
+--- request
+    GET /images/test.gif
+--- more_headers
+Accept: image/webp,*/*
+--- user_files eval
+">>> test.gif
+$::TestGif"
+--- response_headers
+Content-Type: image/webp
+Vary: Accept
+--- response_body_like: ^RIFF
+--- no_error_log
+[error]
+
+
+=== TEST 12: GIF output - client hints
+--- http_config eval: $::HttpConfig
+--- config
+    location /images {
+        weserv filter;
+        weserv_client_hints on;
+        alias $TEST_NGINX_HTML_DIR;
+    }
+--- request
+    GET /images/test.gif
+--- more_headers
+Sec-CH-Width: 200
+--- user_files eval
+">>> test.gif
+$::TestGif"
+--- response_headers
+Accept-CH: Sec-CH-Width, Sec-CH-Viewport-Width, Sec-CH-DPR
+Vary: Sec-CH-Width, Sec-CH-Viewport-Width, Sec-CH-DPR, Save-Data
+--- response_body_filters eval
+\&::gif_size
+--- response_body: 1 1
+--- no_error_log
+[error]
+
+
+=== TEST 13: GIF output - not modified
+--- http_config eval
+qq{
+    $::HttpConfig
+    proxy_cache_path $ENV{TEST_NGINX_HTML_DIR}/cache levels=1 keys_zone=front:1m;
+}
+--- config
+    # Once expired, the cached response is revalidated by sending its ETag in
+    # If-None-Match
+    location /front {
+        proxy_pass http://127.0.0.1:$TEST_NGINX_SERVER_PORT/images/test.gif;
+        proxy_cache front;
+        proxy_cache_revalidate on;
+        add_header X-Cache-Status $upstream_cache_status;
+    }
+
+    location /images {
+        weserv filter;
+        add_header X-Accel-Expires @1;
+        alias $TEST_NGINX_HTML_DIR;
+    }
+--- request eval
+["GET /front", "GET /front"]
+--- user_files eval
+">>> test.gif
+$::TestGif"
+--- response_headers eval
+["X-Cache-Status: MISS", "X-Cache-Status: REVALIDATED"]
+--- response_body_filters eval
+\&::gif_size
+--- response_body eval
+["1 1", "1 1"]
+--- no_error_log
+[error]
+[warn]
+
+
+=== TEST 14: WebP output - too many pixels
+--- http_config eval: $::HttpConfig
+--- config
+    location /images {
+        weserv filter;
+        weserv_limit_input_pixels 1000;
+        alias $TEST_NGINX_HTML_DIR;
+    }
+--- request
+    GET /images/test.webp
+--- user_files eval
+">>> test.webp
+$::TestLargeWebp"
+--- response_headers
+!Content-Disposition
+--- response_body_like: exceeds pixel limit
+--- error_code: 404
+--- error_log
+too many pixels: 100x100
+--- no_error_log
+[warn]
+
+
+=== TEST 15: GIF output - too many pixels on a selected page
+--- http_config eval: $::HttpConfig
+--- config
+    location /images {
+        weserv filter;
+        weserv_limit_input_pixels 1000;
+        alias $TEST_NGINX_HTML_DIR;
+    }
+--- request
+    GET /images/test.gif?page=0
+--- user_files eval
+">>> test.gif
+$::TestLargeGif"
+--- response_headers
+!Content-Disposition
+--- response_body_like: exceeds pixel limit
+--- error_code: 404
+--- no_error_log
+weserv image filter: too many pixels
+[warn]
+
+
+=== TEST 16: WebP output - negotiated across Accept headers
+--- http_config eval: $::HttpConfig
+--- config
+    location /images {
+        weserv filter;
+        weserv_auto_output on;
+        alias $TEST_NGINX_HTML_DIR;
+    }
+--- request
+    GET /images/test.gif
+--- more_headers
+Accept: text/html,application/xhtml+xml
+Accept: image/webp,*/*
+--- user_files eval
+">>> test.gif
+$::TestGif"
+--- response_headers
+Content-Type: image/webp
+Vary: Accept
+--- response_body_like: ^RIFF
+--- no_error_log
+[error]
+
+
+=== TEST 17: GIF output - escaped cache key
+--- http_config eval: $::HttpConfig
+--- config
+    location /images {
+        weserv filter;
+        add_header X-Cache-Key $weserv_cache_key;
+        alias $TEST_NGINX_HTML_DIR;
+    }
+--- request
+    GET /images/test.gif?filename=a%2Db%26c
+--- user_files eval
+">>> test.gif
+$::TestGif"
+--- response_headers
+Content-Type: image/gif
+X-Cache-Key: filename=a-b%26c
+--- response_body_filters eval
+\&::gif_size
+--- response_body: 1 1
+--- no_error_log
+[error]
+
+
+=== TEST 18: GIF output - result cache of a deleted image
+--- http_config eval: $::HttpConfig
+--- config
+    location /images {
+        weserv filter;
+        weserv_cache zone=images:1m;
+        alias $TEST_NGINX_HTML_DIR;
+    }
+
+    # Shares the cache key of /images, but the image no longer exists
+    location /deleted {
+        rewrite ^/deleted(.*)$ /images$1 break;
+        weserv filter;
+        weserv_cache zone=images;
+        root $TEST_NGINX_HTML_DIR/deleted;
+        log_not_found off;
+    }
+--- request eval
+["GET /images/test.gif", "GET /deleted/test.gif"]
+--- user_files eval
+">>> test.gif
+$::TestGif"
+--- response_headers eval
+["Content-Type: image/gif", "Content-Type: application/json"]
+--- response_body_like eval
+["^GIF89a", '^.*"code":404,.*$']
+--- error_code eval
+[200, 404]
+--- no_error_log
+[error]
+[warn]
+
+
+=== TEST 19: GIF output - not modified by an equivalent query
+--- http_config eval
+qq{
+    $::HttpConfig
+    proxy_cache_path $ENV{TEST_NGINX_HTML_DIR}/cache levels=1 keys_zone=front:1m;
+}
+--- config
+    # Both queries share the cached response, which is only revalidated if
+    # they share the ETag as well
+    location /front {
+        proxy_pass http://127.0.0.1:$TEST_NGINX_SERVER_PORT/images/test.gif$is_args$args;
+        proxy_cache front;
+        proxy_cache_key $uri;
+        proxy_cache_revalidate on;
+        add_header X-Cache-Status $upstream_cache_status;
+    }
+
+    location /images {
+        weserv filter;
+        add_header X-Accel-Expires @1;
+        alias $TEST_NGINX_HTML_DIR;
+    }
+--- request eval
+["GET /front?w=1&h=1", "GET /front?h=1&w=1"]
+--- user_files eval
+">>> test.gif
+$::TestGif"
+--- response_headers eval
+["X-Cache-Status: MISS", "X-Cache-Status: REVALIDATED"]
+--- response_body_filters eval
+\&::gif_size
+--- response_body eval
+["1 1", "1 1"]
+--- no_error_log
+[error]
+[warn]
@@ -4,10 +4,11 @@ use Test::Nginx::Socket;
 use Test::Nginx::Util qw($ServerPort $ServerAddr);
 use IO::Compress::Gzip qw(gzip);
 
-plan tests => repeat_each() * (blocks() * 6 - 1);
+plan tests => repeat_each() * (blocks() * 5 + 34);
 
 $ENV{TEST_NGINX_HTML_DIR} ||= html_dir();
 $ENV{TEST_NGINX_URI} = "http://$ServerAddr:$ServerPort";
+$ENV{TEST_NGINX_ORIGIN} = "http://origin.localhost:$ServerPort";
 $ENV{TEST_NGINX_SVG} = '<svg viewBox="0 0 1 1"></svg>';
 
 our $HttpConfig = qq{
@@ -17,6 +18,17 @@ our $HttpConfig = qq{
 our $TestSvgGzip;
 gzip \$ENV{TEST_NGINX_SVG} => \$TestSvgGzip;
 
+# Answers a DNS query for an A record with the address of the test server
+our $DnsReply = sub {
+    my $query = shift;
+
+    # Echo the ID and the question, followed by a single answer that points
+    # to the name in the question
+    return substr($query, 0, 2) . pack('n5', 0x8180, 1, 1, 0, 0)
+        . substr($query, 12) . pack('n3Nn', 0xc00c, 1, 1, 60, 4)
+        . pack('C4', split(/\./, $ServerAddr));
+};
+
 no_long_string();
 #no_diff();
 
@@ -201,3 +213,220 @@ $::TestSvgGzip"
 --- no_error_log
 [error]
 [warn]
+
+
+=== TEST 7: origin cache
+--- http_config eval
+qq{
+    $::HttpConfig
+    weserv_origin_cache zone=origin:1m;
+    log_format origin 'origin fetch: \$status';
+}
+--- config
+    location /static {
+        add_header Cache-Control 'max-age=60';
+        access_log logs/error.log origin;
+        alias $TEST_NGINX_HTML_DIR;
+    }
+
+    location /images {
+        weserv proxy;
+    }
+--- user_files eval
+">>> test.svg
+$ENV{TEST_NGINX_SVG}"
+--- request eval
+["GET /images?url=$ENV{TEST_NGINX_URI}/static/test.svg&output=json", "GET /images?url=$ENV{TEST_NGINX_URI}/static/test.svg&w=1&output=json"]
+--- response_headers eval
+['Content-Type: application/json', 'Content-Type: application/json']
+--- response_body_like eval
+['^.*"format":"svg","width":1,"height":1,.*$', '^.*"format":"svg","width":1,"height":1,.*$']
+--- grep_error_log eval: qr/origin fetch: \d+/
+--- grep_error_log_out eval
+["origin fetch: 200\n", ""]
+--- no_error_log
+[error]
+[warn]
+
+
+=== TEST 8: result cache with lock
+--- http_config eval
+qq{
+    $::HttpConfig
+    weserv_cache zone=images:1m;
+    weserv_cache_lock on;
+}
+--- config
+    location /static {
+        alias $TEST_NGINX_HTML_DIR;
+    }
+
+    location /images {
+        weserv proxy;
+    }
+--- user_files eval
+">>> test.svg
+$ENV{TEST_NGINX_SVG}"
+--- request eval
+"GET /images?url=$ENV{TEST_NGINX_URI}/static/test.svg&output=json"
+--- response_headers
+Content-Type: application/json
+--- response_body_like: ^.*"format":"svg","width":1,"height":1,.*$
+--- no_error_log
+[error]
+[warn]
+
+
+=== TEST 9: origin keepalive
+--- http_config eval
+qq{
+    $::HttpConfig
+    weserv_origin_keepalive 8;
+    log_format origin 'origin connection requests: \$connection_requests';
+}
+--- config
+    # The second image is requested over the connection of the first one
+    location /static {
+        access_log logs/error.log origin;
+        alias $TEST_NGINX_HTML_DIR;
+    }
+
+    location /images {
+        weserv proxy;
+    }
+--- user_files eval
+">>> test.svg
+$ENV{TEST_NGINX_SVG}"
+--- request eval
+["GET /images?url=$ENV{TEST_NGINX_URI}/static/test.svg&output=json", "GET /images?url=$ENV{TEST_NGINX_URI}/static/test.svg&w=1&output=json"]
+--- response_headers eval
+['Content-Type: application/json', 'Content-Type: application/json']
+--- response_body_like eval
+['^.*"format":"svg","width":1,"height":1,.*$', '^.*"format":"svg","width":1,"height":1,.*$']
+--- grep_error_log eval: qr/origin connection requests: \d+/
+--- grep_error_log_out eval
+["origin connection requests: 1\n", "origin connection requests: 2\n"]
+--- no_error_log
+[error]
+[warn]
+
+
+=== TEST 10: result cache with lock - concurrent request
+--- http_config eval
+qq{
+    $::HttpConfig
+    weserv_cache zone=images:1m;
+    weserv_cache_lock on;
+    log_format origin 'origin fetch: \$status';
+    log_format images 'weserv cache status: \$weserv_cache_status';
+}
+--- config
+    log_subrequest on;
+
+    location /static {
+        access_log logs/error.log origin;
+        alias $TEST_NGINX_HTML_DIR;
+    }
+
+    # The mirror requests the same image while the lock is held, it waits for
+    # the image to be cached
+    location /images {
+        mirror /mirror;
+        access_log logs/error.log images;
+        weserv proxy;
+    }
+
+    location /mirror {
+        internal;
+        access_log logs/error.log images;
+        weserv proxy;
+    }
+--- user_files eval
+">>> test.svg
+$ENV{TEST_NGINX_SVG}"
+--- request eval
+"GET /images?url=$ENV{TEST_NGINX_URI}/static/test.svg&output=json"
+--- response_headers
+Content-Type: application/json
+--- response_body_like: ^.*"format":"svg","width":1,"height":1,.*$
+--- error_log
+weserv cache status: MISS
+weserv cache status: HIT
+--- grep_error_log eval: qr/origin fetch: \d+/
+--- grep_error_log_out
+origin fetch: 200
+--- no_error_log
+[error]
+[warn]
+
+
+=== TEST 11: origin cache - revalidate a stale image
+--- http_config eval
+qq{
+    $::HttpConfig
+    weserv_origin_cache zone=origin:1m;
+    log_format origin 'origin fetch: \$status';
+}
+--- config
+    location /static {
+        add_header Cache-Control 'max-age=0';
+        access_log logs/error.log origin;
+        alias $TEST_NGINX_HTML_DIR;
+    }
+
+    location /images {
+        weserv proxy;
+    }
+--- user_files eval
+">>> test.svg
+$ENV{TEST_NGINX_SVG}"
+--- request eval
+["GET /images?url=$ENV{TEST_NGINX_URI}/static/test.svg&output=json", "GET /images?url=$ENV{TEST_NGINX_URI}/static/test.svg&w=1&output=json"]
+--- response_headers eval
+['Content-Type: application/json', 'Content-Type: application/json']
+--- response_body_like eval
+['^.*"format":"svg","width":1,"height":1,.*$', '^.*"format":"svg","width":1,"height":1,.*$']
+--- grep_error_log eval: qr/origin fetch: \d+/
+--- grep_error_log_out eval
+["origin fetch: 200\n", "origin fetch: 304\n"]
+--- no_error_log
+[error]
+[warn]
+
+
+=== TEST 12: resolver cache
+--- http_config eval
+qq{
+    $::HttpConfig
+    weserv_resolver_cache zone=dns:1m;
+}
+--- config
+    location /static {
+        alias $TEST_NGINX_HTML_DIR;
+    }
+
+    location /images {
+        resolver 127.0.0.1:1953 ipv6=off;
+        weserv proxy;
+    }
+
+    # Nothing listens on this resolver, the address must come from the cache
+    location /cached {
+        resolver 127.0.0.1:1954 ipv6=off;
+        resolver_timeout 1s;
+        weserv proxy;
+    }
+--- udp_listen: 1953
+--- udp_reply eval: $::DnsReply
+--- user_files eval
+">>> test.svg
+$ENV{TEST_NGINX_SVG}"
+--- request eval
+["GET /images?url=$ENV{TEST_NGINX_ORIGIN}/static/test.svg&output=json", "GET /cached?url=$ENV{TEST_NGINX_ORIGIN}/static/test.svg&output=json"]
+--- response_headers eval
+['Content-Type: application/json', 'Content-Type: application/json']
+--- response_body_like eval
+['^.*"format":"svg","width":1,"height":1,.*$', '^.*"format":"svg","width":1,"height":1,.*$']
+--- no_error_log
+[error]
+[warn]